@@ -17,7 +17,10 @@ void ActorClient::onStart()
 	ActorObject *pObj = new ActorObject;
 	pObj->registerFactory("FileSystem", IFactoryPtr(new Factory<FileSystemObject>()));
 
-	DualRPC::FutureResultPtr f = globalObject()->call("login", 
+	//Answered ahead of transfers running on the connection
+	boost::shared_ptr<DualRPC::RemoteObject> server = 
+		boost::static_pointer_cast<DualRPC::RemoteObject, DualRPC::IObject>(globalObject());
+	DualRPC::FutureResultPtr f = server->call(DualRPC::PRIORITY_CONTROL, "login", 
 		DualRPC::Variant("login", int(0)).
 		add("type", int(1)).
 		add("name", "Actor").
@@ -24,17 +24,25 @@ DualRPC::Variant FileSystemObject::listDir(const DualRPC::Variant &args)
 FileObject::FileObject(const char *name, std::ios_base::openmode mode) :
 	m_stream(name, mode)
 {
-	registerMethod("read", boost::bind(&FileObject::read, this, _1));
+	registerViewMethod("read", boost::bind(&FileObject::read, this, _1));
 	registerMethod("write", boost::bind(&FileObject::write, this, _1));
 
 	m_stream.exceptions(std::ifstream::failbit | std::ifstream::badbit);
 }
 
-DualRPC::Variant FileObject::read(const DualRPC::Variant &args)
+DualRPC::Variant FileObject::read(const DualRPC::VariantView &args)
 {
-	__int64 size = args.item("size", -1).toInt();
-	__int64 seek = args.item("seek", -1).toInt();
-	m_writer = args.item("writer", DualRPC::IObjectPtr()).toObject();
+	DualRPC::VariantView v = args.item("size");
+	__int64 size = v.isNull() ? -1 : v.toInt();
+	v = args.item("seek");
+	__int64 seek = v.isNull() ? -1 : v.toInt();
+	v = args.item("writer");
+	m_writer = v.isNull() ? DualRPC::IObjectPtr() : v.toObject();
+	//Blocks of the file do not hold up other messages of the connection
+	boost::shared_ptr<DualRPC::RemoteObject> remote = 
+		boost::dynamic_pointer_cast<DualRPC::RemoteObject, DualRPC::IObject>(m_writer);
+	if(remote)
+		remote->setPriority(DualRPC::PRIORITY_BULK);
 
 	if(size < 0)
 	{
@@ -60,13 +68,13 @@ DualRPC::Variant FileObject::read(const DualRPC::Variant &args)
 
 DualRPC::Variant FileObject::readBlock(__int64 size)
 {
-	DualRPC::Variant res("");
-	std::string &data = res.getString();
+	std::string data;
 	data.resize(int(size));
-	m_stream.read(&data[0], size);
+	if(size > 0)
+		m_stream.read(&data[0], size);
 	__int64 c = m_stream.gcount();
 	data.resize(int(c));
-	return res;
+	return DualRPC::Variant::fromBytes(std::move(data));
 }
 
 DualRPC::Variant FileObject::iterRead(__int64 restsize, __int64 lastsize, 
@@ -74,7 +82,7 @@ DualRPC::Variant FileObject::iterRead(__int64 restsize, __int64 lastsize,
 {
 	if(restsize == 0)
 	{
-		m_readResult->callback(DualRPC::Variant(""));
+		m_readResult->callback(DualRPC::Variant::fromBytes(std::string()));
 	}
 	else
 	{
@@ -41,18 +41,18 @@ class FileObject : public DualRPC::LocalObject
 public:
 	FileObject(const char *name, std::ios_base::openmode mode);
 
-	DualRPC::Variant read(const DualRPC::Variant &args);
+	DualRPC::Variant read(const DualRPC::VariantView &args);
 	/*
 	Читает данные из файла.
 	Входной параметр: map
 		size:int=-1 - размер читаемых данных (по умолчанию весь файл)
 		seek:int=-1 - позиция, откуда производится чтение (по умолчанию с текущего места)
 		writer:object=null - объект с безымянным методом, который будет вызываться 
-			с параметром string, содержащим блок данных произвольного размера, некоторое
+			с параметром bytes, содержащим блок данных произвольного размера, некоторое
 			кол-во раз, пока не будет передано size байт файла; 
 			после этого функция вернет пустую строку 
 			(по умолчанию объекта нет и функция возвращает запрошенную порцию данных)
-	Выходной параметр: string - прочитанные данные
+	Выходной параметр: bytes - прочитанные данные
 	*/
 
 	DualRPC::Variant write(const DualRPC::Variant &args);
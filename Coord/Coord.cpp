@@ -38,6 +38,11 @@ int _tmain(int argc, _TCHAR* argv[])
 	sqlite3 *pDb;
 	sqlite3_open("", &pDb);
 
+	//Managers pulling large files over slow links are paused before the
+	//Coord runs out of memory. Declared first, it outlives the clients
+	//that report to it
+	DualRPC::MemoryGovernor governor(512*1024*1024);
+
 	boost::asio::io_service io_service;	
 
 	DualRPC::ObjectsStorage storage;
@@ -46,9 +51,12 @@ int _tmain(int argc, _TCHAR* argv[])
 
 	DualRPC::AsioServer server(io_service, storage);
 	server.setMaxMessageSize(50*1024*1024);
+	server.setArenaMode(true);
+	server.setMemoryGovernor(&governor);
 	server.listen("0.0.0.0", 6000);
 
-	io_service.run();
+	//A thread per core, sessions are served in parallel
+	DualRPC::runIoService(io_service);
 	return 0;
 }
 
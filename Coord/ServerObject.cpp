@@ -23,9 +23,11 @@ DualRPC::Variant GlobalServerObject::login(const DualRPC::Variant &args)
 	info.type = ClientType(args.item("type").toInt());
 	info.objectPtr = args.item("object").toObject();
 
+	boost::mutex::scoped_lock lock(m_clientsMutex);
 	if(info.id == 0)
 		info.id = getNextClientID();
 	m_clients[info.id] = info;
+	lock.unlock();
 
 	return DualRPC::Variant("login", (int)info.id).
 		add("object", DualRPC::IObjectPtr(new ServerObject(shared_from_this())));
@@ -54,14 +56,15 @@ DualRPC::Variant ServerObject::enumClients(const DualRPC::Variant &args)
 {
 	DualRPC::Variant res;
 	unsigned int group = (unsigned int)args.toInt();
+	boost::mutex::scoped_lock lock(m_parent->m_clientsMutex);
 	for(auto it = m_parent->m_clients.begin(); it != m_parent->m_clients.end(); ++it)
 	{
-		res.add(DualRPC::Variant("id", (int)it->second.id).
-			add("name", it->second.name).
+		DualRPC::Variant client("id", (int)it->second.id);
+		client.add("name", it->second.name).
 			add("type", int(it->second.type)).
 			add("domain", it->second.domain).
-			add("group", 0)
-		);		
+			add("group", 0);
+		res.add(std::move(client));
 	}
 	return res;
 }
@@ -69,6 +72,7 @@ DualRPC::Variant ServerObject::enumClients(const DualRPC::Variant &args)
 DualRPC::Variant ServerObject::clientObject(const DualRPC::Variant &args)
 {
 	unsigned int id = (unsigned int)args.toInt();
+	boost::mutex::scoped_lock lock(m_parent->m_clientsMutex);
 	GlobalServerObject::ClientInfoMap::iterator it = m_parent->m_clients.find(id);
 	return (it == m_parent->m_clients.end()) ? DualRPC::Variant() : it->second.objectPtr;
 }
@@ -2,6 +2,7 @@
 
 #include "objects.h"
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/thread/mutex.hpp>
 
 class GlobalServerObject : public DualRPC::LocalObject, 
 						public boost::enable_shared_from_this<GlobalServerObject>
@@ -41,6 +42,8 @@ class GlobalServerObject : public DualRPC::LocalObject,
 	typedef std::map<unsigned int, ClientInfo> ClientInfoMap;
 	friend class ServerObject;
 
+	//Objects of clients are called from several I/O threads, the map is shared by them
+	boost::mutex m_clientsMutex;
 	ClientInfoMap m_clients;
 	unsigned int m_nextClientID;
 
@@ -0,0 +1,113 @@
+﻿#include "stdafx.h"
+#include "arena.h"
+
+#include <algorithm>
+
+namespace DualRPC
+{
+
+Arena::Arena(std::size_t blockSize) :
+	m_pos(nullptr),
+	m_end(nullptr),
+	m_blockSize(blockSize),
+	m_used(0),
+	m_reserved(0),
+	m_peak(0)
+{
+}
+
+Arena::~Arena()
+{
+	freeBlocks(0);
+}
+
+void* Arena::allocateSlow(std::size_t size)
+{
+	//Oversized requests get a block of their own, the tail of the
+	//current block is abandoned until the next reset
+	Block b;
+	b.size = std::max(size, m_blockSize);
+	b.data = new char[b.size];
+	m_reserved += b.size;
+	m_blocks.push_back(b);
+
+	m_pos = b.data + size;
+	m_end = b.data + b.size;
+	m_used += size;
+	return b.data;
+}
+
+void Arena::reset()
+{
+	m_peak = std::max(m_peak, m_used);
+	m_used = 0;
+
+	//Keep one regular block for the next frame and give everything a
+	//large frame needed back to the system
+	if(!m_blocks.empty() && m_blocks[0].size == m_blockSize)
+		freeBlocks(1);
+	else
+		freeBlocks(0);
+
+	if(m_blocks.empty())
+	{
+		m_pos = m_end = nullptr;
+	}
+	else
+	{
+		m_pos = m_blocks[0].data;
+		m_end = m_blocks[0].data + m_blocks[0].size;
+	}
+}
+
+Arena::Mark Arena::mark() const
+{
+	Mark m;
+	m.blocks = m_blocks.size();
+	m.pos = m_pos;
+	m.used = m_used;
+	return m;
+}
+
+void Arena::rewind(const Mark &mark)
+{
+	if(mark.blocks == 0)
+	{
+		reset();
+		return;
+	}
+
+	m_peak = std::max(m_peak, m_used);
+	m_used = mark.used;
+	freeBlocks(mark.blocks);
+	m_pos = mark.pos;
+	m_end = m_blocks.back().data + m_blocks.back().size;
+}
+
+void Arena::freeBlocks(std::size_t from)
+{
+	for(std::size_t i = from; i < m_blocks.size(); i++)
+	{
+		m_reserved -= m_blocks[i].size;
+		delete [] m_blocks[i].data;
+	}
+	if(from < m_blocks.size())
+		m_blocks.resize(from);
+}
+
+std::size_t Arena::bytesUsed() const
+{
+	return m_used;
+}
+
+std::size_t Arena::bytesReserved() const
+{
+	return m_reserved;
+}
+
+std::size_t Arena::peakBytesUsed() const
+{
+	return std::max(m_peak, m_used);
+}
+
+}
@@ -0,0 +1,65 @@
+﻿#pragma once
+
+#include <vector>
+
+#include "defs.h"
+
+namespace DualRPC
+{
+
+class Arena
+{
+public:
+	//Position to give back everything allocated after it
+	struct Mark
+	{
+		std::size_t blocks;
+		char *pos;
+		std::size_t used;
+	};
+
+	explicit Arena(std::size_t blockSize = 64*1024);
+	~Arena();
+
+	void* allocate(std::size_t size)
+	{
+		size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+		if(size > std::size_t(m_end - m_pos))
+			return allocateSlow(size);
+		void *p = m_pos;
+		m_pos += size;
+		m_used += size;
+		return p;
+	}
+
+	void reset();
+	Mark mark() const;
+	//Frees what was allocated since the mark, all of it for a mark of an empty arena
+	void rewind(const Mark &mark);
+
+	std::size_t bytesUsed() const;
+	std::size_t bytesReserved() const;
+	std::size_t peakBytesUsed() const;
+
+private:
+	static const std::size_t ALIGNMENT = 8;
+
+	struct Block
+	{
+		char *data;
+		std::size_t size;
+	};
+	typedef std::vector<Block> BlockList;
+
+	BlockList m_blocks;
+	char *m_pos, *m_end;
+	std::size_t m_blockSize, m_used, m_reserved, m_peak;
+
+	void* allocateSlow(std::size_t size);
+	void freeBlocks(std::size_t from);
+
+	Arena(const Arena&);
+	Arena& operator=(const Arena&);
+};
+
+}
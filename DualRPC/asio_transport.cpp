@@ -1,14 +1,18 @@
 ﻿#include "stdafx.h"
 #include "asio_transport.h"
+#include "shard_server.h"
 #include "objects.h"
 #include "logger.h"
 
 #include <boost/format.hpp>
 #include <iostream>
 #include <ctime>  
+#include <cstring>
+#include <algorithm>
 
 #include <boost/random/random_number_generator.hpp>
 #include <boost/random/mersenne_twister.hpp>
+#include <boost/thread/thread.hpp>
 
 namespace DualRPC
 {
@@ -16,17 +20,87 @@ namespace DualRPC
 boost::mt19937 random_gen(static_cast<unsigned int>(std::time(0)));
 boost::random_number_generator<boost::mt19937, SessionID> random_adapter(random_gen);
 
+static void runService(aio::io_service *iosvc)
+{
+	iosvc->run();
+}
+
+void runIoService(aio::io_service &iosvc, unsigned int threads)
+{
+	if(threads == 0)
+		threads = std::max(1u, boost::thread::hardware_concurrency());
+
+	boost::thread_group pool;
+	for(unsigned int i = 1; i < threads; ++i)
+		pool.create_thread(boost::bind(&runService, &iosvc));
+	iosvc.run();
+	pool.join_all();
+}
+
 AsioClientBase::AsioClientBase(aio::io_service &iosvc, ObjectsStorage &storage) :
 	ClientBase(storage),
 	m_iosvc(iosvc),
-	m_socket(iosvc)
+	m_strand(iosvc),
+	m_socket(iosvc),
+	m_recvBufferSize(0),
+	m_readBegin(0),
+	m_readEnd(0),
+	m_streamLeft(0),
+	m_readNeeded(0),
+	m_readBufferSize(64*1024),
+	m_readWanted(false),
+	m_readPending(false),
+	m_parsing(false),
+	m_readThrottled(false),
+	m_readMemory(0),
+	m_readCalls(0),
+	m_framesRead(0)
 {
 }
 
+void AsioClientBase::setReadBufferSize(unsigned int size)
+{
+	//A read has to take the size and type of a frame, an empty one never completes
+	if(size <= sizeof(m_recvBufferSize))
+		throw std::runtime_error((boost::format("Read buffer size %1% is too small") % size).str());
+	//Applied when the buffer is next empty
+	m_readBufferSize = size;
+}
+
+unsigned int AsioClientBase::getReadBufferSize() const
+{
+	return m_readBufferSize;
+}
+
+std::size_t AsioClientBase::readCalls() const
+{
+	return m_readCalls;
+}
+
+std::size_t AsioClientBase::framesRead() const
+{
+	return m_framesRead;
+}
+
+double AsioClientBase::averageFramesPerRead() const
+{
+	return m_readCalls ? double(m_framesRead) / m_readCalls : 0.0;
+}
+
 void AsioClientBase::close()
 {
 	ClientBase::close();
+	if(asyncMode())
+		m_strand.dispatch(boost::bind(&AsioClientBase::closeSocket, 
+			boost::dynamic_pointer_cast<AsioClientBase, ClientBase>(shared_from_this())));
+	else
+		closeSocket();
+}
+
+void AsioClientBase::closeSocket()
+{
 	m_socket.close();
+	resetRead();
 }
 
 void AsioClientBase::onStart()
@@ -37,33 +111,245 @@ void AsioClientBase::onRestart()
 {
 }
 
-void AsioClientBase::writeData(const string &data) 
+void AsioClientBase::writeData(const WriteSegmentList &segments) 
 {
-	writeData(data.c_str(), data.size());
+	if(segments.size() == 1)
+	{
+		writeData(segments.front().first, (unsigned int)segments.front().second);
+		return;
+	}
+
+	std::vector<aio::const_buffer> buffers;
+	buffers.reserve(segments.size());
+	for(auto it = segments.cbegin(); it != segments.cend(); ++it)
+		buffers.push_back(aio::buffer(it->first, it->second));
+
+	//Messages are queued by whichever thread sends them, the socket is written on the strand
+	m_strand.dispatch(boost::bind(&AsioClientBase::startWrite, 
+		boost::dynamic_pointer_cast<AsioClientBase, ClientBase>(shared_from_this()), buffers));
 }
 
 void AsioClientBase::writeData(const char *data, unsigned int size)
 {
-	aio::async_write(m_socket, aio::buffer(data, size),
-		boost::bind(&AsioClientBase::handleWrite, 
+	m_strand.dispatch(boost::bind(&AsioClientBase::startWriteBuffer, 
+		boost::dynamic_pointer_cast<AsioClientBase, ClientBase>(shared_from_this()), 
+		aio::const_buffer(data, size)));
+}
+
+void AsioClientBase::startWrite(const std::vector<aio::const_buffer> &buffers)
+{
+	aio::async_write(m_socket, buffers,
+		m_strand.wrap(boost::bind(&AsioClientBase::handleWrite, 
 			boost::dynamic_pointer_cast<AsioClientBase, ClientBase>(shared_from_this()), 
 			aio::placeholders::error,
-			aio::placeholders::bytes_transferred)
+			aio::placeholders::bytes_transferred))
 	);
 }
 
-Variant AsioClientBase::startRead(const Variant&)
+void AsioClientBase::startWriteBuffer(const aio::const_buffer &buffer)
 {
-	aio::async_read(m_socket, aio::buffer(&m_recvBufferSize, sizeof(m_recvBufferSize)),
-		boost::bind(&AsioClientBase::handleReadSize, 
+	aio::async_write(m_socket, aio::buffer(buffer),
+		m_strand.wrap(boost::bind(&AsioClientBase::handleWrite, 
 			boost::dynamic_pointer_cast<AsioClientBase, ClientBase>(shared_from_this()), 
 			aio::placeholders::error,
-			boost::asio::placeholders::bytes_transferred)
+			aio::placeholders::bytes_transferred))
 	);
+}
+
+Variant AsioClientBase::startRead(const Variant&)
+{
+	//Futures completed on other threads ask for the next frame too
+	m_strand.dispatch(boost::bind(&AsioClientBase::wantRead, 
+		boost::dynamic_pointer_cast<AsioClientBase, ClientBase>(shared_from_this())));
 	return Variant();
 }
 
-void AsioClientBase::handleReadSize(const boost::system::error_code& error, std::size_t bytes_transferred)
+void AsioClientBase::wantRead()
+{
+	//Frames processed inside parseFrames ask for the next one here
+	m_readWanted = true;
+	if(!m_parsing && !m_readPending)
+		parseFrames();
+}
+
+void AsioClientBase::resetRead()
+{
+	m_readBegin = m_readEnd = 0;
+	m_streamLeft = m_readNeeded = 0;
+	m_readWanted = m_readPending = false;
+	resetFrame();
+}
+
+void AsioClientBase::parseFrames()
+{
+	m_parsing = true;
+	try
+	{
+		while(!m_readPending)
+		{
+			std::size_t available = m_readEnd - m_readBegin;
+			if(m_streamLeft > 0)
+			{
+				//A streamed frame is read to its end, its processing wants the next one
+				if(available > 0 && available >= m_readNeeded)
+				{
+					std::size_t needed;
+					if(available >= m_streamLeft)
+					{
+						const char *part = &m_readBuffer[m_readBegin];
+						std::size_t size = m_streamLeft;
+						m_readBegin += size;
+						m_streamLeft = m_readNeeded = 0;
+						m_readWanted = false;
+						++m_framesRead;
+						continueFrame(part, size, needed);
+					}
+					else
+					{
+						std::size_t taken = continueFrame(&m_readBuffer[m_readBegin], available, needed);
+						m_readBegin += taken;
+						m_streamLeft -= taken;
+						m_readNeeded = needed;
+					}
+					continue;
+				}
+				if(m_readThrottled)
+					break;
+				readMore();
+				continue;
+			}
+
+			if(!m_readWanted)
+				break;
+			if(available >= sizeof(m_recvBufferSize))
+			{
+				memcpy(&m_recvBufferSize, &m_readBuffer[m_readBegin], sizeof(m_recvBufferSize));
+				if(m_recvBufferSize > getMaxMessageSize())
+				{
+					LOG_ALARM_FMT(0, "Max message size %1% bytes exceeded by read size in %2% bytes",
+						getMaxMessageSize() % m_recvBufferSize);
+					m_parsing = false;
+					close();
+					return;
+				}
+
+				std::size_t frameSize = sizeof(m_recvBufferSize) + m_recvBufferSize;
+				if(frameSize <= available)
+				{
+					//The frame stays in place until the next read moves the buffer
+					const char *frame = &m_readBuffer[m_readBegin + sizeof(m_recvBufferSize)];
+					m_readBegin += frameSize;
+					m_readWanted = false;
+					++m_framesRead;
+					processIncomingRequest(frame, m_recvBufferSize);
+					continue;
+				}
+				if(frameSize > m_readBuffer.size())
+				{
+					//Large frames wait too, before their memory is taken
+					if(m_readThrottled)
+						break;
+					std::size_t taken, needed;
+					FrameStart start = startFrame(&m_readBuffer[m_readBegin + sizeof(m_recvBufferSize)], 
+						available - sizeof(m_recvBufferSize), m_recvBufferSize, taken, needed);
+					if(start == FRAME_STREAM)
+					{
+						m_readBegin += sizeof(m_recvBufferSize) + taken;
+						m_streamLeft = m_recvBufferSize - taken;
+						continue;
+					}
+					if(start == FRAME_WHOLE)
+					{
+						readLargeFrame();
+						break;
+					}
+				}
+			}
+			if(m_readThrottled)
+				break;
+			readMore();
+		}
+	}
+	catch(...)
+	{
+		m_parsing = false;
+		throw;
+	}
+	m_parsing = false;
+}
+
+void AsioClientBase::readMore()
+{
+	//The partial frame moves to the front so the rest of it fits behind
+	if(m_readBegin == m_readEnd)
+	{
+		m_readBegin = m_readEnd = 0;
+		if(m_readBuffer.size() != m_readBufferSize)
+			string(m_readBufferSize, '\0').swap(m_readBuffer);
+	}
+	else if(m_readBegin > 0)
+	{
+		memmove(&m_readBuffer[0], &m_readBuffer[m_readBegin], m_readEnd - m_readBegin);
+		m_readEnd -= m_readBegin;
+		m_readBegin = 0;
+	}
+	//A value of a streamed frame that is decoded whole may not fit
+	if(m_readNeeded > m_readBuffer.size())
+		m_readBuffer.resize(m_readNeeded);
+	trackReadMemory();
+
+	m_readPending = true;
+	++m_readCalls;
+	m_socket.async_read_some(aio::buffer(&m_readBuffer[m_readEnd], m_readBuffer.size() - m_readEnd),
+		m_strand.wrap(boost::bind(&AsioClientBase::handleRead, 
+			boost::dynamic_pointer_cast<AsioClientBase, ClientBase>(shared_from_this()), 
+			aio::placeholders::error,
+			boost::asio::placeholders::bytes_transferred))
+	);
+}
+
+void AsioClientBase::readLargeFrame()
+{
+	//Bytes of the frame already read are copied, the rest is read in place
+	std::size_t copied = m_readEnd - m_readBegin - sizeof(m_recvBufferSize);
+	m_recvBuffer = acquireBuffer(m_recvBufferSize);
+	m_recvBuffer.resize(m_recvBufferSize);
+	memcpy(&m_recvBuffer[0], &m_readBuffer[m_readBegin + sizeof(m_recvBufferSize)], copied);
+	m_readBegin = m_readEnd = 0;
+	trackReadMemory();
+
+	m_readPending = true;
+	++m_readCalls;
+	aio::async_read(m_socket, aio::buffer(&m_recvBuffer[copied], m_recvBufferSize - copied),
+		m_strand.wrap(boost::bind(&AsioClientBase::handleReadData, 
+			boost::dynamic_pointer_cast<AsioClientBase, ClientBase>(shared_from_this()), 
+			aio::placeholders::error,
+			boost::asio::placeholders::bytes_transferred))
+	);
+}
+
+void AsioClientBase::throttleReads(bool value)
+{
+	//The governor calls from any thread
+	m_strand.post(boost::bind(&AsioClientBase::setReadThrottled, 
+		boost::dynamic_pointer_cast<AsioClientBase, ClientBase>(shared_from_this()), value));
+}
+
+void AsioClientBase::setReadThrottled(bool value)
+{
+	m_readThrottled = value;
+	if(!value && (m_readWanted || m_streamLeft > 0) && !m_parsing && !m_readPending && m_socket.is_open())
+		parseFrames();
+}
+
+void AsioClientBase::trackReadMemory()
+{
+	std::size_t memory = m_readBuffer.size() + m_recvBuffer.size();
+	trackMemory(MEM_RECEIVE, (std::ptrdiff_t)memory - (std::ptrdiff_t)m_readMemory);
+	m_readMemory = memory;
+}
+
+void AsioClientBase::handleRead(const boost::system::error_code& error, std::size_t bytes_transferred)
 {
 	if(error)
 	{
@@ -71,19 +357,9 @@ void AsioClientBase::handleReadSize(const boost::system::error_code& error, std:
 	}
 	else
 	{
-		if(m_recvBufferSize > getMaxMessageSize())
-		{
-			LOG_ALARM_FMT(0, "Max message size %1% bytes exceeded by read size in %2% bytes",
-				getMaxMessageSize() % m_recvBufferSize);
-			close();
-		}
-		m_recvBuffer.resize(m_recvBufferSize);
-		aio::async_read(m_socket, aio::buffer(&m_recvBuffer[0], m_recvBufferSize),
-			boost::bind(&AsioClientBase::handleReadData, 
-				boost::dynamic_pointer_cast<AsioClientBase, ClientBase>(shared_from_this()), 
-				aio::placeholders::error,
-				boost::asio::placeholders::bytes_transferred)
-		);
+		m_readPending = false;
+		m_readEnd += bytes_transferred;
+		parseFrames();
 	}
 }
 
@@ -95,8 +371,15 @@ void AsioClientBase::handleReadData(const boost::system::error_code& error, std:
 	}
 	else
 	{
-		processIncomingRequest(m_recvBuffer);
-		m_recvBuffer.clear();
+		//The next read may start while this frame is processed
+		m_readPending = false;
+		m_readWanted = false;
+		++m_framesRead;
+		string data;
+		data.swap(m_recvBuffer);
+		trackReadMemory();
+		processIncomingRequest(data);
+		releaseBuffer(data);
 	}
 }
 
@@ -124,12 +407,14 @@ Variant AsioClientBase::recvAnswer()
 					getMaxMessageSize() % m_recvBufferSize).str());
 		}
 
-		m_recvBuffer.resize(m_recvBufferSize);
-		aio::read(m_socket, aio::buffer(&m_recvBuffer[0], m_recvBufferSize), 
+		string data = bufferPool().acquire(m_recvBufferSize);
+		data.resize(m_recvBufferSize);
+		aio::read(m_socket, aio::buffer(&data[0], m_recvBufferSize), 
 			aio::transfer_exactly(m_recvBufferSize));
 
 		Variant result;
-		processIncomingRequest(m_recvBuffer);
+		processIncomingRequest(data);
+		bufferPool().release(data);
 		return result;
 	}
 
@@ -214,10 +499,10 @@ void AsioClient::asyncConnectTcp()
     tcp::resolver::query query(tcp::v4(), m_host, std::to_string((long long)m_port));
 
 	m_resolver.async_resolve(query,
-		boost::bind(&AsioClient::handleResolve, 
+		m_strand.wrap(boost::bind(&AsioClient::handleResolve, 
 			boost::dynamic_pointer_cast<AsioClient, ClientBase>(shared_from_this()), 
 			boost::asio::placeholders::error, 
-            boost::asio::placeholders::iterator)
+            boost::asio::placeholders::iterator))
 	);	
 }
 
@@ -225,8 +510,8 @@ void AsioClient::doReconnect()
 {
 	m_reconTimer.expires_from_now(boost::posix_time::seconds(getReconnectTimeout()));
 	m_reconTimer.async_wait(
-		boost::bind(&AsioClient::asyncConnectTcp, 
-			boost::dynamic_pointer_cast<AsioClient, ClientBase>(shared_from_this()))			
+		m_strand.wrap(boost::bind(&AsioClient::asyncConnectTcp, 
+			boost::dynamic_pointer_cast<AsioClient, ClientBase>(shared_from_this())))
 	);
 }
 
@@ -240,9 +525,9 @@ void AsioClient::handleResolve(const boost::system::error_code& error,
 	else
 	{
 		aio::async_connect(m_socket, iterator,
-			boost::bind(&AsioClient::handleConnect, 
+			m_strand.wrap(boost::bind(&AsioClient::handleConnect, 
 				boost::dynamic_pointer_cast<AsioClient, ClientBase>(shared_from_this()), 
-				aio::placeholders::error)
+				aio::placeholders::error))
 		);
 	}
 }
@@ -256,6 +541,8 @@ void AsioClient::handleConnect(const boost::system::error_code& error)
 	else
 	{
 		LOG_INFO(0, "Successfull connected");
+		//Queued messages are already sent together, Nagle would only delay them
+		m_socket.set_option(tcp::no_delay(true));
 		connectionMade();
 	}
 }
@@ -263,9 +550,9 @@ void AsioClient::handleConnect(const boost::system::error_code& error)
 void AsioClient::connectionMade()
 {
 	aio::async_read(m_socket, aio::buffer(m_proto, 4),
-		boost::bind(&AsioClient::handleReadProto, 
+		m_strand.wrap(boost::bind(&AsioClient::handleReadProto, 
 			boost::dynamic_pointer_cast<AsioClient, ClientBase>(shared_from_this()), 
-			aio::placeholders::error)
+			aio::placeholders::error))
 	);
 }
 
@@ -281,9 +568,9 @@ void AsioClient::handleReadProto(const boost::system::error_code& error)
 		if(strcmp(m_proto, PROTOCOL_NAME) == 0)
 		{
 			aio::async_write(m_socket, aio::buffer(&m_sessionID, sizeof(m_sessionID)),
-				boost::bind(&AsioClient::handleWriteSession, 
+				m_strand.wrap(boost::bind(&AsioClient::handleWriteSession, 
 					boost::dynamic_pointer_cast<AsioClient, ClientBase>(shared_from_this()),
-					aio::placeholders::error)
+					aio::placeholders::error))
 			);
 		}
 		else 
@@ -303,9 +590,9 @@ void AsioClient::handleWriteSession(const boost::system::error_code& error)
 	else
 	{
 		aio::async_read(m_socket, aio::buffer(&m_newSessionID, sizeof(m_newSessionID)),
-			boost::bind(&AsioClient::handleReadSession, 
+			m_strand.wrap(boost::bind(&AsioClient::handleReadSession, 
 				boost::dynamic_pointer_cast<AsioClient, ClientBase>(shared_from_this()),
-				aio::placeholders::error)
+				aio::placeholders::error))
 		);
 	}
 }
@@ -329,17 +616,43 @@ void AsioClient::handleReadSession(const boost::system::error_code& error)
 
 		if(m_sessionID == m_newSessionID)
 		{
+			{
+				Lock lock(mutex());
+				restartFlowControl();
+				restartFragments();
+				restartStringTables();
+			}
 			handleWrite(boost::system::error_code(), 0);
 			onRestart();
 		}
 		else 
 		{
+			//Calls of a session the server dropped are never answered
+			if(m_sessionID != 0)
+				cancelRequestQueue(remote_error("Session is lost"));
+			//A new session starts on v1, onStart waits for the peer to agree on a version
 			m_sessionID = m_newSessionID;
-			onStart();
+			Variant answer;
+			{
+				Lock lock(mutex());
+				setWireVersion(WIRE_V1);
+				answer = requestWireVersion();
+			}
+			if(answer.isFuture())
+				answer.toFuture()->addBoth(boost::bind(&AsioClient::startSession, 
+					boost::dynamic_pointer_cast<AsioClient, ClientBase>(shared_from_this()), _1));
+			else
+				onStart();
 		}
 	}
 }
 
+Variant AsioClient::startSession(const Variant &v)
+{
+	onStart();
+	return Variant();
+}
+
 void AsioClient::handleError(const boost::system::error_code& error)
 {
 	LOG_ERROR_FMT(0, "%1%", error.message());
@@ -364,6 +677,13 @@ AsioClientSession::~AsioClientSession()
 	LOG_DEBUG_FMT(0, "ClientSession delete %1%", m_sessionID);
 }
 
+void AsioClientSession::close()
+{
+	//The server does not resume a session it closes itself
+	AsioClientBase::close();
+	m_server.removeSession(m_sessionID);
+}
+
 void AsioClientSession::cancelTimer()
 {
 	m_timer.cancel();
@@ -371,20 +691,24 @@ void AsioClientSession::cancelTimer()
 
 void AsioClientSession::connectionMade()
 {
-	writeData(PROTOCOL_NAME, 4);
-	/*aio::async_write(m_socket, aio::buffer(m_protoName),
-		boost::bind(&AsioClientBase::handleWrite, 
+	aio::async_write(m_socket, aio::buffer(PROTOCOL_NAME, 4),
+		m_strand.wrap(boost::bind(&AsioClientSession::handleWriteSession, 
 			boost::dynamic_pointer_cast<AsioClientSession, ClientBase>(shared_from_this()), 
-			aio::placeholders::error,
-			boost::asio::placeholders::bytes_transferred)
-	);*/
+			aio::placeholders::error))
+	);
 	aio::async_read(m_socket, aio::buffer(&m_remoteSessionID, sizeof(m_remoteSessionID)),
-		boost::bind(&AsioClientSession::handleReadSession, 
+		m_strand.wrap(boost::bind(&AsioClientSession::handleReadSession, 
 			boost::dynamic_pointer_cast<AsioClientSession, ClientBase>(shared_from_this()), 
-			aio::placeholders::error)
+			aio::placeholders::error))
 	);
 }
 
+void AsioClientSession::handleWriteSession(const boost::system::error_code& error)
+{
+	if(error)
+		handleError(error);
+}
+
 void AsioClientSession::handleReadSession(const boost::system::error_code& error)
 {
 	if(error)
@@ -403,9 +727,9 @@ void AsioClientSession::handleError(const boost::system::error_code& error)
 
 	m_timer.expires_from_now(boost::posix_time::seconds(m_server.getDisconnectTimeout()));
 	m_timer.async_wait(
-		boost::bind(&AsioClientSession::handleTimeout, 
+		m_strand.wrap(boost::bind(&AsioClientSession::handleTimeout, 
 			boost::dynamic_pointer_cast<AsioClientSession, ClientBase>(shared_from_this()),
-			aio::placeholders::error)
+			aio::placeholders::error))
 	);
 }
 
@@ -415,17 +739,68 @@ void AsioClientSession::handleTimeout(const boost::system::error_code& error)
 	{
 		cancelRequestQueue(remote_error(error.message()));
 		close();
-		m_server.removeSession(m_sessionID);
 	}
 }
 
+void AsioClientSession::resumeConnection(const AsioClientSessionPtr &connection)
+{
+	cancelTimer();
+	if(&connection->m_iosvc == &m_iosvc)
+	{
+		m_socket = std::move(connection->m_socket);
+	}
+	else
+	{
+#ifdef SO_REUSEPORT
+		//A socket is registered with the loop that opened it, the descriptor is
+		//taken from that loop and given to this one
+		boost::system::error_code ec;
+		m_socket.close(ec);
+		m_socket.assign(tcp::v4(), connection->m_socket.release());
+#else
+		throw std::runtime_error("Connection can not move to another io_service");
+#endif
+	}
+	{
+		Lock lock(mutex());
+		restartFlowControl();
+		restartFragments();
+		restartStringTables();
+	}
+	sendSession();
+	//The write in progress on the old socket is done with, the queue goes on behind the session
+	handleWrite(boost::system::error_code(), 0);
+}
+
+void AsioClientSession::sendSession()
+{
+	LOG_DEBUG_FMT(0, "Send session %1% to client", m_sessionID);
+
+	aio::async_write(m_socket, aio::buffer(&m_sessionID, sizeof(m_sessionID)),
+		m_strand.wrap(boost::bind(&AsioClientSession::handleWriteSession, 
+			boost::dynamic_pointer_cast<AsioClientSession, ClientBase>(shared_from_this()), 
+			aio::placeholders::error))
+	);
+	resetRead();
+	startRead();
+}
+
 //////////////////////////////////////////////////////////////////////////
 AsioServer::AsioServer(aio::io_service &iosvc, ObjectsStorage &storage) : 
 	m_iosvc(iosvc),
 	m_storage(storage),
 	m_acceptor(iosvc),
 	m_disconnectTimeout(30), //sec
-	m_maxMesssageSize(1024*1024)
+	m_maxMesssageSize(1024*1024),
+	m_arenaMode(false),
+	m_fragmentSize(64*1024),
+	m_maxAssembledSize(1024*1024),
+	m_maxWireVersion(WIRE_V7),
+	m_recvWindowBytes(8*1024*1024),
+	m_recvWindowMessages(1024),
+	m_governor(nullptr),
+	m_shards(nullptr),
+	m_shardIndex(0)
 {
 }
 
@@ -441,6 +816,9 @@ unsigned int AsioServer::getDisconnectTimeout() const
 
 void AsioServer::setMaxMessageSize(unsigned int size)
 {
+	//The assembled size follows until it is set on its own
+	if(m_maxAssembledSize == m_maxMesssageSize)
+		m_maxAssembledSize = size;
 	m_maxMesssageSize = size;
 }
 
@@ -449,12 +827,55 @@ unsigned int AsioServer::getMaxMessageSize() const
 	return m_maxMesssageSize;
 }
 
+void AsioServer::setArenaMode(bool value)
+{
+	m_arenaMode = value;
+}
+
+bool AsioServer::arenaMode() const
+{
+	return m_arenaMode;
+}
+
+void AsioServer::setFragmentSize(unsigned int size)
+{
+	m_fragmentSize = size;
+}
+
+void AsioServer::setMaxAssembledSize(unsigned int size)
+{
+	m_maxAssembledSize = size;
+}
+
+void AsioServer::setMaxWireVersion(WireVersion version)
+{
+	m_maxWireVersion = version;
+}
+
+WireVersion AsioServer::getMaxWireVersion() const
+{
+	return m_maxWireVersion;
+}
+
+void AsioServer::setReceiveWindow(unsigned int bytes, unsigned int messages)
+{
+	m_recvWindowBytes = bytes;
+	m_recvWindowMessages = messages;
+}
+
+void AsioServer::setMemoryGovernor(MemoryGovernor *governor)
+{
+	m_governor = governor;
+}
+
 SessionID AsioServer::getNextSessionID() const
 {
+	SessionID count = m_shards ? m_shards->shardCount() : 1;
 	SessionID id = 0;
 	do 
 	{
-		id = random_adapter(std::numeric_limits<SessionID>::max());
+		//The remainder by the shard count is the index of the session's shard
+		id = random_adapter(std::numeric_limits<SessionID>::max() / count) * count + m_shardIndex;
 	} 
 	while(id == 0 || m_clients.find(id) != m_clients.end());
 	return id;
@@ -487,6 +908,11 @@ void AsioServer::listen(const string &addr, unsigned short port)
 	tcp::endpoint endpoint(aio::ip::address::from_string(addr), port);
 	m_acceptor.open(endpoint.protocol());
 	m_acceptor.set_option(tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+	//Every shard accepts on the port, the kernel spreads the connections
+	if(m_shards)
+		m_acceptor.set_option(aio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#endif
 	m_acceptor.bind(endpoint);
 	m_acceptor.listen();
 	startAsyncAccept();
@@ -494,13 +920,35 @@ void AsioServer::listen(const string &addr, unsigned short port)
 
 void AsioServer::startAsyncAccept()
 {
+	//Without a port per shard this acceptor deals connections to every shard
+	AsioServer &server = m_shards ? m_shards->acceptServer(*this) : *this;
+	AsioClientSessionPtr newSession = server.createSession();
+    m_acceptor.async_accept(newSession->m_socket,
+        boost::bind(&AsioServer::handleAccept, this, newSession, aio::placeholders::error)
+	);
+}
+
+AsioClientSessionPtr AsioServer::createSession()
+{
+	boost::mutex::scoped_lock lock(m_clientsMutex);
 	SessionID id = getNextSessionID();
 	AsioClientSessionPtr newSession(new AsioClientSession(*this, id));
 	newSession->setMaxMessageSize(getMaxMessageSize());
+	newSession->setArenaMode(arenaMode());
+	newSession->setFragmentSize(m_fragmentSize);
+	newSession->setMaxAssembledSize(m_maxAssembledSize);
+	newSession->setMaxWireVersion(getMaxWireVersion());
+	newSession->setReceiveWindow(m_recvWindowBytes, m_recvWindowMessages);
+	newSession->setMemoryGovernor(m_governor);
 	m_clients[id] = newSession;
-    m_acceptor.async_accept(newSession->m_socket,
-        boost::bind(&AsioServer::handleAccept, this, newSession, aio::placeholders::error)
-	);
+	return newSession;
+}
+
+AsioClientSessionPtr AsioServer::findSession(SessionID sessionID)
+{
+	boost::mutex::scoped_lock lock(m_clientsMutex);
+	ClientSessionMap::iterator it = m_clients.find(sessionID);
+	return it != m_clients.end() ? it->second : AsioClientSessionPtr();
 }
 
 void AsioServer::handleAccept(const AsioClientSessionPtr &newSession, const boost::system::error_code& error)
@@ -514,7 +962,8 @@ void AsioServer::handleAccept(const AsioClientSessionPtr &newSession, const boos
 		LOG_INFO_FMT(0, "New client accepted %1%", 
 			newSession->m_socket.remote_endpoint().address().to_string());
 
-		newSession->connectionMade();
+		newSession->m_socket.set_option(tcp::no_delay(true));
+		newSession->m_strand.dispatch(boost::bind(&AsioClientSession::connectionMade, newSession));
 	}
 
 	startAsyncAccept();
@@ -522,24 +971,27 @@ void AsioServer::handleAccept(const AsioClientSessionPtr &newSession, const boos
 
 void AsioServer::moveConnectionToSession(SessionID localSessionID, SessionID remoteSessionID)
 {
+	//The session may be kept by another shard
+	AsioServer &owner = m_shards ? m_shards->sessionServer(remoteSessionID) : *this;
+	AsioClientSessionPtr session = owner.findSession(remoteSessionID);
+
+	boost::mutex::scoped_lock lock(m_clientsMutex);
 	ClientSessionMap::iterator local = m_clients.find(localSessionID);
-	ClientSessionMap::iterator remote = m_clients.find(remoteSessionID);
-	if(remote == m_clients.end())
+	AsioClientSessionPtr connection = local->second;
+	if(!session || session == connection)
 	{
-		remote = local;
+		lock.unlock();
+		connection->sendSession();
 	}
 	else
 	{
 		LOG_DEBUG_FMT(0, "Move socket from session %1% to %2%", localSessionID % remoteSessionID);
-		remote->second->cancelTimer();
-		remote->second->m_socket = std::move(local->second->m_socket);
 		m_clients.erase(local);
+		lock.unlock();
+		//The old session takes the socket on its own strand
+		session->m_strand.dispatch(boost::bind(&AsioClientSession::resumeConnection, 
+			session, connection));
 	}
-
-	LOG_DEBUG_FMT(0, "Send session %1% to client", remote->second->m_sessionID);
-
-	remote->second->writeData((char*)&remote->second->m_sessionID, sizeof(SessionID));
-	remote->second->startRead();
 	/*
 	aio::async_read(remote->second->m_socket, 
 		aio::buffer(&remote->second->m_recvBufferSize, 
@@ -553,6 +1005,7 @@ void AsioServer::moveConnectionToSession(SessionID localSessionID, SessionID rem
 void AsioServer::removeSession(SessionID sessionID)
 {
 	LOG_DEBUG_FMT(0, "Remove session %1% from server", sessionID);
+	boost::mutex::scoped_lock lock(m_clientsMutex);
 	m_clients.erase(sessionID);
 }
 
@@ -4,6 +4,7 @@
 
 #include "transport.h"
 #include <boost/asio.hpp>
+#include <boost/thread/mutex.hpp>
 
 namespace DualRPC
 {
@@ -11,27 +12,68 @@ namespace DualRPC
 namespace aio = boost::asio;
 using aio::ip::tcp;
 
+//Runs the service on this many threads, the calling one among them, until it
+//is out of work. 0 takes a thread per core. Handlers of one connection never
+//run at once, connections process their frames in parallel
+void runIoService(aio::io_service &iosvc, unsigned int threads = 0);
+
 class AsioClientBase : public ClientBase
 {
 public:
 	AsioClientBase(aio::io_service &iosvc, ObjectsStorage &storage);	
 
+	//Bytes taken from the socket per read, every complete frame among them is
+	//parsed in place. Larger frames are read into a buffer of their own. It has
+	//to be larger than the size of a frame's length
+	void setReadBufferSize(unsigned int size);
+	unsigned int getReadBufferSize() const;
+	//Reads issued on the socket and the frames they delivered
+	std::size_t readCalls() const;
+	std::size_t framesRead() const;
+	double averageFramesPerRead() const;
+
 protected:
 	aio::io_service &m_iosvc;
+	//Every handler of the connection runs on it, so do socket operations started
+	//by other threads
+	aio::io_service::strand m_strand;
 	tcp::socket m_socket;
 	string m_recvBuffer;
 	unsigned int m_recvBufferSize;
+	string m_readBuffer;
+	std::size_t m_readBegin, m_readEnd;
+	//Bytes of a streamed frame still to come and bytes to gather for its decoder
+	std::size_t m_streamLeft, m_readNeeded;
+	unsigned int m_readBufferSize;
+	bool m_readWanted, m_readPending, m_parsing;
+	//Paused by the memory governor, buffered frames are still processed
+	bool m_readThrottled;
+	//Read buffer bytes reported to the governor
+	std::size_t m_readMemory;
+	std::size_t m_readCalls, m_framesRead;
 
 	virtual void onStart();
 	virtual void onRestart();
 	virtual void connectionMade() = 0;
 
 	void close() override;
-	void writeData(const string &data) override;
+	void writeData(const WriteSegmentList &segments) override;
 	void writeData(const char *data, unsigned int size);
+	void startWrite(const std::vector<aio::const_buffer> &buffers);
+	void startWriteBuffer(const aio::const_buffer &buffer);
 	Variant startRead(const Variant &v = Variant()) override;
-
-	void handleReadSize(const boost::system::error_code& error, std::size_t bytes_transferred);
+	void wantRead();
+	void closeSocket();
+	//Forgets buffered bytes of a connection that is gone
+	void resetRead();
+	void parseFrames();
+	void readMore();
+	void readLargeFrame();
+	void throttleReads(bool value) override;
+	void setReadThrottled(bool value);
+	void trackReadMemory();
+
+	void handleRead(const boost::system::error_code& error, std::size_t bytes_transferred);
 	void handleReadData(const boost::system::error_code& error, std::size_t bytes_transferred);
 	void handleWrite(const boost::system::error_code& error, std::size_t bytes_transferred);
 	virtual void handleError(const boost::system::error_code& error) = 0;
@@ -76,11 +118,13 @@ class AsioClient : public AsioClientBase
 	void handleReadProto(const boost::system::error_code& error);
 	void handleWriteSession(const boost::system::error_code& error);
 	void handleReadSession(const boost::system::error_code& error);
+	Variant startSession(const Variant &v);
 };
 
 //////////////////////////////////////////////////////////////////////////
 
 class AsioServer;
+class AsioShardServer;
 
 class AsioClientSession : public AsioClientBase
 {
@@ -90,6 +134,7 @@ class AsioClientSession : public AsioClientBase
 
 protected:
 	void connectionMade() override;
+	void close() override;
 	void handleTimeout(const boost::system::error_code& error);
 	void handleError(const boost::system::error_code& error) override;
 
@@ -101,7 +146,12 @@ class AsioClientSession : public AsioClientBase
 	SessionID m_sessionID, m_remoteSessionID;
 
 	void cancelTimer();
+	//The handshake is written outside the message queue, its end completes no message
+	void handleWriteSession(const boost::system::error_code& error);
 	void handleReadSession(const boost::system::error_code& error);
+	//Takes over the socket of a reconnected client, from another shard's loop too
+	void resumeConnection(const AsioClientSessionPtr &connection);
+	void sendSession();
 };
 
 //////////////////////////////////////////////////////////////////////////
@@ -117,20 +167,47 @@ class AsioServer
 	void setMaxMessageSize(unsigned int size);
 	unsigned int getMaxMessageSize() const;	
 
+	void setArenaMode(bool value);
+	bool arenaMode() const;
+
+	//See ClientBase::setFragmentSize and setMaxAssembledSize
+	void setFragmentSize(unsigned int size);
+	void setMaxAssembledSize(unsigned int size);
+
+	void setMaxWireVersion(WireVersion version);
+	WireVersion getMaxWireVersion() const;
+
+	//Budget of calls from each client, see ClientBase::setReceiveWindow
+	void setReceiveWindow(unsigned int bytes, unsigned int messages);
+	//Sessions report their memory to governor, which outlives the server
+	void setMemoryGovernor(MemoryGovernor *governor);
+
 	void listen(const string &addr, unsigned short port);
 
 private:
 	friend class AsioClientSession;
+	friend class AsioShardServer;
 	typedef std::map<SessionID, AsioClientSessionPtr> ClientSessionMap;
 
 	aio::io_service &m_iosvc;	
 	aio::ip::tcp::acceptor m_acceptor;
 	ObjectsStorage &m_storage;
+	boost::mutex m_clientsMutex;
 	ClientSessionMap m_clients;
 	unsigned int m_disconnectTimeout;
 	unsigned int m_maxMesssageSize;
+	bool m_arenaMode;
+	unsigned int m_fragmentSize, m_maxAssembledSize;
+	WireVersion m_maxWireVersion;
+	unsigned int m_recvWindowBytes, m_recvWindowMessages;
+	MemoryGovernor *m_governor;
+	//Shards of a sharded server and the index of this one, session ids keep it
+	AsioShardServer *m_shards;
+	unsigned int m_shardIndex;
 
 	SessionID getNextSessionID() const;
+	AsioClientSessionPtr createSession();
+	AsioClientSessionPtr findSession(SessionID sessionID);
 	
 	void startAsyncAccept();
 	void handleAccept(const AsioClientSessionPtr &newSession, const boost::system::error_code& error);
@@ -0,0 +1,190 @@
+﻿#include "stdafx.h"
+#include "buffer.h"
+#include "string_table.h"
+
+#include <stdexcept>
+#include <boost/format.hpp>
+
+namespace DualRPC
+{
+
+OutputBuffer::OutputBuffer() :
+	m_version(WIRE_V1),
+	m_strings(nullptr),
+	m_spanThreshold(0),
+	m_plainTypes(false)
+{
+}
+
+OutputBuffer::OutputBuffer(std::size_t reserve, WireVersion version, StringTable *strings) :
+	m_version(version),
+	m_strings(strings),
+	m_spanThreshold(0),
+	m_plainTypes(false)
+{
+	m_data.reserve(reserve);
+}
+
+OutputBuffer::OutputBuffer(string &&storage, WireVersion version, StringTable *strings) :
+	m_data(std::move(storage)),
+	m_version(version),
+	m_strings(strings),
+	m_spanThreshold(0),
+	m_plainTypes(false)
+{
+	m_data.clear();
+}
+
+void OutputBuffer::writeKey(const char *data, std::size_t len)
+{
+	if(m_version == WIRE_V1)
+	{
+		if(len > 0xff) len = 0xff;
+		writeUInt(len, 1);
+	}
+	else if(m_version == WIRE_V2)
+	{
+		writeVarint(len);
+	}
+	else
+	{
+		//Odd values are table indices, even ones the length of a text
+		//that becomes a table entry when bit 1 is set
+		int index = m_strings ? m_strings->find(data, len) : -1;
+		if(index >= 0)
+		{
+			writeVarint(((unsigned __int64)index << 1) | 1);
+			return;
+		}
+		index = m_strings ? m_strings->add(data, len) : -1;
+		if(index >= 0)
+		{
+			writeVarint(((unsigned __int64)len << 2) | 2);
+			writeVarint(index);
+		}
+		else
+		{
+			writeVarint((unsigned __int64)len << 2);
+		}
+	}
+	write(data, len);
+}
+
+void OutputBuffer::writeSpan(const char *data, std::size_t size, const boost::shared_ptr<const void> &holder)
+{
+	SharedSpan span;
+	span.offset = m_data.size();
+	span.data = data;
+	span.size = size;
+	span.holder = holder;
+	m_spans.push_back(span);
+}
+
+void OutputBuffer::writeAt(std::size_t pos, const void *data, std::size_t size)
+{
+	if(pos + size > m_data.size())
+		throw std::runtime_error("Write position out of buffer bounds");
+	std::memcpy(&m_data[pos], data, size);
+}
+
+void OutputBuffer::reserve(std::size_t size)
+{
+	m_data.reserve(size);
+}
+
+void OutputBuffer::clear()
+{
+	m_data.clear();
+	m_spans.clear();
+}
+
+std::size_t OutputBuffer::totalSize() const
+{
+	std::size_t size = m_data.size();
+	for(auto it = m_spans.cbegin(); it != m_spans.cend(); ++it)
+		size += it->size;
+	return size;
+}
+
+string& OutputBuffer::str()
+{
+	return m_data;
+}
+
+const string& OutputBuffer::str() const
+{
+	return m_data;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+
+InputBuffer::InputBuffer(const char *data, std::size_t size, WireVersion version, StringTable *strings) :
+	m_begin(data),
+	m_pos(data),
+	m_end(data + size),
+	m_version(version),
+	m_strings(strings)
+{
+}
+
+InputBuffer::InputBuffer(const string &data, WireVersion version, StringTable *strings) :
+	m_begin(data.data()),
+	m_pos(data.data()),
+	m_end(data.data() + data.size()),
+	m_version(version),
+	m_strings(strings)
+{
+}
+
+unsigned __int64 InputBuffer::readVarint()
+{
+	unsigned __int64 value = 0;
+	for(int shift = 0; shift < 64; shift += 7)
+	{
+		unsigned char b;
+		readValue(b);
+		value |= (unsigned __int64)(b & 0x7f) << shift;
+		if(!(b & 0x80))
+			return value;
+	}
+	throw std::runtime_error("Invalid varint");
+}
+
+const char* InputBuffer::readKey(std::size_t &len)
+{
+	if(m_version < WIRE_V3)
+	{
+		len = (std::size_t)readUInt(1);
+		return readSpan(len);
+	}
+
+	unsigned __int64 value = readVarint();
+	if(value & 1)
+	{
+		if(!m_strings)
+			throw std::runtime_error("String table reference without a table");
+		const string &s = m_strings->get((std::size_t)(value >> 1));
+		len = s.size();
+		return s.data();
+	}
+
+	len = (std::size_t)(value >> 2);
+	if(value & 2)
+	{
+		std::size_t index = (std::size_t)readVarint();
+		const char *data = readSpan(len);
+		//Views read a value more than once, defining an entry again is harmless
+		if(m_strings)
+			m_strings->define(index, data, len);
+		return data;
+	}
+	return readSpan(len);
+}
+
+void InputBuffer::throwUnderflow(std::size_t size) const
+{
+	throw std::runtime_error((boost::format("Unexpected end of message (need %1% bytes at %2%, %3% left)") %
+		size % pos() % remaining()).str());
+}
+
+}
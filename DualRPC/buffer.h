@@ -0,0 +1,238 @@
+﻿#pragma once
+
+#include <cstring>
+#include <vector>
+
+#include "defs.h"
+
+namespace DualRPC
+{
+
+//Encoding of numbers and lengths, chosen per connection
+enum WireVersion
+{
+	WIRE_V1 = 1,	//fixed size numbers in host order
+	WIRE_V2 = 2,	//varints, small values share a byte with the type
+	WIRE_V3 = 3,	//v2 with map keys and method names in a StringTable
+	WIRE_V4 = 4,	//v3 with arrays of same-shaped maps sent by column
+	WIRE_V5 = 5,	//v4 with credit flow control of calls
+	WIRE_V6 = 6,	//v5 with priority classes of messages, a StringTable per class
+	WIRE_V7 = 7		//v6 with large messages split into fragments
+};
+
+inline unsigned __int64 zigzagEncode(__int64 value)
+{
+	return ((unsigned __int64)value << 1) ^ (unsigned __int64)(value >> 63);
+}
+
+inline __int64 zigzagDecode(unsigned __int64 value)
+{
+	return (__int64)(value >> 1) ^ -(__int64)(value & 1);
+}
+
+//Large payload sent from its own memory instead of being copied into the
+//buffer, the holder keeps the bytes alive until they are written
+struct SharedSpan
+{
+	std::size_t offset;		//position among the buffer's own bytes
+	const char *data;
+	std::size_t size;
+	boost::shared_ptr<const void> holder;
+};
+typedef std::vector<SharedSpan> SharedSpanList;
+
+class OutputBuffer
+{
+public:
+	OutputBuffer();
+	explicit OutputBuffer(std::size_t reserve, WireVersion version = WIRE_V1, 
+		StringTable *strings = nullptr);
+	//Writes into the capacity of storage, for pooled buffers
+	OutputBuffer(string &&storage, WireVersion version = WIRE_V1, StringTable *strings = nullptr);
+
+	WireVersion version() const { return m_version; }
+	void setVersion(WireVersion version) { m_version = version; }
+
+	void write(const void *data, std::size_t size)
+	{
+		m_data.append((const char*)data, size);
+	}
+
+	template<typename T> void writeValue(const T &value)
+	{
+		m_data.append((const char*)&value, sizeof(value));
+	}
+
+	void writeVarint(unsigned __int64 value)
+	{
+		char buf[10];
+		int len = 0;
+		while(value >= 0x80)
+		{
+			buf[len++] = char(value | 0x80);
+			value >>= 7;
+		}
+		buf[len++] = char(value);
+		m_data.append(buf, len);
+	}
+
+	//v1 writes the low v1Size bytes, v2 a varint
+	void writeUInt(unsigned __int64 value, int v1Size)
+	{
+		if(m_version == WIRE_V1)
+			m_data.append((const char*)&value, v1Size);
+		else
+			writeVarint(value);
+	}
+
+	//Type of a value followed by its length or small payload. v2 keeps values
+	//below 15 in the high bits of the type byte
+	void writeHeader(char type, unsigned __int64 value, int v1Size)
+	{
+		if(m_version == WIRE_V1)
+		{
+			m_data.push_back(type);
+			m_data.append((const char*)&value, v1Size);
+		}
+		else if(value < 15)
+		{
+			m_data.push_back(char(type | (value << 4)));
+		}
+		else
+		{
+			m_data.push_back(char(type | 0xf0));
+			writeVarint(value);
+		}
+	}
+
+	//v2 zigzags the value so small negatives stay in the type byte too
+	void writeIntHeader(char type, __int64 value)
+	{
+		if(m_version == WIRE_V1)
+			writeHeader(type, (unsigned __int64)value, sizeof(value));
+		else
+			writeHeader(type, zigzagEncode(value), sizeof(value));
+	}
+
+	//Map key or method name. v3 sends strings of the table by index, values 
+	//without a table (relayed ones) always carry the text
+	void writeKey(const char *data, std::size_t len);
+
+	//Payloads of at least this size become spans, 0 copies everything. Only for
+	//buffers written out by gathering their bytes and spans
+	void setSpanThreshold(std::size_t size) { m_spanThreshold = size; }
+	bool sharesSpan(std::size_t size) const { return m_spanThreshold != 0 && size >= m_spanThreshold; }
+	void writeSpan(const char *data, std::size_t size, const boost::shared_ptr<const void> &holder);
+
+	//Typed arrays and bytes are written as arrays of numbers and strings, for
+	//peers of wire version 1 that may only know the original types
+	void setPlainTypes(bool value) { m_plainTypes = value; }
+	bool plainTypes() const { return m_plainTypes; }
+
+	void writeAt(std::size_t pos, const void *data, std::size_t size);
+
+	void reserve(std::size_t size);
+	void clear();
+
+	//Own bytes only, totalSize() adds the spans
+	std::size_t size() const { return m_data.size(); }
+	std::size_t totalSize() const;
+	const char* data() const { return m_data.data(); }
+
+	string& str();
+	const string& str() const;
+	SharedSpanList& spans() { return m_spans; }
+	const SharedSpanList& spans() const { return m_spans; }
+
+private:
+	string m_data;
+	WireVersion m_version;
+	StringTable *m_strings;
+	std::size_t m_spanThreshold;
+	bool m_plainTypes;
+	SharedSpanList m_spans;
+};
+
+class InputBuffer
+{
+public:
+	InputBuffer(const char *data, std::size_t size, WireVersion version = WIRE_V1, 
+		StringTable *strings = nullptr);
+	explicit InputBuffer(const string &data, WireVersion version = WIRE_V1, 
+		StringTable *strings = nullptr);
+
+	WireVersion version() const { return m_version; }
+	StringTable* strings() const { return m_strings; }
+
+	void read(void *data, std::size_t size)
+	{
+		std::memcpy(data, readSpan(size), size);
+	}
+
+	template<typename T> void readValue(T &value)
+	{
+		read(&value, sizeof(value));
+	}
+
+	const char* readSpan(std::size_t size)
+	{
+		if(size > remaining())
+			throwUnderflow(size);
+		const char *p = m_pos;
+		m_pos += size;
+		return p;
+	}
+
+	void skip(std::size_t size) { readSpan(size); }
+
+	unsigned __int64 readVarint();
+
+	unsigned __int64 readUInt(int v1Size)
+	{
+		if(m_version != WIRE_V1)
+			return readVarint();
+		unsigned __int64 value = 0;
+		read(&value, v1Size);
+		return value;
+	}
+
+	//Returns the type, tag keeps the type byte for readHeaderValue
+	char readHeader(unsigned char &tag)
+	{
+		readValue(tag);
+		return m_version == WIRE_V1 ? char(tag) : char(tag & 0x0f);
+	}
+
+	unsigned __int64 readHeaderValue(unsigned char tag, int v1Size)
+	{
+		if(m_version == WIRE_V1)
+			return readUInt(v1Size);
+		if((tag >> 4) < 15)
+			return tag >> 4;
+		return readVarint();
+	}
+
+	__int64 readIntHeaderValue(unsigned char tag)
+	{
+		if(m_version == WIRE_V1)
+			return (__int64)readUInt(sizeof(__int64));
+		return zigzagDecode(readHeaderValue(tag, sizeof(__int64)));
+	}
+
+	//Points into the message or the string table, valid until the next read
+	const char* readKey(std::size_t &len);
+
+	std::size_t pos() const { return m_pos - m_begin; }
+	std::size_t remaining() const { return m_end - m_pos; }
+	const char* current() const { return m_pos; }
+	bool atEnd() const { return m_pos == m_end; }
+
+private:
+	const char *m_begin, *m_pos, *m_end;
+	WireVersion m_version;
+	StringTable *m_strings;
+
+	void throwUnderflow(std::size_t size) const;
+};
+
+}
@@ -0,0 +1,141 @@
+﻿#include "stdafx.h"
+#include "buffer_pool.h"
+
+namespace DualRPC
+{
+
+BufferPool::BufferPool(std::size_t maxBytes, std::size_t maxPerClass) :
+	m_maxBytes(maxBytes),
+	m_maxPerClass(maxPerClass),
+	m_acquired(0),
+	m_hits(0),
+	m_dropped(0),
+	m_retained(0),
+	m_peakRetained(0)
+{
+	//Lists never reallocate, so a steady release/acquire cycle allocates nothing
+	for(unsigned int k = MIN_CLASS; k <= MAX_CLASS; k++)
+		m_classes[k].reserve(maxPerClass);
+}
+
+unsigned int BufferPool::classOf(std::size_t capacity)
+{
+	unsigned int k = 0;
+	while(k < 63 && (std::size_t(2) << k) <= capacity)
+		k++;
+	return k;
+}
+
+string BufferPool::acquire(std::size_t size)
+{
+	++m_acquired;
+	unsigned int k = MIN_CLASS;
+	while(k <= MAX_CLASS && (std::size_t(1) << k) < size)
+		k++;
+
+	//The smallest kept buffer that is large enough
+	for(unsigned int c = k; c <= MAX_CLASS; c++)
+	{
+		BufferList &list = m_classes[c];
+		if(!list.empty())
+		{
+			string buffer;
+			buffer.swap(list.back());
+			list.pop_back();
+			m_retained -= buffer.capacity();
+			++m_hits;
+			return buffer;
+		}
+	}
+
+	string buffer;
+	buffer.reserve(k <= MAX_CLASS ? (std::size_t(1) << k) : size);
+	return buffer;
+}
+
+void BufferPool::release(string &buffer)
+{
+	std::size_t capacity = buffer.capacity();
+	unsigned int k = classOf(capacity);
+	string dropped;
+	if(k < MIN_CLASS)
+	{
+		//Too small to be worth a slot, including moved-from strings
+		buffer.swap(dropped);
+		return;
+	}
+	if(k > MAX_CLASS || m_classes[k].size() >= m_maxPerClass || m_retained + capacity > m_maxBytes)
+	{
+		++m_dropped;
+		buffer.swap(dropped);
+		return;
+	}
+
+	buffer.clear();
+	m_classes[k].push_back(string());
+	m_classes[k].back().swap(buffer);
+	m_retained += capacity;
+	if(m_retained > m_peakRetained)
+		m_peakRetained = m_retained;
+}
+
+void BufferPool::setMaxBytes(std::size_t size)
+{
+	m_maxBytes = size;
+}
+
+std::size_t BufferPool::getMaxBytes() const
+{
+	return m_maxBytes;
+}
+
+void BufferPool::setMaxPerClass(std::size_t count)
+{
+	m_maxPerClass = count;
+	for(unsigned int k = MIN_CLASS; k <= MAX_CLASS; k++)
+		m_classes[k].reserve(count);
+}
+
+std::size_t BufferPool::getMaxPerClass() const
+{
+	return m_maxPerClass;
+}
+
+void BufferPool::clear()
+{
+	for(unsigned int k = MIN_CLASS; k <= MAX_CLASS; k++)
+		m_classes[k].clear();
+	m_retained = 0;
+}
+
+std::size_t BufferPool::acquired() const
+{
+	return m_acquired;
+}
+
+std::size_t BufferPool::hits() const
+{
+	return m_hits;
+}
+
+double BufferPool::hitRate() const
+{
+	return m_acquired ? double(m_hits) / m_acquired : 0.0;
+}
+
+std::size_t BufferPool::dropped() const
+{
+	return m_dropped;
+}
+
+std::size_t BufferPool::bytesRetained() const
+{
+	return m_retained;
+}
+
+std::size_t BufferPool::peakBytesRetained() const
+{
+	return m_peakRetained;
+}
+
+}
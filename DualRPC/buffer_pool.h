@@ -0,0 +1,55 @@
+﻿#pragma once
+
+#include <vector>
+
+#include "defs.h"
+
+namespace DualRPC
+{
+
+//Message buffers kept for reuse by one connection. Buffers are sorted into
+//classes by capacity (powers of two), a buffer of class k holds at least 2^k
+//bytes. Not thread safe
+class BufferPool
+{
+public:
+	static const unsigned int MIN_CLASS = 8;	//256 bytes
+	static const unsigned int MAX_CLASS = 24;	//16 MB, larger buffers are not kept
+
+	explicit BufferPool(std::size_t maxBytes = 4*1024*1024, std::size_t maxPerClass = 8);
+
+	//Empty string with at least size bytes of capacity
+	string acquire(std::size_t size);
+	//Takes the storage of buffer and leaves it empty
+	void release(string &buffer);
+
+	//High-water limits, buffers over them are freed on release
+	void setMaxBytes(std::size_t size);
+	std::size_t getMaxBytes() const;
+	void setMaxPerClass(std::size_t count);
+	std::size_t getMaxPerClass() const;
+
+	void clear();
+
+	std::size_t acquired() const;
+	std::size_t hits() const;
+	double hitRate() const;
+	std::size_t dropped() const;
+	std::size_t bytesRetained() const;
+	std::size_t peakBytesRetained() const;
+
+private:
+	typedef std::vector<string> BufferList;
+
+	BufferList m_classes[MAX_CLASS + 1];
+	std::size_t m_maxBytes, m_maxPerClass;
+	std::size_t m_acquired, m_hits, m_dropped;
+	std::size_t m_retained, m_peakRetained;
+
+	static unsigned int classOf(std::size_t capacity);
+
+	BufferPool(const BufferPool&);
+	BufferPool& operator=(const BufferPool&);
+};
+
+}
@@ -9,6 +9,9 @@ namespace DualRPC
 {
 
 class Variant;
+class VariantView;
+class Arena;
+class StringTable;
 class ClientBase;
 class AsioClientBase;
 class AsioClientSession;
@@ -21,6 +24,16 @@ typedef unsigned int ObjectID;
 typedef unsigned int RequestID;
 typedef unsigned __int64 SessionID;
 
+//Classes of outgoing messages, a queued message goes ahead of those of lower
+//classes. Answers go back in the class of their call
+enum MessagePriority
+{
+	PRIORITY_CONTROL,
+	PRIORITY_NORMAL,
+	PRIORITY_BULK,
+	PRIORITY_CLASSES
+};
+
 typedef boost::shared_ptr<ClientBase> ClientBasePtr;
 typedef boost::shared_ptr<AsioClientSession> AsioClientSessionPtr;
 typedef boost::shared_ptr<AsioClient> AsioClientPtr;
@@ -30,6 +43,7 @@ typedef boost::shared_ptr<FutureResult> FutureResultPtr;
 typedef std::list<ObjectID> ObjectIDList;
 
 typedef boost::function<Variant (const Variant&)> Callback;
+typedef boost::function<Variant (const VariantView&)> ViewCallback;
 
 using std::string;
 
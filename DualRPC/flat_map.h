@@ -0,0 +1,225 @@
+﻿#pragma once
+
+#include <vector>
+#include <utility>
+#include <iterator>
+
+namespace DualRPC
+{
+
+//Sorted vector with the interface of std::map used by Variant. Keys and values
+//are stored side by side, small maps are searched linearly. Unlike std::map,
+//inserting and erasing invalidate iterators and references to the items
+template<typename K, typename V>
+class FlatMap
+{
+	//Keys are stored assignable for the vector to move items, iterators give
+	//them out const as std::map does, so a key can not break the order
+	typedef std::pair<K, V> Item;
+	typedef std::vector<Item> Items;
+
+public:
+	typedef K key_type;
+	typedef V mapped_type;
+	typedef std::pair<const K, V> value_type;
+	typedef typename Items::size_type size_type;
+
+	template<typename Base, typename T>
+	class Iterator
+	{
+	public:
+		typedef std::random_access_iterator_tag iterator_category;
+		typedef T value_type;
+		typedef typename Base::difference_type difference_type;
+		typedef T* pointer;
+		typedef T& reference;
+
+		Iterator() {}
+		explicit Iterator(const Base &it) : m_it(it) {}
+		//iterator to const_iterator
+		template<typename B, typename U> Iterator(const Iterator<B, U> &it) : m_it(it.base()) {}
+
+		T& operator*() const { return reinterpret_cast<T&>(*m_it); }
+		T* operator->() const { return &**this; }
+		T& operator[](difference_type n) const { return *(*this + n); }
+
+		Iterator& operator++() { ++m_it; return *this; }
+		Iterator operator++(int) { return Iterator(m_it++); }
+		Iterator& operator--() { --m_it; return *this; }
+		Iterator operator--(int) { return Iterator(m_it--); }
+		Iterator& operator+=(difference_type n) { m_it += n; return *this; }
+		Iterator& operator-=(difference_type n) { m_it -= n; return *this; }
+		Iterator operator+(difference_type n) const { return Iterator(m_it + n); }
+		Iterator operator-(difference_type n) const { return Iterator(m_it - n); }
+		template<typename B, typename U> difference_type operator-(const Iterator<B, U> &it) const { return m_it - it.base(); }
+
+		template<typename B, typename U> bool operator==(const Iterator<B, U> &it) const { return m_it == it.base(); }
+		template<typename B, typename U> bool operator!=(const Iterator<B, U> &it) const { return m_it != it.base(); }
+		template<typename B, typename U> bool operator<(const Iterator<B, U> &it) const { return m_it < it.base(); }
+
+		const Base& base() const { return m_it; }
+
+	private:
+		Base m_it;
+	};
+	typedef Iterator<typename Items::iterator, value_type> iterator;
+	typedef Iterator<typename Items::const_iterator, const value_type> const_iterator;
+
+	FlatMap() {}
+	FlatMap(const FlatMap &m) : m_items(m.m_items) {}
+	FlatMap(FlatMap &&m) : m_items(std::move(m.m_items)) {}
+
+	FlatMap& operator=(const FlatMap &m)
+	{
+		m_items = m.m_items;
+		return *this;
+	}
+
+	FlatMap& operator=(FlatMap &&m)
+	{
+		m_items = std::move(m.m_items);
+		return *this;
+	}
+
+	iterator begin() { return iterator(m_items.begin()); }
+	iterator end() { return iterator(m_items.end()); }
+	const_iterator begin() const { return const_iterator(m_items.begin()); }
+	const_iterator end() const { return const_iterator(m_items.end()); }
+	const_iterator cbegin() const { return const_iterator(m_items.cbegin()); }
+	const_iterator cend() const { return const_iterator(m_items.cend()); }
+
+	size_type size() const { return m_items.size(); }
+	bool empty() const { return m_items.empty(); }
+	void clear() { m_items.clear(); }
+	void reserve(size_type n) { m_items.reserve(n); }
+	void swap(FlatMap &m) { m_items.swap(m.m_items); }
+
+	iterator lower_bound(const K &key)
+	{
+		return begin() + lowerIndex(key);
+	}
+
+	const_iterator lower_bound(const K &key) const
+	{
+		return begin() + lowerIndex(key);
+	}
+
+	iterator find(const K &key)
+	{
+		size_type pos = lowerIndex(key);
+		return (pos != m_items.size() && !(key < m_items[pos].first)) ? begin() + pos : end();
+	}
+
+	const_iterator find(const K &key) const
+	{
+		size_type pos = lowerIndex(key);
+		return (pos != m_items.size() && !(key < m_items[pos].first)) ? begin() + pos : end();
+	}
+
+	size_type count(const K &key) const
+	{
+		return find(key) != end() ? 1 : 0;
+	}
+
+	V& operator[](const K &key)
+	{
+		size_type pos = lowerIndex(key);
+		if(pos == m_items.size() || key < m_items[pos].first)
+		{
+			grow();
+			m_items.insert(m_items.begin() + pos, Item(key, V()));
+		}
+		return m_items[pos].second;
+	}
+
+	//Existing keys keep their value, as in std::map
+	std::pair<iterator, bool> insert(const value_type &item)
+	{
+		return emplace(item.first, item.second);
+	}
+
+	std::pair<iterator, bool> insert(value_type &&item)
+	{
+		return emplace(item.first, std::move(item.second));
+	}
+
+	template<typename KK, typename VV>
+	std::pair<iterator, bool> emplace(KK &&key, VV &&value)
+	{
+		size_type pos = lowerIndex(key);
+		if(pos != m_items.size() && !(key < m_items[pos].first))
+			return std::make_pair(begin() + pos, false);
+		grow();
+		m_items.insert(m_items.begin() + pos, Item(std::forward<KK>(key), std::forward<VV>(value)));
+		return std::make_pair(begin() + pos, true);
+	}
+
+	//Appending keys in order costs one comparison
+	template<typename KK, typename VV>
+	iterator emplace_hint(const_iterator hint, KK &&key, VV &&value)
+	{
+		size_type pos = hint.base() - m_items.cbegin();
+		if((pos == 0 || m_items[pos - 1].first < key) && (pos == m_items.size() || key < m_items[pos].first))
+		{
+			grow();
+			m_items.insert(m_items.begin() + pos, Item(std::forward<KK>(key), std::forward<VV>(value)));
+			return begin() + pos;
+		}
+		return emplace(std::forward<KK>(key), std::forward<VV>(value)).first;
+	}
+
+	iterator erase(const_iterator it)
+	{
+		return iterator(m_items.erase(m_items.begin() + (it.base() - m_items.cbegin())));
+	}
+
+	size_type erase(const K &key)
+	{
+		size_type pos = lowerIndex(key);
+		if(pos == m_items.size() || key < m_items[pos].first)
+			return 0;
+		m_items.erase(m_items.begin() + pos);
+		return 1;
+	}
+
+private:
+	//Below this size a scan beats the branches of a binary search
+	static const size_type LINEAR_SEARCH_SIZE = 8;
+	//Maps built item by item skip the first reallocations
+	static const size_type MIN_CAPACITY = 4;
+
+	Items m_items;
+
+	void grow()
+	{
+		if(m_items.capacity() == 0)
+			m_items.reserve(MIN_CAPACITY);
+	}
+
+	size_type lowerIndex(const K &key) const
+	{
+		size_type n = m_items.size();
+		if(n <= LINEAR_SEARCH_SIZE)
+		{
+			size_type i = 0;
+			while(i < n && m_items[i].first < key)
+				i++;
+			return i;
+		}
+		size_type first = 0;
+		while(n > 0)
+		{
+			size_type half = n / 2;
+			if(m_items[first + half].first < key)
+			{
+				first += half + 1;
+				n -= half + 1;
+			}
+			else
+				n = half;
+		}
+		return first;
+	}
+};
+
+}
@@ -6,67 +6,85 @@ namespace DualRPC
 {
 
 FutureResult::FutureResult() : 
-	m_activated(false)
+	m_activated(false),
+	m_running(false)
 {
 }
 
-void FutureResult::execFirstItem()
+void FutureResult::add(const Callback &cb, const Callback &eb)
 {
-	CallbackList::iterator it = m_callbackList.begin();
-	if(it == m_callbackList.end())
+	boost::mutex::scoped_lock lock(m_mutex);
+	m_callbackList.push_back(CallbackList::value_type(cb, eb));
+	if(!m_activated || m_running)
 		return;
+	m_running = true;
+	lock.unlock();
+	runCallbacks();
+}
 
-	try
-	{
-		if(m_lastResult.isException())
-			m_lastResult = it->second(m_lastResult);
-		else
-			m_lastResult = it->first(m_lastResult);
-	}
-	catch(std::exception &e)
+Variant FutureResult::runCallbacks()
+{
+	boost::mutex::scoped_lock lock(m_mutex);
+	while(!m_callbackList.empty())
 	{
-		m_lastResult = e;
+		CallbackList::value_type item(std::move(m_callbackList.front()));
+		m_callbackList.pop_front();
+		lock.unlock();
+
+		Variant result;
+		try
+		{
+			if(m_lastResult.isException())
+				result = item.second(m_lastResult);
+			else
+				result = item.first(m_lastResult);
+		}
+		catch(std::exception &e)
+		{
+			result = e;
+		}
+		//Only the running thread uses the result, the one replaced goes unlocked
+		m_lastResult = std::move(result);
+		lock.lock();
 	}
-	m_callbackList.erase(it);
+	m_running = false;
+	return m_lastResult;
 }
 
 void FutureResult::addCallback(const Callback &cb)
 {
-	m_callbackList.push_back(CallbackList::value_type(cb, Callback()));
-	if(m_activated)
-		execFirstItem();
+	add(cb, Callback());
 }
 
 void FutureResult::addErrback(const Callback &eb)
 {
-	m_callbackList.push_back(CallbackList::value_type(Callback(), eb));
-	if(m_activated)
-		execFirstItem();
+	add(Callback(), eb);
 }
 
 void FutureResult::addBoth(const Callback &cb, const Callback &eb)
 {
-	m_callbackList.push_back(CallbackList::value_type(cb, eb));
-	if(m_activated)
-		execFirstItem();
+	add(cb, eb);
 }
 
 void FutureResult::addBoth(const Callback &cb)
 {
-	m_callbackList.push_back(CallbackList::value_type(cb, cb));
-	if(m_activated)
-		execFirstItem();
+	add(cb, cb);
 }
 
 Variant FutureResult::callback(const Variant &result)
 {
-	m_activated = true;
-	m_lastResult = result;
-	while(!m_callbackList.empty())
+	return callback(Variant(result));
+}
+
+Variant FutureResult::callback(Variant &&result)
+{
 	{
-		execFirstItem();
+		boost::mutex::scoped_lock lock(m_mutex);
+		m_activated = true;
+		m_lastResult = std::move(result);
+		m_running = true;
 	}
-	return m_lastResult;
+	return runCallbacks();
 }
 
 Variant FutureResult::errback(const Variant &error)
@@ -74,6 +92,11 @@ Variant FutureResult::errback(const Variant &error)
 	return callback(error);
 }
 
+Variant FutureResult::errback(Variant &&error)
+{
+	return callback(std::move(error));
+}
+
 ///////////////////////////////////////////////////////////////////////////////////
 
 FutureResultList::FutureResultList() : 
@@ -107,7 +130,7 @@ Variant FutureResultList::internalCallback(ResultList::iterator it, const Varian
 		Variant result;
 		for(ResultList::iterator j = m_results.begin(); j != m_results.end(); ++j)
 		{
-			result.add(j->second);
+			result.add(std::move(j->second));
 		}
 		m_callback(result);
 	}
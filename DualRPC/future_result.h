@@ -1,6 +1,7 @@
 #pragma once
 
 #include <boost/bimap.hpp>
+#include <boost/thread/mutex.hpp>
 #include <map>
 
 #include "defs.h"
@@ -9,6 +10,8 @@
 namespace DualRPC
 {
 
+//Completed and given callbacks from any thread. Callbacks run one at a time
+//in the order added, outside the future's lock
 class FutureResult
 {
 public:
@@ -20,16 +23,21 @@ class FutureResult
 	void addBoth(const Callback &callback);
 
 	Variant callback(const Variant &result);
+	Variant callback(Variant &&result);
 	Variant errback(const Variant &error);
+	Variant errback(Variant &&error);
 
 private:
 	typedef std::list< std::pair<Callback, Callback> > CallbackList;
 
-	bool m_activated;
+	boost::mutex m_mutex;
+	//m_running is set while a thread runs the callbacks, others only add to the list
+	bool m_activated, m_running;
 	Variant m_lastResult;
 	CallbackList m_callbackList;
 
-	void execFirstItem();
+	void add(const Callback &callback, const Callback &errback);
+	Variant runCallbacks();
 };
 
 class FutureResultList
@@ -1,13 +1,15 @@
 ﻿#include "stdafx.h"
+
+//Before logger.h, the thread headers include chrono too
+#define BOOST_CHRONO_VERSION 2
+#include <boost/chrono/chrono_io.hpp>
+
 #include "logger.h"
 
 #include <algorithm>
 #include <iostream>
 #include <sstream>
 
-#define BOOST_CHRONO_VERSION 2
-#include <boost/chrono/chrono_io.hpp>
-
 LogMessage::LogMessage() :
 	level(DEBUG_LEVEL), senderID(0), file(nullptr), func(nullptr), line(0)
 {
@@ -70,6 +72,7 @@ void Logger::write(const LogMessage &message)
 	if(message.level < m_level)
 		return;
 
+	boost::mutex::scoped_lock lock(m_mutex);
 	auto it = m_senders.find(message.senderID);
 	if(it == m_senders.end())
 		return;
@@ -94,7 +97,7 @@ void LineFormatter::write(const LogMessage &message)
 	LogMessage msg = message;
 
 	if(m_param & LF_TIME)
-		ss << time_fmt(timezone::local, m_timeFormat) << system_clock::now() << " ";
+		ss << time_fmt(boost::chrono::timezone::local, m_timeFormat) << system_clock::now() << " ";
 
 	if(m_param & LF_LEVEL)
 		ss << levelNames[msg.level] << " ";
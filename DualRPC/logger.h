@@ -8,6 +8,7 @@
 #include <boost/function.hpp>
 #include "boost/shared_ptr.hpp"
 #include <boost/format.hpp>
+#include <boost/thread/mutex.hpp>
 
 enum ENUM_LOG_LEVEL
 {
@@ -68,6 +69,8 @@ class Logger : public ILogSink
 	
 	typedef std::map<int, SenderInfo> SenderMap;	
 
+	//Messages come from every I/O thread
+	boost::mutex m_mutex;
 	SenderMap m_senders;
 	ENUM_LOG_LEVEL m_level;
 };
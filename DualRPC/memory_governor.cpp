@@ -0,0 +1,236 @@
+﻿#include "stdafx.h"
+#include "memory_governor.h"
+#include "transport.h"
+#include "logger.h"
+
+#include <boost/format.hpp>
+#include <stdexcept>
+
+namespace DualRPC
+{
+
+MemoryGovernor::Connection::Connection() :
+	total(0),
+	bulk(false),
+	paused(false)
+{
+	for(int k = 0; k < MEM_KINDS; k++)
+		bytes[k] = 0;
+}
+
+MemoryGovernor::MemoryGovernor(std::size_t budget) :
+	m_budget(budget),
+	m_bulkFrameSize(64*1024),
+	m_pauseWatermark(90),
+	m_resumeWatermark(70),
+	m_total(0),
+	m_peak(0),
+	m_pausedAt(0),
+	m_pausedCount(0),
+	m_pauses(0)
+{
+	for(int k = 0; k < MEM_KINDS; k++)
+		m_usage[k] = 0;
+}
+
+void MemoryGovernor::setBudget(std::size_t bytes)
+{
+	boost::mutex::scoped_lock lock(m_mutex);
+	m_budget = bytes;
+}
+
+std::size_t MemoryGovernor::getBudget() const
+{
+	boost::mutex::scoped_lock lock(m_mutex);
+	return m_budget;
+}
+
+void MemoryGovernor::setWatermarks(unsigned int pause, unsigned int resume)
+{
+	if(resume > pause || pause > 100)
+		throw std::runtime_error((boost::format("Invalid memory watermarks %1%/%2%") % pause % resume).str());
+
+	boost::mutex::scoped_lock lock(m_mutex);
+	m_pauseWatermark = pause;
+	m_resumeWatermark = resume;
+}
+
+unsigned int MemoryGovernor::getPauseWatermark() const
+{
+	boost::mutex::scoped_lock lock(m_mutex);
+	return m_pauseWatermark;
+}
+
+unsigned int MemoryGovernor::getResumeWatermark() const
+{
+	boost::mutex::scoped_lock lock(m_mutex);
+	return m_resumeWatermark;
+}
+
+void MemoryGovernor::setBulkFrameSize(std::size_t size)
+{
+	boost::mutex::scoped_lock lock(m_mutex);
+	m_bulkFrameSize = size;
+}
+
+std::size_t MemoryGovernor::getBulkFrameSize() const
+{
+	boost::mutex::scoped_lock lock(m_mutex);
+	return m_bulkFrameSize;
+}
+
+std::size_t MemoryGovernor::usage() const
+{
+	boost::mutex::scoped_lock lock(m_mutex);
+	return m_total;
+}
+
+std::size_t MemoryGovernor::usage(MemoryKind kind) const
+{
+	boost::mutex::scoped_lock lock(m_mutex);
+	return m_usage[kind];
+}
+
+std::size_t MemoryGovernor::peakUsage() const
+{
+	boost::mutex::scoped_lock lock(m_mutex);
+	return m_peak;
+}
+
+std::size_t MemoryGovernor::connectionCount() const
+{
+	boost::mutex::scoped_lock lock(m_mutex);
+	return m_connections.size();
+}
+
+std::size_t MemoryGovernor::pausedCount() const
+{
+	boost::mutex::scoped_lock lock(m_mutex);
+	return m_pausedCount;
+}
+
+std::size_t MemoryGovernor::pauses() const
+{
+	boost::mutex::scoped_lock lock(m_mutex);
+	return m_pauses;
+}
+
+void MemoryGovernor::attach(const ClientBasePtr &client)
+{
+	boost::mutex::scoped_lock lock(m_mutex);
+	m_connections[client.get()].client = client;
+}
+
+void MemoryGovernor::detach(ClientBase *client)
+{
+	ClientList pause, resume;
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+		ConnectionMap::iterator it = m_connections.find(client);
+		if(it == m_connections.end())
+			return;
+		for(int k = 0; k < MEM_KINDS; k++)
+			m_usage[k] -= it->second.bytes[k];
+		m_total -= it->second.total;
+		if(it->second.paused)
+			--m_pausedCount;
+		m_connections.erase(it);
+		balance(pause, resume);
+	}
+	throttle(pause, true);
+	throttle(resume, false);
+}
+
+void MemoryGovernor::track(ClientBase *client, MemoryKind kind, std::ptrdiff_t bytes, std::size_t frameSize)
+{
+	//Connections are paused and resumed outside the lock, the last reference
+	//to one may go with the lists
+	ClientList pause, resume;
+	std::size_t total, budget, paused;
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+		ConnectionMap::iterator it = m_connections.find(client);
+		if(it == m_connections.end())
+			return;
+		Connection &c = it->second;
+		c.bytes[kind] += bytes;
+		c.total += bytes;
+		if(kind == MEM_RECEIVE)
+			c.bulk = frameSize >= m_bulkFrameSize;
+		m_usage[kind] += bytes;
+		m_total += bytes;
+		if(m_total > m_peak)
+			m_peak = m_total;
+		if(m_budget == 0 && m_pausedCount == 0)
+			return;
+
+		balance(pause, resume);
+		total = m_total;
+		budget = m_budget;
+		paused = m_pausedCount;
+	}
+
+	if(!pause.empty())
+		LOG_WARN_FMT(0, "Memory %1% of %2% bytes, reads paused on %3% connections", total % budget % paused);
+	if(!resume.empty())
+		LOG_INFO_FMT(0, "Memory %1% of %2% bytes, reads resumed on %3% connections", total % budget % resume.size());
+	throttle(pause, true);
+	throttle(resume, false);
+}
+
+void MemoryGovernor::balance(ClientList &pause, ClientList &resume)
+{
+	std::size_t pauseMark = m_budget / 100 * m_pauseWatermark;
+	std::size_t resumeMark = m_budget / 100 * m_resumeWatermark;
+
+	if(m_pausedCount > 0 && (m_budget == 0 || m_total <= resumeMark))
+	{
+		for(ConnectionMap::iterator it = m_connections.begin(); it != m_connections.end(); ++it)
+		{
+			if(!it->second.paused)
+				continue;
+			it->second.paused = false;
+			ClientBasePtr client = it->second.client.lock();
+			if(client)
+				resume.push_back(client);
+		}
+		m_pausedCount = 0;
+		return;
+	}
+
+	//Paused connections stop taking more, the next one is paused only if
+	//usage still grows
+	if(m_budget == 0 || m_total < pauseMark ||
+		(m_pausedCount > 0 && m_total < m_pausedAt + m_budget / 32))
+		return;
+
+	Connection *next = nullptr;
+	for(ConnectionMap::iterator it = m_connections.begin(); it != m_connections.end(); ++it)
+	{
+		Connection &c = it->second;
+		if(c.paused)
+			continue;
+		if(!next || (next->bulk != c.bulk ? c.bulk : c.total > next->total))
+			next = &c;
+	}
+	if(!next)
+		return;
+
+	//A connection already gone is detached by its destructor
+	ClientBasePtr client = next->client.lock();
+	if(!client)
+		return;
+	next->paused = true;
+	++m_pausedCount;
+	++m_pauses;
+	m_pausedAt = m_total;
+	pause.push_back(client);
+}
+
+void MemoryGovernor::throttle(const ClientList &clients, bool value)
+{
+	for(ClientList::const_iterator it = clients.begin(); it != clients.end(); ++it)
+		(*it)->throttleReads(value);
+}
+
+}
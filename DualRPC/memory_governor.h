@@ -0,0 +1,93 @@
+﻿#pragma once
+
+#include <map>
+#include <vector>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "defs.h"
+
+namespace DualRPC
+{
+
+enum MemoryKind
+{
+	MEM_RECEIVE,	//read buffers and frames being decoded
+	MEM_SEND,		//messages queued for writing
+	MEM_CALLBACKS,	//calls waiting for their answers
+	MEM_OBJECTS,	//objects registered for the connection
+	MEM_KINDS
+};
+
+//Process-wide budget of the memory connections hold. Connections report what
+//they take and free, and from the pause watermark on the governor stops reads
+//on one more connection each time usage grows by a step: bulk transfers first,
+//then the connections holding the most. Reads go on below the resume watermark.
+//Thread safe, outlives the connections attached to it
+class MemoryGovernor
+{
+public:
+	//Estimates for what is not counted in bytes
+	static const std::size_t CALLBACK_BYTES = 256;
+	static const std::size_t OBJECT_BYTES = 128;
+
+	//0 only counts
+	explicit MemoryGovernor(std::size_t budget = 0);
+
+	void setBudget(std::size_t bytes);
+	std::size_t getBudget() const;
+	//Percents of the budget
+	void setWatermarks(unsigned int pause, unsigned int resume);
+	unsigned int getPauseWatermark() const;
+	unsigned int getResumeWatermark() const;
+	//Connections receiving frames of this size on average are bulk transfers
+	void setBulkFrameSize(std::size_t size);
+	std::size_t getBulkFrameSize() const;
+
+	std::size_t usage() const;
+	std::size_t usage(MemoryKind kind) const;
+	std::size_t peakUsage() const;
+	std::size_t connectionCount() const;
+	std::size_t pausedCount() const;
+	//Times reads were paused
+	std::size_t pauses() const;
+
+private:
+	friend class ClientBase;
+
+	struct Connection
+	{
+		boost::weak_ptr<ClientBase> client;
+		std::size_t bytes[MEM_KINDS];
+		std::size_t total;
+		bool bulk, paused;
+
+		Connection();
+	};
+	typedef std::map<ClientBase*, Connection> ConnectionMap;
+	typedef std::vector<ClientBasePtr> ClientList;
+
+	mutable boost::mutex m_mutex;
+	ConnectionMap m_connections;
+	std::size_t m_budget, m_bulkFrameSize;
+	unsigned int m_pauseWatermark, m_resumeWatermark;
+	std::size_t m_usage[MEM_KINDS];
+	std::size_t m_total, m_peak;
+	//Usage when the last connection was paused
+	std::size_t m_pausedAt;
+	std::size_t m_pausedCount, m_pauses;
+
+	void attach(const ClientBasePtr &client);
+	void detach(ClientBase *client);
+	//frameSize is the average size of the frames the connection receives, 
+	//passed with MEM_RECEIVE only
+	void track(ClientBase *client, MemoryKind kind, std::ptrdiff_t bytes, std::size_t frameSize);
+	//Connections to pause or resume after the change, called with the mutex held
+	void balance(ClientList &pause, ClientList &resume);
+	static void throttle(const ClientList &clients, bool value);
+
+	MemoryGovernor(const MemoryGovernor&);
+	MemoryGovernor& operator=(const MemoryGovernor&);
+};
+
+}
@@ -8,6 +8,18 @@
 namespace DualRPC
 {
 
+bool IObject::hasViewMethod(const string &name) const
+{
+	return false;
+}
+
+Variant IObject::callView(const string &name, const VariantView &args, bool withResult, 
+		float timeout, FutureResultPtr &written)
+{
+	return call(name, args.toVariant(), withResult, timeout, written);
+}
+
+///////////////////////////////////////////////////////////////////////////////////
 LocalObject::~LocalObject() 
 {
 }
@@ -17,12 +29,19 @@ void LocalObject::registerMethod(const string &name, const Callback &method)
 	m_methods[name] = method;
 }
 
+void LocalObject::registerViewMethod(const string &name, const ViewCallback &method)
+{
+	m_viewMethods[name] = method;
+}
+
 Variant LocalObject::call(const string &name, const Variant &args, bool withResult, 
 		float timeout, FutureResultPtr &written)
 {
-	if(m_methods.count(name) > 0)
+	boost::recursive_mutex::scoped_lock lock(m_mutex);
+	RemoteMethodMap::iterator it = m_methods.find(name);
+	if(it != m_methods.end())
 	{
-		Variant v = m_methods[name](args);
+		Variant v = it->second(args);
 		if(m_written)
 		{
 			written = m_written;
@@ -34,29 +53,52 @@ Variant LocalObject::call(const string &name, const Variant &args, bool withResu
 	throw std::runtime_error((boost::format("Method '%1%' not exists") % name).str());
 }
 
+bool LocalObject::hasViewMethod(const string &name) const
+{
+	boost::recursive_mutex::scoped_lock lock(m_mutex);
+	return m_viewMethods.find(name) != m_viewMethods.end();
+}
+
+Variant LocalObject::callView(const string &name, const VariantView &args, bool withResult, 
+		float timeout, FutureResultPtr &written)
+{
+	boost::recursive_mutex::scoped_lock lock(m_mutex);
+	RemoteViewMethodMap::iterator it = m_viewMethods.find(name);
+	if(it == m_viewMethods.end())
+		return IObject::callView(name, args, withResult, timeout, written);
+
+	Variant v = it->second(args);
+	if(m_written)
+	{
+		written = m_written;
+		m_written.reset();
+	}
+	return v;
+}
+
 void LocalObject::returnWritten(const FutureResultPtr &written)
 {
 	m_written = written;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////
-int RemoteObject::count = 0;
+boost::detail::atomic_count RemoteObject::count(0);
 
 RemoteObject::RemoteObject(const RemoteObject &obj) :
-	m_clientPtr(obj.m_clientPtr), m_id(obj.m_id)
+	m_clientPtr(obj.m_clientPtr), m_id(obj.m_id), m_priority(obj.m_priority)
 {
-	count++;
+	++count;
 }
 
 RemoteObject::RemoteObject(const ClientBasePtr &client, ObjectID id) :
-	m_clientPtr(client), m_id(id)
+	m_clientPtr(client), m_id(id), m_priority(PRIORITY_NORMAL)
 {
-	count++;
+	++count;
 }
 
 RemoteObject::~RemoteObject()
 {
-	count--;
+	--count;
 	if(m_id != 0)
 		m_clientPtr->destroyObject(m_id);
 }
@@ -64,7 +106,33 @@ RemoteObject::~RemoteObject()
 Variant RemoteObject::call(const string &name, const Variant &args, bool withResult,
 	float timeout, FutureResultPtr &written)
 {
-	return m_clientPtr->call(m_id, name, args, withResult, timeout, written);
+	return m_clientPtr->call(m_id, name, args, withResult, timeout, written, m_priority);
+}
+
+Variant RemoteObject::call(MessagePriority priority, const string &name, const Variant &args, 
+	bool withResult, float timeout, FutureResultPtr &written)
+{
+	return m_clientPtr->call(m_id, name, args, withResult, timeout, written, priority);
+}
+
+const ClientBasePtr& RemoteObject::client() const
+{
+	return m_clientPtr;
+}
+
+ObjectID RemoteObject::id() const
+{
+	return m_id;
+}
+
+void RemoteObject::setPriority(MessagePriority priority)
+{
+	m_priority = priority;
+}
+
+MessagePriority RemoteObject::priority() const
+{
+	return m_priority;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////
@@ -73,6 +141,11 @@ ObjectsStorage::ObjectsStorage()
 	m_nextObjectID = 100;
 }
 
+ObjectsStorage::Mutex& ObjectsStorage::mutex() const
+{
+	return m_mutex;
+}
+
 ObjectID ObjectsStorage::getNextObjectID()
 {
 	return m_nextObjectID++;
@@ -80,21 +153,31 @@ ObjectID ObjectsStorage::getNextObjectID()
 
 ObjectID ObjectsStorage::registerObject(const IObjectPtr &obj, const ClientBasePtr &client, bool global)
 {
+	Lock lock(m_mutex);
 	ObjectID id = global ? 0 : getNextObjectID();
 	m_objects[id] = obj;
 	m_clientLocalObjects[client].push_back(id);
+	if(client)
+		client->trackMemory(MEM_OBJECTS, MemoryGovernor::OBJECT_BYTES);
 	return id;
 }
 
+IObjectPtr ObjectsStorage::findObject(ObjectID id) const
+{
+	Lock lock(m_mutex);
+	auto it = m_objects.find(id);
+	return it != m_objects.end() ? it->second : IObjectPtr();
+}
+
 Variant ObjectsStorage::localCall(ObjectID id, const string &name,
 	const Variant &args, bool withResult, float timeout, FutureResultPtr &written)
 {
-	auto it = m_objects.find(id);
-	if(it != m_objects.end())
+	IObjectPtr obj = findObject(id);
+	if(obj)
 	{
 		try
 		{
-			return it->second->call(name, args, withResult, timeout, written);
+			return obj->call(name, args, withResult, timeout, written);
 		}
 		catch(std::exception &e)
 		{
@@ -112,6 +195,75 @@ Variant ObjectsStorage::localCall(ObjectID id, const string &name,
 	}
 }
 
+bool ObjectsStorage::hasViewMethod(ObjectID id, const string &name) const
+{
+	IObjectPtr obj = findObject(id);
+	return obj && obj->hasViewMethod(name);
+}
+
+Variant ObjectsStorage::localViewCall(ObjectID id, const string &name,
+	const VariantView &args, bool withResult, float timeout, FutureResultPtr &written)
+{
+	IObjectPtr obj = findObject(id);
+	if(obj)
+	{
+		try
+		{
+			return obj->callView(name, args, withResult, timeout, written);
+		}
+		catch(std::exception &e)
+		{
+			return Variant(e);
+		}
+		catch(...)
+		{
+			return Variant(std::runtime_error("Unknown exception")); 
+		}
+	}
+	else 
+	{
+		return Variant(std::runtime_error(
+			(boost::format("Object #%1% not registered") % id).str()));
+	}
+}
+
+boost::shared_ptr<RemoteObject> ObjectsStorage::findRemoteObject(ObjectID id) const
+{
+	return boost::dynamic_pointer_cast<RemoteObject, IObject>(findObject(id));
+}
+
+Variant ObjectsStorage::relayCall(ObjectID id, const string &name, const Variant &args, 
+	MessagePriority priority, bool withResult, const ClientBasePtr &origin, FutureResultPtr &written)
+{
+	boost::shared_ptr<RemoteObject> obj = findRemoteObject(id);
+	if(!obj)
+	{
+		return Variant(std::runtime_error(
+			(boost::format("Object #%1% not registered") % id).str()));
+	}
+
+	try
+	{
+		return obj->client()->relayCall(obj->id(), name, args, priority, withResult, origin, written);
+	}
+	catch(std::exception &e)
+	{
+		return Variant(e);
+	}
+}
+
+Variant ObjectsStorage::relayVariant(InputBuffer &in, const ClientBasePtr &from, const ClientBasePtr &to)
+{
+	//Encoded again for the receiver's wire version in one pass without decoding.
+	//Keys go as text, entries of the receiver's string table are only defined 
+	//by values it packs itself, so they can not arrive out of order
+	OutputBuffer out(in.remaining() + 16, to->wireVersion());
+	out.setPlainTypes(to->wireVersion() == WIRE_V1);
+	Variant::transcode(in, out, boost::bind(&ObjectsStorage::relayIDReplacer, this, _1, from, to));
+
+	return Variant::fromPacked(std::move(out.str()));
+}
+
 /*
 bool ObjectsStorage::hasObjects(const Variant &v) const
 {
@@ -198,25 +350,59 @@ Variant ObjectsStorage::objectToIDReplacer(const Variant &v, const ClientBasePtr
 	return Variant(registerObject(v.toObject(), client), true);
 }
 
-void ObjectsStorage::packVariant(std::ostream &stream, const Variant &v, const ClientBasePtr &client)
+Variant ObjectsStorage::relayIDReplacer(const Variant &v, const ClientBasePtr &from, const ClientBasePtr &to)
+{
+	//Object ids of the sender become proxies owned by the receiver
+	return Variant(registerObject(IObjectPtr(new RemoteObject(from, v.toObjectID())), to), true);
+}
+
+Variant ObjectsStorage::proxyRecordingReplacer(const Variant &v, const ClientBasePtr &client, 
+	ObjectIDList *proxies)
+{
+	boost::shared_ptr<RemoteObject> proxy = boost::dynamic_pointer_cast<RemoteObject, IObject>(v.toObject());
+	if(proxy && proxy->client() == client && proxy->id() != 0)
+		proxies->push_back(proxy->id());
+	return objectToIDReplacer(v, client);
+}
+
+void ObjectsStorage::packVariant(OutputBuffer &out, const Variant &v, const ClientBasePtr &client, 
+	ObjectIDList *proxies)
+{
+	if(proxies)
+		v.pack(out, boost::bind(&ObjectsStorage::proxyRecordingReplacer, this, _1, client, proxies));
+	else
+		v.pack(out, boost::bind(&ObjectsStorage::objectToIDReplacer, this, _1, client));
+}
+
+void ObjectsStorage::unpackVariant(InputBuffer &in, Variant &v, const ClientBasePtr &client)
 {
-	v.pack(stream, boost::bind(&ObjectsStorage::objectToIDReplacer, this, _1, client));
+	v.unpack(in, boost::bind(&ObjectsStorage::IDtoObjectReplacer, this, _1, client));
 }
 
-void ObjectsStorage::unpackVariant(std::istream &stream, Variant &v, const ClientBasePtr &client)
+void ObjectsStorage::unpackVariant(InputBuffer &in, Variant &v, Arena &arena, const ClientBasePtr &client)
 {
-	v.unpack(stream, boost::bind(&ObjectsStorage::IDtoObjectReplacer, this, _1, client));
+	v.unpack(in, arena, boost::bind(&ObjectsStorage::IDtoObjectReplacer, this, _1, client));
 }
 
 void ObjectsStorage::freeClientObjects(const ClientBasePtr &client)
 {
+	//Destroyed once the lock is released, proxies among them release their 
+	//objects on their connections
+	std::vector<IObjectPtr> objects;
+	Lock lock(m_mutex);
 	ClientOwnedObjectMap::iterator f = m_clientLocalObjects.find(client);
 	if(f != m_clientLocalObjects.end())
 	{
 		for(auto i = f->second.begin(); i != f->second.end(); ++i)
 		{
-			m_objects.erase(*i);
+			ObjectMap::iterator obj = m_objects.find(*i);
+			if(obj == m_objects.end())
+				continue;
+			objects.push_back(obj->second);
+			m_objects.erase(obj);
 		}
+		if(client)
+			client->trackMemory(MEM_OBJECTS, -(std::ptrdiff_t)(f->second.size() * MemoryGovernor::OBJECT_BYTES));
 		m_clientLocalObjects.erase(f);
 	}	
 }
@@ -225,8 +411,12 @@ void ObjectsStorage::deleteObject(ObjectID id)
 {
 	if(id == 0) return;
 
+	//As in freeClientObjects, destroyed after the lock
+	IObjectPtr obj;
+	Lock lock(m_mutex);
 	auto f = m_objects.find(id);
 	if(f == m_objects.end()) return;
+	obj = f->second;
 
 	auto c = m_clientLocalObjects.begin();
 	while(c != m_clientLocalObjects.end())
@@ -235,7 +425,11 @@ void ObjectsStorage::deleteObject(ObjectID id)
 		while(i != c->second.end())
 		{
 			if(id == *i)
+			{
 				i = c->second.erase(i);
+				if(c->first)
+					c->first->trackMemory(MEM_OBJECTS, -(std::ptrdiff_t)MemoryGovernor::OBJECT_BYTES);
+			}
 			else ++i;
 		}
 		if(c->second.empty())
@@ -1,9 +1,13 @@
 ﻿#pragma once
 
 #include <map>
+#include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/detail/atomic_count.hpp>
 
 #include "defs.h"
 #include "variant.h"
+#include "variant_view.h"
 #include "future_result.h"
 
 namespace DualRPC
@@ -13,8 +17,14 @@ struct IObject
 {
 	virtual Variant call(const string &name, const Variant &args, bool withResult = true, 
 		float timeout = -1, FutureResultPtr &written = FutureResultPtr()) = 0;	
+
+	//Methods reading their arguments in place from the received message
+	virtual bool hasViewMethod(const string &name) const;
+	virtual Variant callView(const string &name, const VariantView &args, bool withResult = true, 
+		float timeout = -1, FutureResultPtr &written = FutureResultPtr());
 };
 
+//Calls to one object run one at a time, objects sharing state guard it themselves
 class LocalObject : public IObject
 {
 public:
@@ -22,23 +32,31 @@ class LocalObject : public IObject
 	virtual ~LocalObject();
 
 	void registerMethod(const string &name, const Callback &method);
+	void registerViewMethod(const string &name, const ViewCallback &method);
 	Variant call(const string &name, const Variant &args = Variant(), bool withResult = true, 
 		float timeout = -1, FutureResultPtr &written = FutureResultPtr()) override;	
 
+	bool hasViewMethod(const string &name) const override;
+	Variant callView(const string &name, const VariantView &args, bool withResult = true, 
+		float timeout = -1, FutureResultPtr &written = FutureResultPtr()) override;
+
 protected:
 	void returnWritten(const FutureResultPtr &written);
 
 private:
 	typedef std::map<string, Callback> RemoteMethodMap;
+	typedef std::map<string, ViewCallback> RemoteViewMethodMap;
 
+	mutable boost::recursive_mutex m_mutex;
 	RemoteMethodMap m_methods;
+	RemoteViewMethodMap m_viewMethods;
 	FutureResultPtr m_written;
 };
 
 class RemoteObject : public IObject
 {
 public:
-	static int count;
+	static boost::detail::atomic_count count;
 
 	RemoteObject(const RemoteObject &obj);
 	RemoteObject(const ClientBasePtr &client, ObjectID id);
@@ -47,18 +65,46 @@ class RemoteObject : public IObject
 	Variant call(const string &name, const Variant &args = Variant(), bool withResult = true, 
 		float timeout = -1, FutureResultPtr &written = FutureResultPtr()) override;	
 
+	//One call in another class than the proxy's
+	Variant call(MessagePriority priority, const string &name, const Variant &args = Variant(), 
+		bool withResult = true, float timeout = -1, FutureResultPtr &written = FutureResultPtr());
+
+	const ClientBasePtr& client() const;
+	ObjectID id() const;
+
+	//Class of the calls through the proxy, PRIORITY_NORMAL by default
+	void setPriority(MessagePriority priority);
+	MessagePriority priority() const;
+
 private:
 	ClientBasePtr m_clientPtr;
 	ObjectID m_id;
+	MessagePriority m_priority;
 };
 
 class ObjectsStorage
 {
 public:	
+	typedef boost::recursive_mutex Mutex;
+	typedef boost::unique_lock<Mutex> Lock;
+
 	ObjectsStorage();
 
+	//Guards the maps of objects only. Objects are called and destroyed outside
+	//it, a connection's lock is never taken while it is held
+	Mutex& mutex() const;
+
 	Variant localCall(ObjectID id, const string &name, const Variant &args, 
 		bool withResult = true, float timeout = -1, FutureResultPtr &written = FutureResultPtr());
+	bool hasViewMethod(ObjectID id, const string &name) const;
+	Variant localViewCall(ObjectID id, const string &name, const VariantView &args, 
+		bool withResult = true, float timeout = -1, FutureResultPtr &written = FutureResultPtr());
+
+	//Calls on proxies of another connection's objects are passed on as packed bytes
+	boost::shared_ptr<RemoteObject> findRemoteObject(ObjectID id) const;
+	Variant relayCall(ObjectID id, const string &name, const Variant &args, MessagePriority priority,
+		bool withResult, const ClientBasePtr &origin, FutureResultPtr &written = FutureResultPtr());
+	Variant relayVariant(InputBuffer &in, const ClientBasePtr &from, const ClientBasePtr &to);
 
 	ObjectID registerObject(const IObjectPtr &obj, const ClientBasePtr &owner = ClientBasePtr(), bool global = false);
 	void deleteObject(ObjectID id);
@@ -71,9 +117,14 @@ class ObjectsStorage
 
 	Variant IDtoObjectReplacer(const Variant &v, const ClientBasePtr &client);
 	Variant objectToIDReplacer(const Variant &v, const ClientBasePtr &client);
+	Variant relayIDReplacer(const Variant &v, const ClientBasePtr &from, const ClientBasePtr &to);
+	//As objectToIDReplacer, ids of the client's proxies met are added to proxies
+	Variant proxyRecordingReplacer(const Variant &v, const ClientBasePtr &client, ObjectIDList *proxies);
 
-	void packVariant(std::ostream &stream, const Variant &v, const ClientBasePtr &client);
-	void unpackVariant(std::istream &stream, Variant &v, const ClientBasePtr &client);
+	void packVariant(OutputBuffer &out, const Variant &v, const ClientBasePtr &client, 
+		ObjectIDList *proxies = nullptr);
+	void unpackVariant(InputBuffer &in, Variant &v, const ClientBasePtr &client);
+	void unpackVariant(InputBuffer &in, Variant &v, Arena &arena, const ClientBasePtr &client);
 
 	void freeClientObjects(const ClientBasePtr &client);
 
@@ -81,11 +132,13 @@ class ObjectsStorage
 	typedef std::map<ObjectID, IObjectPtr> ObjectMap;	
 	typedef std::map<ClientBasePtr, ObjectIDList> ClientOwnedObjectMap;
 
+	mutable Mutex m_mutex;
 	ObjectMap m_objects;
 	ObjectID m_nextObjectID;
 	ClientOwnedObjectMap m_clientLocalObjects;
 
 	ObjectID getNextObjectID();	
+	IObjectPtr findObject(ObjectID id) const;
 };
 
 
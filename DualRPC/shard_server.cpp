@@ -0,0 +1,283 @@
+﻿#include "stdafx.h"
+#include "shard_server.h"
+#include "future_result.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <boost/thread/thread.hpp>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace DualRPC
+{
+
+AsioShardServer::Shard::Shard(const boost::shared_ptr<aio::io_service> &iosvc) :
+	iosvc(iosvc),
+	server(*iosvc, storage)
+{
+}
+
+AsioShardServer::AsioShardServer(unsigned int shards) :
+	m_nextShard(0)
+{
+	if(shards == 0)
+		shards = std::max(1u, boost::thread::hardware_concurrency());
+
+	boost::shared_ptr<aio::io_service> shared;
+	for(unsigned int i = 0; i < shards; ++i)
+	{
+		boost::shared_ptr<aio::io_service> iosvc;
+		if(portPerShard())
+			iosvc.reset(new aio::io_service(1));
+		else
+		{
+			if(!shared)
+				shared.reset(new aio::io_service());
+			iosvc = shared;
+		}
+		ShardPtr shard(new Shard(iosvc));
+		shard->server.m_shards = this;
+		shard->server.m_shardIndex = i;
+		m_shards.push_back(shard);
+	}
+}
+
+AsioShardServer::~AsioShardServer()
+{
+}
+
+unsigned int AsioShardServer::shardCount() const
+{
+	return (unsigned int)m_shards.size();
+}
+
+bool AsioShardServer::portPerShard() const
+{
+#ifdef SO_REUSEPORT
+	return true;
+#else
+	return false;
+#endif
+}
+
+aio::io_service& AsioShardServer::ioService(unsigned int shard)
+{
+	return *m_shards[shard]->iosvc;
+}
+
+ObjectsStorage& AsioShardServer::storage(unsigned int shard)
+{
+	return m_shards[shard]->storage;
+}
+
+AsioServer& AsioShardServer::server(unsigned int shard)
+{
+	return m_shards[shard]->server;
+}
+
+void AsioShardServer::setGlobalObject(const IObjectPtr &obj)
+{
+	Shard &first = *m_shards.front();
+	first.storage.registerObject(obj, ClientBasePtr(), true);
+	for(std::size_t i = 1; i < m_shards.size(); ++i)
+		m_shards[i]->storage.registerObject(IObjectPtr(new ShardObject(first, *m_shards[i], 0)),
+			ClientBasePtr(), true);
+}
+
+void AsioShardServer::setDisconnectTimeout(unsigned int sec)
+{
+	for(auto it = m_shards.begin(); it != m_shards.end(); ++it)
+		(*it)->server.setDisconnectTimeout(sec);
+}
+
+void AsioShardServer::setMaxMessageSize(unsigned int size)
+{
+	for(auto it = m_shards.begin(); it != m_shards.end(); ++it)
+		(*it)->server.setMaxMessageSize(size);
+}
+
+void AsioShardServer::setArenaMode(bool value)
+{
+	for(auto it = m_shards.begin(); it != m_shards.end(); ++it)
+		(*it)->server.setArenaMode(value);
+}
+
+void AsioShardServer::setFragmentSize(unsigned int size)
+{
+	for(auto it = m_shards.begin(); it != m_shards.end(); ++it)
+		(*it)->server.setFragmentSize(size);
+}
+
+void AsioShardServer::setMaxAssembledSize(unsigned int size)
+{
+	for(auto it = m_shards.begin(); it != m_shards.end(); ++it)
+		(*it)->server.setMaxAssembledSize(size);
+}
+
+void AsioShardServer::setMaxWireVersion(WireVersion version)
+{
+	for(auto it = m_shards.begin(); it != m_shards.end(); ++it)
+		(*it)->server.setMaxWireVersion(version);
+}
+
+void AsioShardServer::setReceiveWindow(unsigned int bytes, unsigned int messages)
+{
+	for(auto it = m_shards.begin(); it != m_shards.end(); ++it)
+		(*it)->server.setReceiveWindow(bytes, messages);
+}
+
+void AsioShardServer::setMemoryGovernor(MemoryGovernor *governor)
+{
+	for(auto it = m_shards.begin(); it != m_shards.end(); ++it)
+		(*it)->server.setMemoryGovernor(governor);
+}
+
+void AsioShardServer::listen(const string &addr, unsigned short port)
+{
+	if(!portPerShard())
+	{
+		m_shards.front()->server.listen(addr, port);
+		return;
+	}
+	for(auto it = m_shards.begin(); it != m_shards.end(); ++it)
+		(*it)->server.listen(addr, port);
+}
+
+static void runShard(aio::io_service *iosvc, unsigned int core)
+{
+#ifdef __linux__
+	//The shard's data stays in the caches of its core
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(core % CPU_SETSIZE, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+	iosvc->run();
+}
+
+void AsioShardServer::run()
+{
+	if(!portPerShard())
+	{
+		runIoService(*m_shards.front()->iosvc, shardCount());
+		return;
+	}
+
+	unsigned int cores = std::max(1u, boost::thread::hardware_concurrency());
+	boost::thread_group pool;
+	for(unsigned int i = 1; i < shardCount(); ++i)
+		pool.create_thread(boost::bind(&runShard, m_shards[i]->iosvc.get(), i % cores));
+	runShard(m_shards.front()->iosvc.get(), 0);
+	pool.join_all();
+}
+
+void AsioShardServer::stop()
+{
+	for(auto it = m_shards.begin(); it != m_shards.end(); ++it)
+		(*it)->iosvc->stop();
+}
+
+AsioServer& AsioShardServer::sessionServer(SessionID sessionID)
+{
+	return m_shards[sessionID % m_shards.size()]->server;
+}
+
+AsioServer& AsioShardServer::acceptServer(AsioServer &server)
+{
+	if(portPerShard())
+		return server;
+	//Only the first shard accepts, one connection at a time
+	AsioServer &next = m_shards[m_nextShard]->server;
+	m_nextShard = (m_nextShard + 1) % shardCount();
+	return next;
+}
+
+Variant AsioShardServer::shardObjectReplacer(Shard &owner, Shard &caller, const Variant &v)
+{
+	return IObjectPtr(new ShardObject(owner, caller, v.toObjectID()));
+}
+
+string AsioShardServer::packValue(const Variant &v, Shard &from)
+{
+	//Objects stay in the shard they come from, the other shard gets proxies
+	OutputBuffer out(256, WIRE_V2);
+	v.pack(out, boost::bind(&ObjectsStorage::objectToIDReplacer, &from.storage, _1, ClientBasePtr()));
+	string data;
+	data.swap(out.str());
+	return data;
+}
+
+Variant AsioShardServer::unpackValue(const string &data, Shard &from, Shard &to)
+{
+	InputBuffer in(data, WIRE_V2);
+	Variant v;
+	v.unpack(in, boost::bind(&AsioShardServer::shardObjectReplacer, boost::ref(from), boost::ref(to), _1));
+	return v;
+}
+
+void AsioShardServer::callObject(Shard &owner, Shard &caller, ObjectID id, const string &name,
+	const string &args, const FutureResultPtr &result)
+{
+	Variant v = owner.storage.localCall(id, name, unpackValue(args, caller, owner), bool(result));
+	if(!result)
+		return;
+
+	if(v.isFuture())
+		v.toFuture()->addBoth(boost::bind(&AsioShardServer::returnResult,
+			boost::ref(owner), boost::ref(caller), result, _1));
+	else
+		returnResult(owner, caller, result, v);
+}
+
+Variant AsioShardServer::returnResult(Shard &owner, Shard &caller, const FutureResultPtr &result,
+	const Variant &v)
+{
+	caller.iosvc->post(boost::bind(&AsioShardServer::completeCall,
+		boost::ref(owner), boost::ref(caller), result, packValue(v, owner)));
+	return v;
+}
+
+void AsioShardServer::completeCall(Shard &owner, Shard &caller, const FutureResultPtr &result,
+	const string &data)
+{
+	Variant v = unpackValue(data, owner, caller);
+	if(v.isException())
+		result->errback(std::move(v));
+	else
+		result->callback(std::move(v));
+}
+
+//////////////////////////////////////////////////////////////////////////
+ShardObject::ShardObject(AsioShardServer::Shard &owner, AsioShardServer::Shard &caller, ObjectID id) :
+	m_owner(owner),
+	m_caller(caller),
+	m_id(id)
+{
+}
+
+ShardObject::~ShardObject()
+{
+	//Frees the registration made when the object crossed to this shard
+	if(m_id != 0)
+		m_owner.iosvc->post(boost::bind(&ObjectsStorage::deleteObject, &m_owner.storage, m_id));
+}
+
+Variant ShardObject::call(const string &name, const Variant &args, bool withResult,
+	float timeout, FutureResultPtr &written)
+{
+	LOG_DEBUG_FMT(0, "Shard call <object id %d>.%s(%s)", m_id % name % args.repr());
+
+	FutureResultPtr result;
+	if(withResult)
+		result.reset(new FutureResult);
+	m_owner.iosvc->post(boost::bind(&AsioShardServer::callObject, boost::ref(m_owner), boost::ref(m_caller),
+		m_id, name, AsioShardServer::packValue(args, m_caller), result));
+	if(result)
+		return result;
+	return Variant();
+}
+
+}
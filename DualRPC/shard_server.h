@@ -0,0 +1,103 @@
+﻿#pragma once
+
+#include <vector>
+
+#include "asio_transport.h"
+#include "objects.h"
+
+namespace DualRPC
+{
+
+class ShardObject;
+
+//Server of independent shards, each with its own event loop, objects storage
+//and sessions. With SO_REUSEPORT every shard accepts on the port itself and
+//runs on a thread pinned to its core. Elsewhere the shards share one service
+//whose acceptor deals connections round robin. Shards share no objects, a
+//call to an object of another shard is posted to its loop with the values
+//copied packed, and a reconnecting client goes back to its session's shard
+class AsioShardServer
+{
+public:
+	//0 shards takes one per core
+	explicit AsioShardServer(unsigned int shards = 0);
+	~AsioShardServer();
+
+	unsigned int shardCount() const;
+	//True if every shard listens on the port
+	bool portPerShard() const;
+
+	aio::io_service& ioService(unsigned int shard);
+	ObjectsStorage& storage(unsigned int shard);
+	AsioServer& server(unsigned int shard);
+
+	//Registered in the first shard, the others call it through a proxy
+	void setGlobalObject(const IObjectPtr &obj);
+
+	void setDisconnectTimeout(unsigned int sec);
+	void setMaxMessageSize(unsigned int size);
+	void setArenaMode(bool value);
+	void setFragmentSize(unsigned int size);
+	void setMaxAssembledSize(unsigned int size);
+	void setMaxWireVersion(WireVersion version);
+	void setReceiveWindow(unsigned int bytes, unsigned int messages);
+	//One governor for the memory of every shard
+	void setMemoryGovernor(MemoryGovernor *governor);
+
+	void listen(const string &addr, unsigned short port);
+	//Runs the shards until they are out of work
+	void run();
+	void stop();
+
+private:
+	friend class AsioServer;
+	friend class ShardObject;
+
+	struct Shard
+	{
+		boost::shared_ptr<aio::io_service> iosvc;
+		ObjectsStorage storage;
+		AsioServer server;
+
+		Shard(const boost::shared_ptr<aio::io_service> &iosvc);
+	};
+	typedef boost::shared_ptr<Shard> ShardPtr;
+
+	std::vector<ShardPtr> m_shards;
+	unsigned int m_nextShard;
+
+	//Shard of the session, its id keeps the shard index
+	AsioServer& sessionServer(SessionID sessionID);
+	//Shard for the next connection accepted by server
+	AsioServer& acceptServer(AsioServer &server);
+	static Variant shardObjectReplacer(Shard &owner, Shard &caller, const Variant &v);
+
+	static string packValue(const Variant &v, Shard &from);
+	static Variant unpackValue(const string &data, Shard &from, Shard &to);
+	static void callObject(Shard &owner, Shard &caller, ObjectID id, const string &name,
+		const string &args, const FutureResultPtr &result);
+	static Variant returnResult(Shard &owner, Shard &caller, const FutureResultPtr &result,
+		const Variant &v);
+	static void completeCall(Shard &owner, Shard &caller, const FutureResultPtr &result,
+		const string &data);
+
+	AsioShardServer(const AsioShardServer&);
+	AsioShardServer& operator=(const AsioShardServer&);
+};
+
+//Object of another shard
+class ShardObject : public IObject
+{
+public:
+	ShardObject(AsioShardServer::Shard &owner, AsioShardServer::Shard &caller, ObjectID id);
+	virtual ~ShardObject();
+
+	Variant call(const string &name, const Variant &args = Variant(), bool withResult = true,
+		float timeout = -1, FutureResultPtr &written = FutureResultPtr()) override;
+
+private:
+	AsioShardServer::Shard &m_owner, &m_caller;
+	ObjectID m_id;
+};
+
+}
@@ -0,0 +1,330 @@
+﻿#include "stdafx.h"
+#include "stream_decoder.h"
+#include "variant_view.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace DualRPC
+{
+
+StreamDecoder::Level::Level(Variant::Type type, std::size_t count, std::size_t reserve) :
+	type(type),
+	count(count),
+	hasKey(false)
+{
+	if(type == Variant::VT_ARRAY)
+		items.reserve(reserve);
+	else
+		map.reserve(reserve);
+}
+
+StreamDecoder::Level::Level(Level &&level) :
+	type(level.type),
+	count(level.count),
+	items(std::move(level.items)),
+	map(std::move(level.map)),
+	key(std::move(level.key)),
+	hasKey(level.hasKey)
+{
+}
+
+StreamDecoder::Level& StreamDecoder::Level::operator=(Level &&level)
+{
+	type = level.type;
+	count = level.count;
+	items = std::move(level.items);
+	map = std::move(level.map);
+	key = std::move(level.key);
+	hasKey = level.hasKey;
+	return *this;
+}
+
+StreamDecoder::StreamDecoder() :
+	m_done(false),
+	m_left(0),
+	m_needed(0),
+	m_version(WIRE_V1),
+	m_strings(nullptr),
+	m_payloadType(Variant::VT_NULL),
+	m_payloadSize(0),
+	m_payloadPos(0)
+{
+}
+
+void StreamDecoder::start(std::size_t size, WireVersion version, StringTable *strings,
+	const Callback &replacer)
+{
+	clear();
+	m_left = size;
+	m_version = version;
+	m_strings = strings;
+	m_replacer = replacer;
+}
+
+void StreamDecoder::end(std::size_t size)
+{
+	if(size > m_left)
+		throw std::runtime_error("Streamed value is larger than its limit");
+	m_left = size;
+}
+
+std::size_t StreamDecoder::feed(const char *data, std::size_t size)
+{
+	if(size > m_left)
+		size = m_left;
+	std::size_t taken = 0;
+	m_needed = 0;
+	while(taken < size)
+	{
+		std::size_t used;
+		if(m_done)
+		{
+			//Bytes after the value are skipped, as in a buffered frame
+			used = size - taken;
+		}
+		else if(m_payloadType != Variant::VT_NULL)
+		{
+			used = feedPayload(data + taken, size - taken);
+		}
+		else
+		{
+			InputBuffer in(data + taken, size - taken, m_version, m_strings);
+			if(!step(in))
+			{
+				//A value that does not fit is tried again with twice the bytes,
+				//not after every read
+				m_needed = std::min(m_left, 2 * (size - taken) + 1);
+				break;
+			}
+			used = in.pos();
+		}
+		taken += used;
+		m_left -= used;
+	}
+	if(m_left == 0 && !m_done)
+		throw std::runtime_error("Unexpected end of streamed value");
+	return taken;
+}
+
+bool StreamDecoder::step(InputBuffer &in)
+{
+	//Once every byte of the value is here an error is not a short read
+	bool last = in.remaining() >= m_left;
+
+	if(!m_levels.empty() && m_levels.back().type == Variant::VT_MAP && !m_levels.back().hasKey)
+	{
+		Level &level = m_levels.back();
+		std::size_t keyLen;
+		const char *keyData;
+		try
+		{
+			keyData = in.readKey(keyLen);
+		}
+		catch(const std::exception&)
+		{
+			if(last) throw;
+			return false;
+		}
+		level.key.assign(keyData, keyLen);
+		level.hasKey = true;
+		return true;
+	}
+
+	InputBuffer peek(in);
+	try
+	{
+		unsigned char tag;
+		Variant::Type type = Variant::Type(peek.readHeader(tag));
+		switch(type)
+		{
+		case Variant::VT_ARRAY:
+		case Variant::VT_MAP:
+			{
+				std::size_t count = (std::size_t)peek.readHeaderValue(tag, sizeof(std::size_t));
+				if(count > m_left)
+					throw std::runtime_error(type == Variant::VT_ARRAY ?
+						"Invalid array length" : "Invalid map length");
+				in.skip(peek.pos());
+				//The count is only what the peer claims, each item takes a byte at least
+				if(count == 0)
+					finish(type == Variant::VT_ARRAY ? Variant(Variant::Array()) : Variant(Variant::Map()));
+				else
+					m_levels.push_back(Level(type, count, std::min(count, in.remaining())));
+				return true;
+			}
+
+		case Variant::VT_STRING:
+		case Variant::VT_EXCEPTION:
+		case Variant::VT_BYTES:
+			{
+				std::size_t len = (std::size_t)peek.readHeaderValue(tag, sizeof(unsigned int));
+				if(len >= STREAM_PAYLOAD_SIZE && len > peek.remaining())
+				{
+					if(len > m_left - peek.pos())
+						throw std::runtime_error("Invalid string length");
+					in.skip(peek.pos());
+					startPayload(type, len);
+					return true;
+				}
+			}
+			break;
+
+		case Variant::VT_INT_ARRAY:
+		case Variant::VT_REAL_ARRAY:
+			{
+				std::size_t len = (std::size_t)peek.readHeaderValue(tag, sizeof(unsigned int));
+				if(len * 8 >= STREAM_PAYLOAD_SIZE && len * 8 > peek.remaining())
+				{
+					if(len > (m_left - peek.pos()) / 8)
+						throw std::runtime_error("Invalid typed array length");
+					in.skip(peek.pos());
+					startPayload(type, len);
+					return true;
+				}
+			}
+			break;
+
+		default:
+			break;
+		}
+
+		//Checked first so the replacer never sees a value that is not complete
+		VariantView(in).packedSize();
+	}
+	catch(const std::exception&)
+	{
+		if(last) throw;
+		return false;
+	}
+
+	Variant value;
+	value.unpack(in, m_replacer);
+	finish(std::move(value));
+	return true;
+}
+
+void StreamDecoder::startPayload(Variant::Type type, std::size_t size)
+{
+	//Storage grows with the bytes that come, not with the size the peer claims
+	m_payloadType = type;
+	m_payloadPos = 0;
+	m_payloadSize = type == Variant::VT_INT_ARRAY || type == Variant::VT_REAL_ARRAY ? size * 8 : size;
+	m_ints.clear();
+	m_reals.clear();
+	m_string.clear();
+}
+
+std::size_t StreamDecoder::feedPayload(const char *data, std::size_t size)
+{
+	std::size_t count = std::min(size, m_payloadSize - m_payloadPos);
+	//Items cut between feeds are completed by the next one
+	std::size_t items = (m_payloadPos + count + 7) / 8;
+	if(m_payloadType == Variant::VT_INT_ARRAY)
+	{
+		m_ints.resize(items);
+		std::memcpy((char*)&m_ints[0] + m_payloadPos, data, count);
+	}
+	else if(m_payloadType == Variant::VT_REAL_ARRAY)
+	{
+		m_reals.resize(items);
+		std::memcpy((char*)&m_reals[0] + m_payloadPos, data, count);
+	}
+	else
+		m_string.append(data, count);
+	m_payloadPos += count;
+
+	if(m_payloadPos == m_payloadSize)
+	{
+		Variant::Type type = m_payloadType;
+		m_payloadType = Variant::VT_NULL;
+		switch(type)
+		{
+		case Variant::VT_STRING:
+			finish(Variant(std::move(m_string)));
+			break;
+		case Variant::VT_BYTES:
+			finish(Variant::fromBytes(std::move(m_string)));
+			break;
+		case Variant::VT_EXCEPTION:
+			finish(Variant(remote_error(m_string)));
+			break;
+		case Variant::VT_INT_ARRAY:
+			finish(Variant(std::move(m_ints)));
+			break;
+		case Variant::VT_REAL_ARRAY:
+			finish(Variant(std::move(m_reals)));
+			break;
+		default:
+			break;
+		}
+		m_string.clear();
+	}
+	return count;
+}
+
+void StreamDecoder::finish(Variant &&value)
+{
+	//Levels complete with their last item go to the level above
+	Variant v(std::move(value));
+	while(!m_levels.empty())
+	{
+		Level &level = m_levels.back();
+		if(level.type == Variant::VT_ARRAY)
+			level.items.push_back(std::move(v));
+		else
+		{
+			level.map.emplace_hint(level.map.end(), std::move(level.key), std::move(v));
+			level.hasKey = false;
+		}
+		if(--level.count > 0)
+			return;
+
+		if(level.type == Variant::VT_ARRAY)
+			v = Variant(std::move(level.items));
+		else
+			v = Variant(std::move(level.map));
+		m_levels.pop_back();
+	}
+	m_result = std::move(v);
+	m_done = true;
+}
+
+bool StreamDecoder::done() const
+{
+	return m_done && m_left == 0;
+}
+
+std::size_t StreamDecoder::needed() const
+{
+	return m_needed;
+}
+
+std::size_t StreamDecoder::left() const
+{
+	return m_left;
+}
+
+Variant StreamDecoder::take()
+{
+	Variant v(std::move(m_result));
+	m_result = Variant();
+	return v;
+}
+
+void StreamDecoder::clear()
+{
+	m_levels.clear();
+	m_result = Variant();
+	m_done = false;
+	m_left = m_needed = 0;
+	m_replacer.clear();
+	m_payloadType = Variant::VT_NULL;
+	m_payloadSize = m_payloadPos = 0;
+	string().swap(m_string);
+	Variant::IntArray().swap(m_ints);
+	Variant::RealArray().swap(m_reals);
+}
+
+}
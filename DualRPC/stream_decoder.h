@@ -0,0 +1,82 @@
+﻿#pragma once
+
+#include <vector>
+
+#include "defs.h"
+#include "variant.h"
+#include "buffer.h"
+
+namespace DualRPC
+{
+
+//Decodes one packed Variant from bytes fed as they arrive, so the whole value
+//never has to be in one buffer. Large strings and typed arrays are copied
+//straight into their own storage, other values are decoded once all of their
+//bytes are fed. Containers are built level by level
+class StreamDecoder
+{
+public:
+	//Payloads from this size are streamed, smaller ones wait for their bytes
+	static const std::size_t STREAM_PAYLOAD_SIZE = 16*1024;
+
+	StreamDecoder();
+
+	//Starts a value of size bytes, of at most size bytes until end is called
+	void start(std::size_t size, WireVersion version, StringTable *strings,
+		const Callback &replacer = Callback());
+	//The value ends after size more bytes, once its size is known
+	void end(std::size_t size);
+	//Decodes what it can and returns the bytes taken. The rest of data has to be
+	//fed again together with the bytes after it, needed() of them at least
+	std::size_t feed(const char *data, std::size_t size);
+
+	bool done() const;
+	std::size_t needed() const;
+	//Bytes of the value not taken yet
+	std::size_t left() const;
+	//The decoded value, moved out
+	Variant take();
+	void clear();
+
+private:
+	struct Level
+	{
+		Variant::Type type;
+		std::size_t count;		//items still to come
+		Variant::Array items;
+		Variant::Map map;
+		string key;				//key of the map value being decoded
+		bool hasKey;
+
+		//Room is made for reserve items, as many as the bytes at hand may hold
+		Level(Variant::Type type, std::size_t count, std::size_t reserve);
+		Level(Level &&level);
+		Level& operator=(Level &&level);
+	};
+	typedef std::vector<Level> LevelList;
+
+	LevelList m_levels;
+	Variant m_result;
+	bool m_done;
+	std::size_t m_left, m_needed;
+	WireVersion m_version;
+	StringTable *m_strings;
+	Callback m_replacer;
+
+	//Streamed payload of m_payloadType, m_payloadSize bytes
+	Variant::Type m_payloadType;
+	std::size_t m_payloadSize, m_payloadPos;
+	string m_string;
+	Variant::IntArray m_ints;
+	Variant::RealArray m_reals;
+
+	bool step(InputBuffer &in);
+	void startPayload(Variant::Type type, std::size_t size);
+	std::size_t feedPayload(const char *data, std::size_t size);
+	void finish(Variant &&value);
+
+	StreamDecoder(const StreamDecoder&);
+	StreamDecoder& operator=(const StreamDecoder&);
+};
+
+}
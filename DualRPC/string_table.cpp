@@ -0,0 +1,64 @@
+﻿#include "stdafx.h"
+#include "string_table.h"
+
+#include <stdexcept>
+#include <boost/format.hpp>
+
+namespace DualRPC
+{
+
+StringTable::StringTable()
+{
+}
+
+int StringTable::find(const char *data, std::size_t len) const
+{
+	if(len > MAX_STRING_SIZE)
+		return -1;
+	IndexMap::const_iterator it = m_index.find(string(data, len));
+	return it == m_index.end() ? -1 : (int)it->second;
+}
+
+int StringTable::add(const char *data, std::size_t len)
+{
+	if(len > MAX_STRING_SIZE || m_strings.size() >= MAX_SIZE)
+		return -1;
+	unsigned int index = (unsigned int)m_strings.size();
+	m_strings.push_back(string(data, len));
+	m_index[m_strings.back()] = index;
+	return (int)index;
+}
+
+void StringTable::define(std::size_t index, const char *data, std::size_t len)
+{
+	if(index < m_strings.size())
+	{
+		if(m_strings[index].size() != len || m_strings[index].compare(0, len, data, len) != 0)
+			throw std::runtime_error((boost::format("String table entry %1% redefined") % index).str());
+		return;
+	}
+	if(index != m_strings.size() || index >= MAX_SIZE)
+		throw std::runtime_error((boost::format("String table out of sync (entry %1% of %2%)") % 
+			index % m_strings.size()).str());
+	m_strings.push_back(string(data, len));
+}
+
+const string& StringTable::get(std::size_t index) const
+{
+	if(index >= m_strings.size())
+		throw std::runtime_error((boost::format("Unknown string table entry %1%") % index).str());
+	return m_strings[index];
+}
+
+std::size_t StringTable::size() const
+{
+	return m_strings.size();
+}
+
+void StringTable::clear()
+{
+	m_strings.clear();
+	m_index.clear();
+}
+
+}
@@ -0,0 +1,44 @@
+﻿#pragma once
+
+#include <deque>
+#include <unordered_map>
+
+#include "defs.h"
+
+namespace DualRPC
+{
+
+//Map keys and method names a connection sends by index, one table per direction.
+//Entries live as long as the wire version of the session and are never reused
+class StringTable
+{
+public:
+	static const std::size_t MAX_SIZE = 4096;
+	static const std::size_t MAX_STRING_SIZE = 64;
+
+	StringTable();
+
+	//Sending side: index of a string sent before or -1
+	int find(const char *data, std::size_t len) const;
+	//Sending side: index for a new string, -1 when it is not worth a slot
+	int add(const char *data, std::size_t len);
+
+	//Receiving side: repeated definitions of an entry are ignored
+	void define(std::size_t index, const char *data, std::size_t len);
+	const string& get(std::size_t index) const;
+
+	std::size_t size() const;
+	void clear();
+
+private:
+	typedef std::unordered_map<string, unsigned int> IndexMap;
+
+	//deque keeps returned strings in place while the table grows
+	std::deque<string> m_strings;
+	IndexMap m_index;
+
+	StringTable(const StringTable&);
+	StringTable& operator=(const StringTable&);
+};
+
+}
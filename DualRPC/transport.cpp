@@ -1,32 +1,125 @@
 ﻿#include "stdafx.h"
 #include "transport.h"
 #include "objects.h"
+#include "variant_view.h"
 #include "logger.h"
 
 #include <boost/format.hpp>
+#include <algorithm>
 
 namespace DualRPC
 {
 
 const char* PROTOCOL_NAME = "ROC1";
+const char* WIRE_VERSION_METHOD = "__wire_version";
 
 ClientBase::ClientBase(ObjectsStorage &storage) : 
 	m_storage(storage), 	
 	m_async(true),
-	m_requireProcessing(false), 
-	m_enableProcessing(true),
+	m_readPaused(false),
+	m_arenaMode(false),
+	m_wireVersion(WIRE_V1),
+	m_maxWireVersion(WIRE_V7),
+	m_recvWireVersion(WIRE_V1),
 	m_nextRequestID(1),
-	m_maxMessageSize(1024*1024)
+	m_maxMessageSize(1024*1024),
+	m_spanThreshold(16*1024),
+	m_maxWriteBatchSize(256*1024),
+	m_fragmentSize(64*1024),
+	m_maxAssembledSize(1024*1024),
+	m_streamFrameSize(1024*1024),
+	m_maxCallsInFlight(256),
+	m_callsInFlight(0),
+	m_recvWindowBytes(8*1024*1024),
+	m_recvWindowMessages(1024),
+	m_sendCreditBytes(0),
+	m_sendCreditMessages(0),
+	m_sendUnlimited(true),
+	m_grantWindow(false),
+	m_heldBytes(0),
+	m_heldMessages(0),
+	m_ungrantedBytes(0),
+	m_ungrantedMessages(0),
+	m_frameBytes(0),
+	m_processingDepth(0),
+	m_governor(nullptr),
+	m_frameSizeAverage(0),
+	m_streamMemory(0),
+	m_writingCount(0),
+	m_writeCalls(0),
+	m_messagesWritten(0)
 {
 }
 
 ClientBase::~ClientBase()
 {
-	close();	
+	//Objects owned by a connection keep it alive, so none are left to free here
+	//and shared_from_this() would throw
+	if(m_governor)
+		m_governor->detach(this);
+}
+
+ClientBase::RequestData::RequestData() :
+	type(RT_PING),
+	id(0),
+	priority(PRIORITY_NORMAL),
+	version(WIRE_V1),
+	needsCredit(false),
+	sent(0),
+	sending(0)
+{
+}
+
+ClientBase::RequestData::RequestData(RequestData &&rd) :
+	type(rd.type),
+	id(rd.id),
+	priority(rd.priority),
+	version(rd.version),
+	objects(std::move(rd.objects)),
+	needsCredit(rd.needsCredit),
+	sent(rd.sent),
+	sending(rd.sending),
+	writeCompletePtr(std::move(rd.writeCompletePtr)),
+	data(std::move(rd.data)),
+	spans(std::move(rd.spans))
+{
+}
+
+ClientBase::RequestData& ClientBase::RequestData::operator=(RequestData &&rd)
+{
+	type = rd.type;
+	id = rd.id;
+	priority = rd.priority;
+	version = rd.version;
+	objects = std::move(rd.objects);
+	needsCredit = rd.needsCredit;
+	sent = rd.sent;
+	sending = rd.sending;
+	writeCompletePtr = std::move(rd.writeCompletePtr);
+	data = std::move(rd.data);
+	spans = std::move(rd.spans);
+	return *this;
+}
+
+ClientBase::HeldCall::HeldCall() :
+	type(RT_CALL_PROC),
+	id(0),
+	priority(PRIORITY_NORMAL),
+	object(0)
+{
+}
+
+ClientBase::Assembly::Assembly() :
+	mode(HEADER),
+	size(0)
+{
 }
 
 void ClientBase::setMaxMessageSize(unsigned int size)
 {
+	//The assembled size follows until it is set on its own
+	if(m_maxAssembledSize == m_maxMessageSize)
+		m_maxAssembledSize = size;
 	m_maxMessageSize = size;
 }
 
@@ -35,6 +128,147 @@ unsigned int ClientBase::getMaxMessageSize() const
 	return m_maxMessageSize;
 }
 
+void ClientBase::setFragmentSize(unsigned int size)
+{
+	if(size != 0 && size <= FRAGMENT_HEADER_SIZE)
+		throw std::runtime_error((boost::format("Fragment size %1% is too small") % size).str());
+	m_fragmentSize = size;
+}
+
+unsigned int ClientBase::getFragmentSize() const
+{
+	return m_fragmentSize;
+}
+
+void ClientBase::setMaxAssembledSize(unsigned int size)
+{
+	m_maxAssembledSize = size;
+}
+
+unsigned int ClientBase::getMaxAssembledSize() const
+{
+	return m_maxAssembledSize;
+}
+
+void ClientBase::setSpanThreshold(unsigned int size)
+{
+	m_spanThreshold = size;
+}
+
+unsigned int ClientBase::getSpanThreshold() const
+{
+	return m_spanThreshold;
+}
+
+void ClientBase::setStreamFrameSize(unsigned int size)
+{
+	m_streamFrameSize = size;
+}
+
+unsigned int ClientBase::getStreamFrameSize() const
+{
+	return m_streamFrameSize;
+}
+
+void ClientBase::setMaxCallsInFlight(unsigned int count)
+{
+	m_maxCallsInFlight = count;
+}
+
+unsigned int ClientBase::getMaxCallsInFlight() const
+{
+	return m_maxCallsInFlight;
+}
+
+unsigned int ClientBase::callsInFlight() const
+{
+	Lock lock(m_mutex);
+	return m_callsInFlight;
+}
+
+void ClientBase::setReceiveWindow(unsigned int bytes, unsigned int messages)
+{
+	m_recvWindowBytes = bytes;
+	m_recvWindowMessages = messages;
+}
+
+unsigned int ClientBase::getReceiveWindowBytes() const
+{
+	return m_recvWindowBytes;
+}
+
+unsigned int ClientBase::getReceiveWindowMessages() const
+{
+	return m_recvWindowMessages;
+}
+
+__int64 ClientBase::sendCreditBytes() const
+{
+	Lock lock(m_mutex);
+	return m_sendCreditBytes;
+}
+
+__int64 ClientBase::sendCreditMessages() const
+{
+	Lock lock(m_mutex);
+	return m_sendCreditMessages;
+}
+
+std::size_t ClientBase::queuedMessages() const
+{
+	Lock lock(m_mutex);
+	return m_messageQueue.size() + m_heldCalls.size();
+}
+
+void ClientBase::setMemoryGovernor(MemoryGovernor *governor)
+{
+	if(m_governor)
+		m_governor->detach(this);
+	m_governor = governor;
+	if(m_governor)
+		m_governor->attach(shared_from_this());
+}
+
+MemoryGovernor* ClientBase::memoryGovernor() const
+{
+	return m_governor;
+}
+
+void ClientBase::trackMemory(MemoryKind kind, std::ptrdiff_t bytes)
+{
+	//The size of received frames is the reads' own, other threads do not pass it
+	if(m_governor && bytes != 0)
+		m_governor->track(this, kind, bytes, kind == MEM_RECEIVE ? m_frameSizeAverage : 0);
+}
+
+void ClientBase::setMaxWriteBatchSize(unsigned int size)
+{
+	m_maxWriteBatchSize = size;
+}
+
+unsigned int ClientBase::getMaxWriteBatchSize() const
+{
+	return m_maxWriteBatchSize;
+}
+
+std::size_t ClientBase::writeCalls() const
+{
+	Lock lock(m_mutex);
+	return m_writeCalls;
+}
+
+std::size_t ClientBase::messagesWritten() const
+{
+	Lock lock(m_mutex);
+	return m_messagesWritten;
+}
+
+double ClientBase::averageMessagesPerWrite() const
+{
+	Lock lock(m_mutex);
+	return m_writeCalls ? double(m_messagesWritten) / m_writeCalls : 0.0;
+}
+
 void ClientBase::setAsyncMode(bool value)
 {
 	m_async = value;
@@ -45,11 +279,220 @@ bool ClientBase::asyncMode() const
 	return m_async;
 }
 
+void ClientBase::setArenaMode(bool value)
+{
+	m_arenaMode = value;
+}
+
+bool ClientBase::arenaMode() const
+{
+	return m_arenaMode;
+}
+
+const Arena& ClientBase::arena() const
+{
+	return m_arena;
+}
+
+BufferPool& ClientBase::bufferPool()
+{
+	return m_bufferPool;
+}
+
+const BufferPool& ClientBase::bufferPool() const
+{
+	return m_bufferPool;
+}
+
+void ClientBase::setMaxWireVersion(WireVersion version)
+{
+	m_maxWireVersion = version;
+}
+
+WireVersion ClientBase::getMaxWireVersion() const
+{
+	return m_maxWireVersion;
+}
+
+WireVersion ClientBase::wireVersion() const
+{
+	Lock lock(m_mutex);
+	return m_wireVersion;
+}
+
+void ClientBase::setWireVersion(WireVersion version)
+{
+	Lock lock(m_mutex);
+	LOG_DEBUG_FMT(0, "Wire version %1%", int(version));
+	m_wireVersion = m_recvWireVersion = version;
+	for(int i = 0; i < PRIORITY_CLASSES; i++)
+	{
+		m_sendStrings[i].clear();
+		m_recvStrings[i].clear();
+	}
+
+	//Calls wait for the peer's first grant, ours goes out with the next write
+	m_sendUnlimited = !flowControl();
+	m_sendCreditBytes = m_sendCreditMessages = 0;
+	m_heldBytes = m_heldMessages = 0;
+	m_ungrantedBytes = m_ungrantedMessages = 0;
+	m_grantWindow = flowControl();
+	if(m_grantWindow && asyncMode() && m_writingCount == 0)
+		writeQueue();
+}
+
+void ClientBase::restartFlowControl()
+{
+	if(!flowControl())
+		return;
+	//Calls in flight keep their credit, the rest of the window is granted again
+	m_sendUnlimited = false;
+	m_sendCreditBytes = m_sendCreditMessages = 0;
+	m_ungrantedBytes = m_ungrantedMessages = 0;
+	m_grantWindow = true;
+}
+
+void ClientBase::restartFragments()
+{
+	//The write in progress completes without a fragment that does not end its message
+	if(m_writingCount > 0)
+	{
+		const RequestData &last = m_messageQueue[m_writingCount - 1];
+		if(last.sending > 0 && last.sent + last.sending < messageSize(last) - sizeof(unsigned int))
+			--m_writingCount;
+	}
+	for(std::size_t i = m_writingCount; i < m_messageQueue.size(); i++)
+		m_messageQueue[i].sent = m_messageQueue[i].sending = 0;
+}
+
+void ClientBase::restartStringTables()
+{
+	if(!asyncMode())
+		return;
+	//Each table goes in its class, messages of the class that use it come after
+	for(int i = PRIORITY_CLASSES - 1; i >= 0; i--)
+	{
+		const StringTable &table = m_sendStrings[i];
+		if(table.size() == 0)
+			continue;
+		OutputBuffer out(m_bufferPool.acquire(16 + table.size() * 16), m_wireVersion);
+		unsigned int size = 0;
+		char type = char(m_wireVersion >= WIRE_V6 ? RT_STRINGS | (i << 6) : RT_STRINGS);
+		out.writeValue(size);
+		out.writeValue(type);
+		out.writeUInt(table.size(), sizeof(unsigned int));
+		for(std::size_t j = 0; j < table.size(); j++)
+		{
+			const string &s = table.get(j);
+			out.writeUInt(s.size(), sizeof(unsigned int));
+			out.write(s.data(), s.size());
+		}
+		size = (unsigned int)out.totalSize() - sizeof(size);
+		out.writeAt(0, &size, sizeof(size));
+
+		RequestData rd;
+		rd.type = RT_STRINGS;
+		rd.priority = MessagePriority(i);
+		rd.version = m_wireVersion;
+		rd.data.swap(out.str());
+		trackMemory(MEM_SEND, rd.data.size());
+		m_messageQueue.insert(frontPosition(), std::move(rd));
+	}
+}
+
+bool ClientBase::flowControl() const
+{
+	return m_wireVersion >= WIRE_V5;
+}
+
+bool ClientBase::recvFlowControl() const
+{
+	return m_recvWireVersion >= WIRE_V5;
+}
+
+StringTable* ClientBase::sendStrings(MessagePriority priority)
+{
+	return m_wireVersion >= WIRE_V3 ? &m_sendStrings[priority] : nullptr;
+}
+
+StringTable* ClientBase::recvStrings(MessagePriority priority)
+{
+	return m_recvWireVersion >= WIRE_V3 ? &m_recvStrings[priority] : nullptr;
+}
+
+MessagePriority ClientBase::sendPriority(MessagePriority priority) const
+{
+	return m_wireVersion >= WIRE_V6 ? priority : PRIORITY_NORMAL;
+}
+
+MessagePriority ClientBase::framePriority(const char *data, std::size_t size) const
+{
+	//The class travels in the high bits of the type byte
+	if(m_recvWireVersion < WIRE_V6 || size == 0)
+		return PRIORITY_NORMAL;
+	unsigned int priority = (unsigned char)data[0] >> 6;
+	if(priority >= PRIORITY_CLASSES)
+		throw std::runtime_error((boost::format("Invalid message priority %1%") % priority).str());
+	return MessagePriority(priority);
+}
+
+Variant ClientBase::requestWireVersion()
+{
+	Lock lock(m_mutex);
+	//Messages already queued are encoded in the current version
+	if(!asyncMode() || m_maxWireVersion == m_wireVersion || !m_messageQueue.empty())
+		return Variant();
+
+	FutureResultPtr written;
+	FutureResultPtr future = asyncCall(0, WIRE_VERSION_METHOD, int(m_maxWireVersion), 
+		true, -1, written).toFuture();
+	future->addBoth(boost::bind(&ClientBase::acceptWireVersion, shared_from_this(), _1));
+	return future;
+}
+
+Variant ClientBase::acceptWireVersion(const Variant &v)
+{
+	if(v.isInt() && v.toInt() > WIRE_V1 && v.toInt() <= m_maxWireVersion)
+	{
+		Lock lock(m_mutex);
+		//The peer reads what was sent before this mark in the old format
+		OutputBuffer out(m_bufferPool.acquire(16), m_wireVersion);
+		unsigned int size = 0;
+		char type = RT_WIRE_VERSION;
+		out.writeValue(size);
+		out.writeValue(type);
+		sendBuffer(type, 0, sendPriority(PRIORITY_CONTROL), out);
+		setWireVersion(WireVersion(v.toInt()));
+	}
+	else
+		LOG_INFO(0, "Peer keeps wire version 1");
+	return v;
+}
+
+bool ClientBase::answerWireVersion(RequestID requestID, InputBuffer &in)
+{
+	Variant args;
+	args.unpack(in);
+	__int64 version = args.isInt() ? args.toInt() : (__int64)WIRE_V1;
+	if(version > m_maxWireVersion) version = m_maxWireVersion;
+	if(version < WIRE_V1) version = WIRE_V1;
+
+	//The answer goes out in the old format, everything after it in the new one.
+	//Frames are read in the old one until the caller marks its switch
+	Lock lock(m_mutex);
+	WireVersion recvVersion = m_recvWireVersion;
+	sendReturnResponse(requestID, PRIORITY_NORMAL, Variant(version));
+	setWireVersion(WireVersion(version));
+	m_recvWireVersion = recvVersion;
+	return true;
+}
+
 Variant ClientBase::call(ObjectID id, const string &name, const Variant &args, 
-	bool withResult, float timeout, FutureResultPtr &written)
+	bool withResult, float timeout, FutureResultPtr &written, MessagePriority priority)
 {
+	Lock lock(m_mutex);
 	if(asyncMode())
-		return asyncCall(id, name, args, withResult, timeout, written);
+		return asyncCall(id, name, args, withResult, timeout, written, priority);
 	return syncCall(id, name, args, withResult);
 }
 
@@ -59,18 +502,18 @@ Variant ClientBase::syncCall(ObjectID id, const string &name, const Variant &arg
 
 	if(withResult)
 	{
-		sendCallRequest(RT_CALL_FUNC, getNextRequestID(), id, name, args);
+		sendCallRequest(RT_CALL_FUNC, getNextRequestID(), PRIORITY_NORMAL, id, name, args);
 		//return recvAnswer();
 	}
 	else
 	{
-		sendCallRequest(RT_CALL_PROC, getNextRequestID(), id, name, args);
+		sendCallRequest(RT_CALL_PROC, getNextRequestID(), PRIORITY_NORMAL, id, name, args);
 	}
 	return Variant();
 }
 
 Variant ClientBase::asyncCall(ObjectID id, const string &name, const Variant &args, 
-	bool withResult, float timeout, FutureResultPtr &written)
+	bool withResult, float timeout, FutureResultPtr &written, MessagePriority priority)
 {
 	LOG_DEBUG_FMT(0, "Async call <object id %d>.%s(%s)", id % name % args.repr());
 
@@ -80,12 +523,48 @@ Variant ClientBase::asyncCall(ObjectID id, const string &name, const Variant &ar
 	{
 		FutureResultPtr future(new FutureResult);			
 		m_callbacks[requestID] = future;		
-		written = sendCallRequest(RT_CALL_FUNC, requestID, id, name, args).toFuture();
+		trackMemory(MEM_CALLBACKS, MemoryGovernor::CALLBACK_BYTES);
+		written = sendCallRequest(RT_CALL_FUNC, requestID, priority, id, name, args).toFuture();
+		return future;
+	}
+	else
+	{
+		written = sendCallRequest(RT_CALL_PROC, requestID, priority, id, name, args).toFuture();
+	}
+	return Variant();
+}
+
+Variant ClientBase::relayCall(ObjectID id, const string &name, const Variant &args, MessagePriority priority,
+	bool withResult, const ClientBasePtr &origin, FutureResultPtr &written)
+{
+	LOG_DEBUG_FMT(0, "Relay call <object id %d>.%s(%s)", id % name % args.repr());
+
+	if(withResult)
+	{
+		//Before our own, a connection's lock is never taken while another's is held
+		Lock lock(origin->m_mutex);
+		bool known = false;
+		for(ClientList::iterator it = origin->m_relayedTo.begin(); it != origin->m_relayedTo.end() && !known; ++it)
+			known = it->lock().get() == this;
+		if(!known)
+			origin->m_relayedTo.push_back(shared_from_this());
+	}
+
+	Lock lock(m_mutex);
+	unsigned int requestID = getNextRequestID();
+
+	if(withResult)
+	{
+		FutureResultPtr future(new FutureResult);			
+		m_callbacks[requestID] = future;		
+		m_relayTargets[requestID] = origin;
+		trackMemory(MEM_CALLBACKS, 2 * MemoryGovernor::CALLBACK_BYTES);
+		written = sendCallRequest(RT_CALL_FUNC, requestID, priority, id, name, args).toFuture();
 		return future;
 	}
 	else
 	{
-		written = sendCallRequest(RT_CALL_PROC, requestID, id, name, args).toFuture();
+		written = sendCallRequest(RT_CALL_PROC, requestID, priority, id, name, args).toFuture();
 	}
 	return Variant();
 }
@@ -94,172 +573,727 @@ Variant ClientBase::destroyObject(ObjectID id)
 {
 	if(id == 0) return Variant();
 
-	std::ostringstream stream;
+	//Proxies are released on any thread, even while a frame is decoded
+	Lock lock(m_mutex);
+	for(HeldCallQueue::const_iterator it = m_heldCalls.cbegin(); it != m_heldCalls.cend(); ++it)
+	{
+		if(it->object != id)
+			continue;
+		HeldCall release;
+		release.type = RT_DELOBJ;
+		release.id = getNextRequestID();
+		release.object = id;
+		release.written.reset(new FutureResult);
+		m_heldCalls.push_back(release);
+		return release.written;
+	}
+	return sendRelease(getNextRequestID(), id);
+}
+
+Variant ClientBase::sendRelease(RequestID requestID, ObjectID id, const FutureResultPtr &written)
+{
+	//A release goes ahead of other messages but stays behind the queued ones 
+	//referring to the object, they would not find it. The rest of a call being
+	//written in fragments is still to come
+	MessagePriority priority = sendPriority(PRIORITY_CONTROL);
+	for(MessageQueue::const_iterator it = m_messageQueue.cbegin(); it != m_messageQueue.cend(); ++it)
+	{
+		if(it->priority > priority && std::find(it->objects.begin(), it->objects.end(), id) != it->objects.end())
+			priority = it->priority;
+	}
+	OutputBuffer out(m_bufferPool.acquire(16), m_wireVersion, sendStrings(priority));
 	unsigned int size = 0;
 	char type = RT_DELOBJ;
-	unsigned int requestID = getNextRequestID();
 
-	stream.write((const char*)&size, sizeof(size));
-	stream.write(&type, sizeof(type));
-	stream.write((const char*)&requestID, sizeof(requestID));
-	stream.write((const char*)&id, sizeof(id));
+	out.writeValue(size);
+	out.writeValue(type);
+	out.writeUInt(requestID, sizeof(requestID));
+	out.writeUInt(id, sizeof(id));
 
-	return sendBuffer(type, requestID, stream);
+	return sendBuffer(type, requestID, priority, out, nullptr, written);
 }
 
 void ClientBase::close()
 {
+	ClientList targets;
+	{
+		Lock lock(m_mutex);
+		targets.swap(m_relayedTo);
+	}
+	//Futures of calls relayed for this connection keep it alive until answered
+	for(ClientList::iterator it = targets.begin(); it != targets.end(); ++it)
+	{
+		if(ClientBasePtr target = it->lock())
+			target->dropRelays(this);
+	}
 	m_storage.freeClientObjects(shared_from_this());
 }
 
+void ClientBase::dropRelays(const ClientBase *origin)
+{
+	//Destroyed after the lock, their callbacks may hold other connections
+	std::vector<FutureResultPtr> dropped;
+	Lock lock(m_mutex);
+	RelayTargetMap::iterator it = m_relayTargets.begin();
+	while(it != m_relayTargets.end())
+	{
+		ClientBasePtr target = it->second.lock();
+		if(target && target.get() != origin)
+		{
+			++it;
+			continue;
+		}
+		//The answer is decoded as any other and dropped when it comes
+		FutureResultMap::iterator callback = m_callbacks.find(it->first);
+		if(callback != m_callbacks.end())
+		{
+			dropped.push_back(callback->second);
+			m_callbacks.erase(callback);
+			trackMemory(MEM_CALLBACKS, -(std::ptrdiff_t)MemoryGovernor::CALLBACK_BYTES);
+		}
+		trackMemory(MEM_CALLBACKS, -(std::ptrdiff_t)MemoryGovernor::CALLBACK_BYTES);
+		it = m_relayTargets.erase(it);
+	}
+}
+
+ObjectsStorage& ClientBase::storage()
+{
+	return m_storage;
+}
+
+ClientBase::Mutex& ClientBase::mutex() const
+{
+	return m_mutex;
+}
+
+string ClientBase::acquireBuffer(std::size_t size)
+{
+	Lock lock(m_mutex);
+	return m_bufferPool.acquire(size);
+}
+
+void ClientBase::releaseBuffer(string &buffer)
+{
+	Lock lock(m_mutex);
+	m_bufferPool.release(buffer);
+}
+
+void ClientBase::resetFrame()
+{
+	m_frameDecoder.clear();
+	trackMemory(MEM_RECEIVE, -(std::ptrdiff_t)m_streamMemory);
+	m_streamMemory = 0;
+	for(int i = 0; i < PRIORITY_CLASSES; i++)
+		clearAssembly(m_assembly[i]);
+}
+
 RequestID ClientBase::getNextRequestID()
 {
 	return m_nextRequestID++;
 }
 
-Variant ClientBase::sendBuffer(char type, RequestID requestID, std::ostringstream &stream)
+Variant ClientBase::sendBuffer(char type, RequestID requestID, MessagePriority priority, 
+	OutputBuffer &out, ObjectIDList *objects, const FutureResultPtr &written)
 {	
-	unsigned int size = (unsigned int)stream.tellp();
+	unsigned int size = (unsigned int)out.totalSize();
 	size -= sizeof(size);
-	stream.seekp(0);
-	stream.write((const char*)&size, sizeof(size));
+	out.writeAt(0, &size, sizeof(size));
+	if(m_wireVersion >= WIRE_V6 && priority != PRIORITY_CONTROL)
+	{
+		char typeByte = char(type | (priority << 6));
+		out.writeAt(sizeof(size), &typeByte, sizeof(typeByte));
+	}
 
 	RequestData rd;
 	rd.type = MessageType(type);
 	rd.id = requestID;
-	rd.data = stream.str();
+	rd.priority = priority;
+	rd.version = m_wireVersion;
+	if(objects)
+		rd.objects.swap(*objects);
+	//Answers and releases are not held back, the calls they end hold credit
+	rd.needsCredit = flowControl() && (type == RT_CALL_PROC || type == RT_CALL_FUNC);
+	rd.data.swap(out.str());
+	rd.spans.swap(out.spans());
 
 	if(asyncMode())
 	{
-		rd.writeCompletePtr.reset(new FutureResult);
-		bool empty = m_messageQueue.empty();
-		m_messageQueue.push(rd);
-		if(empty)
+		rd.writeCompletePtr = written ? written : FutureResultPtr(new FutureResult);
+		Variant future = rd.writeCompletePtr;
+		//A call takes its credit as it is queued, any left sends it whole
+		if(rd.needsCredit && !m_sendUnlimited)
 		{
-			writeData(m_messageQueue.front().data);			
+			m_sendCreditBytes -= messageSize(rd);
+			--m_sendCreditMessages;
 		}
-		return rd.writeCompletePtr;
+		trackMemory(MEM_SEND, messageSize(rd));
+		//Ahead of queued messages of lower classes, not of those being written or
+		//packed in an older format. Each class keeps its order, its strings are 
+		//defined before they are used
+		MessageQueue::iterator pos = m_messageQueue.end();
+		while(std::size_t(pos - m_messageQueue.begin()) > m_writingCount && 
+			(pos - 1)->priority > rd.priority && (pos - 1)->version == rd.version)
+			--pos;
+		m_messageQueue.insert(pos, std::move(rd));
+		//Messages sent during a write go out together when it completes
+		if(m_writingCount == 0 && !written)
+			writeQueue();
+		return future;
 	}
 	else
 	{
-		writeData(rd.data);	
+		m_writeSegments.clear();
+		appendSegments(rd, m_writeSegments);
+		writeData(m_writeSegments);
 	}
 	return Variant();
 }
 
-Variant ClientBase::sendCallRequest(char type, RequestID requestID, 
-		ObjectID id, const string &name, const Variant &args)
+void ClientBase::writeQueue()
+{
+	if(grantDue())
+		queueGrant();
+
+	//At least one message, then as many as fit the batch size. Calls out of
+	//credit are held before they are queued, nothing here waits for credit
+	m_writeSegments.clear();
+	m_fragmentHeaders.clear();
+	//No fragment header moves once its segment is taken
+	m_fragmentHeaders.reserve(m_messageQueue.size() * FRAGMENT_HEADER_SIZE);
+	std::size_t bytes = 0;
+	for(MessageQueue::iterator it = m_messageQueue.begin(); it != m_messageQueue.end(); ++it)
+	{
+		std::size_t fragment = nextFragment(*it);
+		std::size_t size = fragment ? FRAGMENT_HEADER_SIZE + fragment : messageSize(*it);
+		if(m_writingCount > 0 && bytes + size > m_maxWriteBatchSize)
+			break;
+		if(fragment)
+		{
+			appendFragment(*it, fragment, m_writeSegments);
+			it->sending = fragment;
+		}
+		else
+			appendSegments(*it, m_writeSegments);
+		bytes += size;
+		++m_writingCount;
+		//The rest waits for the next write, messages of higher classes queued
+		//meanwhile go between the fragments
+		if(fragment && it->sent + fragment < messageSize(*it) - sizeof(unsigned int))
+			break;
+	}
+	if(m_writingCount == 0)
+		return;
+	++m_writeCalls;
+	m_messagesWritten += m_writingCount;
+	writeData(m_writeSegments);
+}
+
+std::size_t ClientBase::nextFragment(const RequestData &rd) const
+{
+	//A message started in fragments goes on in them
+	std::size_t size = messageSize(rd);
+	if(rd.sent == 0 && (rd.version < WIRE_V7 || m_fragmentSize == 0 || size <= m_fragmentSize))
+		return 0;
+	std::size_t body = size - sizeof(unsigned int);
+	std::size_t fragment = m_fragmentSize != 0 ? m_fragmentSize - FRAGMENT_HEADER_SIZE : body;
+	return std::min(fragment, body - rd.sent);
+}
+
+void ClientBase::appendFragment(const RequestData &rd, std::size_t size, WriteSegmentList &segments)
+{
+	//A frame of its own in the class of the message, the last one ends the message
+	unsigned int frameSize = (unsigned int)(size + 1);
+	bool last = rd.sent + size == messageSize(rd) - sizeof(unsigned int);
+	char type = char((last ? RT_LAST_FRAGMENT : RT_FRAGMENT) | (rd.priority << 6));
+	std::size_t pos = m_fragmentHeaders.size();
+	m_fragmentHeaders.append((const char*)&frameSize, sizeof(frameSize));
+	m_fragmentHeaders.push_back(type);
+	segments.push_back(WriteSegment(m_fragmentHeaders.data() + pos, FRAGMENT_HEADER_SIZE));
+	appendSegments(rd, segments, sizeof(unsigned int) + rd.sent, size);
+}
+
+std::size_t ClientBase::messageSize(const RequestData &rd)
+{
+	std::size_t size = rd.data.size();
+	for(auto span = rd.spans.cbegin(); span != rd.spans.cend(); ++span)
+		size += span->size;
+	return size;
+}
+
+bool ClientBase::hasCredit() const
+{
+	//Any credit left sends a whole call, so one larger than the window goes too
+	return !flowControl() || m_sendUnlimited || 
+		(m_sendCreditBytes > 0 && m_sendCreditMessages > 0);
+}
+
+void ClientBase::releaseHeldCalls(HeldCallQueue &released)
+{
+	//In the order they were sent, a release goes with the call it waited for
+	while(!m_heldCalls.empty() && (m_heldCalls.front().type == RT_DELOBJ || hasCredit()))
+	{
+		released.push_back(m_heldCalls.front());
+		m_heldCalls.pop_front();
+		const HeldCall &call = released.back();
+		if(call.type == RT_DELOBJ)
+			sendRelease(call.id, call.object, call.written);
+		else
+			sendCallRequest(call.type, call.id, call.priority, call.object, call.name, call.args, call.written);
+	}
+}
+
+bool ClientBase::grantDue() const
+{
+	if(!flowControl())
+		return false;
+	if(m_grantWindow)
+		return true;
+	//Credit goes back in halves of the window rather than with every call
+	return m_recvWindowBytes != 0 && m_recvWindowMessages != 0 &&
+		(m_ungrantedBytes >= m_recvWindowBytes / 2 || m_ungrantedMessages >= m_recvWindowMessages / 2);
+}
+
+void ClientBase::queueGrant()
 {
-	std::ostringstream stream;
+	unsigned int bytes, messages;
+	if(m_recvWindowBytes == 0 || m_recvWindowMessages == 0)
+	{
+		bytes = 0;
+		messages = NO_CREDIT_LIMIT;
+	}
+	else if(m_grantWindow)
+	{
+		bytes = m_recvWindowBytes - std::min(m_heldBytes, m_recvWindowBytes);
+		messages = m_recvWindowMessages - std::min(m_heldMessages, m_recvWindowMessages);
+	}
+	else
+	{
+		bytes = m_ungrantedBytes;
+		messages = m_ungrantedMessages;
+	}
+	m_grantWindow = false;
+	m_ungrantedBytes = m_ungrantedMessages = 0;
+	if(bytes == 0 && messages == 0)
+		return;
+
+	//Goes ahead of everything queued, it uses no strings of the tables
+	OutputBuffer out(m_bufferPool.acquire(16), m_wireVersion);
 	unsigned int size = 0;
+	char type = RT_CREDIT;
+	out.writeValue(size);
+	out.writeValue(type);
+	out.writeUInt(bytes, sizeof(bytes));
+	out.writeUInt(messages, sizeof(messages));
+	size = (unsigned int)out.totalSize() - sizeof(size);
+	out.writeAt(0, &size, sizeof(size));
+
+	RequestData rd;
+	rd.type = RT_CREDIT;
+	rd.priority = PRIORITY_CONTROL;
+	rd.version = m_wireVersion;
+	rd.data.swap(out.str());
+	trackMemory(MEM_SEND, rd.data.size());
+	m_messageQueue.insert(frontPosition(), std::move(rd));
+}
+
+ClientBase::MessageQueue::iterator ClientBase::frontPosition()
+{
+	MessageQueue::iterator pos = m_messageQueue.begin() + m_writingCount;
+	for(MessageQueue::iterator it = pos; it != m_messageQueue.end(); ++it)
+	{
+		if(it->version != m_wireVersion)
+			pos = it + 1;
+	}
+	return pos;
+}
 
-	stream.write((const char*)&size, sizeof(size));
-	stream.write(&type, sizeof(type));
-	stream.write((const char*)&requestID, sizeof(requestID));
-	stream.write((const char*)&id, sizeof(id));
-	packStr(stream, name, 1);
-	m_storage.packVariant(stream, args, shared_from_this());
+void ClientBase::holdCredit(unsigned int bytes)
+{
+	if(bytes == 0)
+		return;
+	Lock lock(m_mutex);
+	m_heldBytes += bytes;
+	++m_heldMessages;
+}
+
+void ClientBase::returnCredit(unsigned int bytes)
+{
+	//Credit of calls from before the flow control started is not held
+	Lock lock(m_mutex);
+	if(bytes == 0 || m_heldMessages == 0)
+		return;
+	m_heldBytes -= std::min(bytes, m_heldBytes);
+	--m_heldMessages;
+	m_ungrantedBytes += bytes;
+	++m_ungrantedMessages;
+	if(m_writingCount == 0 && grantDue())
+		writeQueue();
+}
+
+void ClientBase::appendSegments(const RequestData &rd, WriteSegmentList &segments,
+	std::size_t offset, std::size_t size)
+{
+	//Message bytes around the spans
+	std::size_t first = segments.size();
+	std::size_t pos = 0;
+	for(auto it = rd.spans.cbegin(); it != rd.spans.cend(); ++it)
+	{
+		if(it->offset > pos)
+			segments.push_back(WriteSegment(rd.data.data() + pos, it->offset - pos));
+		segments.push_back(WriteSegment(static_cast<const char*>(it->data), it->size));
+		pos = it->offset;
+	}
+	if(pos < rd.data.size())
+		segments.push_back(WriteSegment(rd.data.data() + pos, rd.data.size() - pos));
+	if(offset == 0 && size >= messageSize(rd))
+		return;
+
+	//A fragment keeps the parts of the segments it covers
+	std::size_t end = offset + std::min(size, messageSize(rd) - offset);
+	std::size_t at = 0;
+	WriteSegmentList::iterator out = segments.begin() + first;
+	for(WriteSegmentList::iterator it = segments.begin() + first; it != segments.end(); ++it)
+	{
+		std::size_t start = at;
+		std::size_t from = std::max(start, offset);
+		std::size_t to = std::min(start + it->second, end);
+		at += it->second;
+		if(from < to)
+			*out++ = WriteSegment(it->first + (from - start), to - from);
+	}
+	segments.erase(out, segments.end());
+}
+
+Variant ClientBase::sendCallRequest(char type, RequestID requestID, MessagePriority priority,
+		ObjectID id, const string &name, const Variant &args, const FutureResultPtr &written)
+{
+	//Out of credit the call waits unpacked, as do those sent after it
+	if(!written && asyncMode() && (!m_heldCalls.empty() || !hasCredit()))
+	{
+		HeldCall call;
+		call.type = type;
+		call.id = requestID;
+		call.priority = priority;
+		call.object = id;
+		call.name = name;
+		call.args = args;
+		call.written.reset(new FutureResult);
+		m_heldCalls.push_back(call);
+		return call.written;
+	}
+
+	priority = sendPriority(priority);
+	OutputBuffer out(m_bufferPool.acquire(256), m_wireVersion, sendStrings(priority));
+	out.setSpanThreshold(m_spanThreshold);
+	out.setPlainTypes(m_wireVersion == WIRE_V1);
+	unsigned int size = 0;
+
+	out.writeValue(size);
+	out.writeValue(type);
+	out.writeUInt(requestID, sizeof(requestID));
+	out.writeUInt(id, sizeof(id));
+	out.writeKey(name.data(), name.size());
+	ObjectIDList objects(1, id);
+	m_storage.packVariant(out, args, shared_from_this(), &objects);
 
 	if(asyncMode())
-		return sendBuffer(type, requestID, stream);
+		return sendBuffer(type, requestID, priority, out, &objects, written);
 	else
 		m_syncRequestStack.push(requestID);
 	return Variant();
 }
 
-Variant ClientBase::sendReturnResponse(RequestID requestID, const Variant &v)
+Variant ClientBase::sendReturnResponse(RequestID requestID, MessagePriority priority, const Variant &v)
 {
-	std::ostringstream stream;
+	priority = sendPriority(priority);
+	OutputBuffer out(m_bufferPool.acquire(256), m_wireVersion, sendStrings(priority));
+	out.setSpanThreshold(m_spanThreshold);
+	out.setPlainTypes(m_wireVersion == WIRE_V1);
 	unsigned int size = 0;
 	char type = RT_RETURN;
 	LOG_DEBUG_FMT(0, "Send return response on request %1% value %2%", requestID % v.repr());
 
-	stream.write((const char*)&size, sizeof(size));
-	stream.write(&type, sizeof(type));
-	stream.write((const char*)&requestID, sizeof(requestID));
+	out.writeValue(size);
+	out.writeValue(type);
+	out.writeUInt(requestID, sizeof(requestID));
 
-	m_storage.packVariant(stream, v, shared_from_this());
-	return sendBuffer(type, requestID, stream);
+	ObjectIDList objects;
+	m_storage.packVariant(out, v, shared_from_this(), &objects);
+	return sendBuffer(type, requestID, priority, out, &objects);
 }
 
 void ClientBase::processIncomingRequest(const string &data)
 {
-	m_requireProcessing = true;
-	if(m_enableProcessing)
+	processIncomingRequest(data.data(), data.size());
+}
+
+void ClientBase::processIncomingRequest(const char *data, std::size_t size)
+{
+	//Only the connection's reads get here, the state it shares is locked where used
+	m_frameBytes = recvFlowControl() ? (unsigned int)(sizeof(unsigned int) + size) : 0;
+	m_frameSizeAverage = (m_frameSizeAverage * 7 + size) / 8;
+
+	//Nothing decoded into the arena outlives the processing of its frame, values
+	//kept by handlers are copied to the heap when they escape. A frame read by a
+	//sync call inside a handler frees its part before the outer frame goes on
+	Arena::Mark mark = m_arena.mark();
+	++m_processingDepth;
+	bool processed;
+	try
 	{
-		if(processInput(Variant(), data))
-		{			
+		processed = processInput(Variant(), data, size);
+	}
+	catch(...)
+	{
+		--m_processingDepth;
+		m_arena.rewind(mark);
+		throw;
+	}
+	--m_processingDepth;
+	m_arena.rewind(mark);
+
+	if(processed)
+		startRead();
+}
+
+ClientBase::FrameStart ClientBase::startFrame(const char *data, std::size_t size, 
+	std::size_t frameSize, std::size_t &taken, std::size_t &needed)
+{
+	taken = needed = 0;
+	if(m_streamFrameSize == 0 || frameSize < m_streamFrameSize || !asyncMode())
+		return FRAME_WHOLE;
+
+	if(size > frameSize)
+		size = frameSize;
+	InputBuffer in(data, size, m_recvWireVersion, recvStrings(framePriority(data, size)));
+	try
+	{
+		readFrameHeader(in, m_frameHeader);
+	}
+	catch(const std::exception&)
+	{
+		if(size == frameSize)
+			throw;
+		needed = std::min(frameSize, 2 * size + 1);
+		return FRAME_MORE;
+	}
+	if(in.pos() == frameSize || frameNeedsBytes(m_frameHeader))
+		return FRAME_WHOLE;
+
+	taken = in.pos();
+	m_frameBytes = recvFlowControl() ? (unsigned int)(sizeof(unsigned int) + frameSize) : 0;
+	m_frameSizeAverage = (m_frameSizeAverage * 7 + frameSize) / 8;
+	//The decoder builds the value up to the size of the frame
+	m_streamMemory = frameSize;
+	trackMemory(MEM_RECEIVE, m_streamMemory);
+	m_frameDecoder.start(frameSize - taken, m_recvWireVersion, recvStrings(m_frameHeader.priority), 
+		boost::bind(&ObjectsStorage::IDtoObjectReplacer, &m_storage, _1, shared_from_this()));
+	return FRAME_STREAM;
+}
+
+std::size_t ClientBase::continueFrame(const char *data, std::size_t size, std::size_t &needed)
+{
+	//Only the connection's reads feed the decoder
+	std::size_t taken = m_frameDecoder.feed(data, size);
+	needed = m_frameDecoder.needed();
+	if(m_frameDecoder.done())
+	{
+		//As processIncomingRequest, with the body decoded already
+		Variant body = m_frameDecoder.take();
+		resetFrame();
+		if(processFrame(m_frameHeader, body, nullptr))
 			startRead();
-		}
-		else m_delayedData = data;
 	}
+	return taken;
 }
 
 void ClientBase::processDataWritten()
 {
-	if(!m_messageQueue.empty())
+	//Callbacks run in queue order once the next write is started, outside the lock
+	std::vector<FutureResultPtr> completed;
+	Lock lock(m_mutex);
+	for(std::size_t count = m_writingCount; count > 0 && !m_messageQueue.empty(); --count)
 	{
+		//A message written up to a fragment stays queued for the rest
 		RequestData &rd = m_messageQueue.front();
-		rd.writeCompletePtr->callback(Variant());
-		m_messageQueue.pop();
-		if(!m_messageQueue.empty())
+		rd.sent += rd.sending;
+		rd.sending = 0;
+		if(rd.sent > 0 && rd.sent < messageSize(rd) - sizeof(unsigned int))
+			break;
+
+		FutureResultPtr written;
+		written.swap(rd.writeCompletePtr);
+		trackMemory(MEM_SEND, -(std::ptrdiff_t)messageSize(rd));
+		m_bufferPool.release(rd.data);
+		m_messageQueue.pop_front();
+		if(written)
+			completed.push_back(written);
+	}
+	m_writingCount = 0;
+
+	//Messages of higher classes queued during the write go before its next fragment
+	if(!m_messageQueue.empty() && m_messageQueue.front().sent > 0)
+	{
+		std::size_t pos = 1;
+		while(pos < m_messageQueue.size() && m_messageQueue[pos].priority < m_messageQueue.front().priority)
+			++pos;
+		if(pos > 1)
 		{
-			writeData(m_messageQueue.front().data);			
+			RequestData rd(std::move(m_messageQueue.front()));
+			m_messageQueue.pop_front();
+			m_messageQueue.insert(m_messageQueue.begin() + (pos - 1), std::move(rd));
 		}
 	}
+	writeQueue();
+	lock.unlock();
+
+	for(std::vector<FutureResultPtr>::iterator it = completed.begin(); it != completed.end(); ++it)
+		(*it)->callback(Variant());
 }
 
-bool ClientBase::findAndStartCallback(const Variant &result, RequestID id)
+bool ClientBase::findAndStartCallback(Variant &result, RequestID id)
 {
-	FutureResultMap::iterator it = m_callbacks.find(id);
-	if(it == m_callbacks.end()) return true;
+	FutureResultPtr future;
+	WireVersion version;
+	{
+		Lock lock(m_mutex);
+		FutureResultMap::iterator it = m_callbacks.find(id);
+		if(it == m_callbacks.end()) return true;
+		future = it->second;
+		m_callbacks.erase(it);
+		trackMemory(MEM_CALLBACKS, -(std::ptrdiff_t)MemoryGovernor::CALLBACK_BYTES);
+		version = m_wireVersion;
+	}
 
 	Variant v;
-	if(result.isException())
-		v = it->second->errback(result);
+	const Variant &packed = result;
+	if(result.isException() || 
+		(result.isPacked() && VariantView(packed.getPacked().data(), packed.getPacked().size(), 
+			nullptr, version).isException()))
+		v = future->errback(std::move(result));
 	else
-		v = it->second->callback(result);
+		v = future->callback(std::move(result));
 
 	if(v.isFuture())
 	{
 		FutureResultPtr f = v.toFuture();
 		f->addBoth(boost::bind(&ClientBase::startRead, shared_from_this(), Variant()));
 	}
-
-	m_callbacks.erase(it);
 	return !v.isFuture();
 }
 
-Variant ClientBase::disableProcessing(RequestID requestID, const Variant &v)
+bool ClientBase::beginCall()
 {
-	m_enableProcessing = false;
-	FutureResultPtr f = sendReturnResponse(requestID, v).toFuture();
-	f->addCallback(boost::bind(&ClientBase::enableProcessing, shared_from_this(), Variant()));
-	return Variant();
+	//Reading stops at the limit and goes on when a call completes
+	Lock lock(m_mutex);
+	++m_callsInFlight;
+	if(m_maxCallsInFlight == 0 || m_callsInFlight < m_maxCallsInFlight)
+		return true;
+	m_readPaused = true;
+	return false;
+}
+
+Variant ClientBase::endCall(unsigned int credit, const Variant &v)
+{
+	bool resume = false;
+	{
+		Lock lock(m_mutex);
+		returnCredit(credit);
+		--m_callsInFlight;
+		if(m_readPaused && m_callsInFlight < m_maxCallsInFlight)
+		{
+			m_readPaused = false;
+			resume = true;
+		}
+	}
+	//Frames may be processed right away on the connection's strand
+	if(resume)
+		startRead();
+	return v;
 }
 
-Variant ClientBase::enableProcessing(const Variant &v)
+Variant ClientBase::returnCall(RequestID requestID, MessagePriority priority, unsigned int credit, 
+	const Variant &v)
 {
-	m_enableProcessing = true;
-	if(m_requireProcessing)
-		processIncomingRequest(m_delayedData);
+	//Credit goes back with the result, an answer waiting behind our calls out
+	//of credit does not keep the peer's calls from going on
+	Variant written;
+	{
+		Lock lock(m_mutex);
+		returnCredit(credit);
+		//The call completes when its answer is written
+		written = sendReturnResponse(requestID, priority, v);
+	}
+	if(written.isFuture())
+		written.toFuture()->addCallback(boost::bind(&ClientBase::endCall, shared_from_this(), 0, _1));
+	else
+		endCall(0, Variant());
 	return Variant();
 }
 
-bool ClientBase::processInput(Variant &result, const string &data)
+void ClientBase::readFrameHeader(InputBuffer &in, FrameHeader &header)
 {
-	char type;
-	RequestID requestID;
-	std::istringstream stream(data);	
+	in.readValue(header.type);
+	header.priority = PRIORITY_NORMAL;
+	if(m_recvWireVersion >= WIRE_V6)
+	{
+		header.priority = MessagePriority((unsigned char)header.type >> 6);
+		header.type &= 0x3f;
+	}
+	header.requestID = 0;
+	header.id = 0;
+	header.name.clear();
 
-	m_requireProcessing = false;
+	if(header.type == RT_RETURN || header.type == RT_CALL_PROC || 
+		header.type == RT_CALL_FUNC || header.type == RT_DELOBJ)
+	{
+		header.requestID = (RequestID)in.readUInt(sizeof(header.requestID));
+	}
 
-	stream.read(&type, sizeof(type));
+	if(header.type == RT_CALL_PROC || header.type == RT_CALL_FUNC)
+	{
+		header.id = (ObjectID)in.readUInt(sizeof(header.id));
+
+		std::size_t nameLen;
+		const char *nameData = in.readKey(nameLen);
+		header.name.assign(nameData, nameLen);
+	}
+}
 
-	if(type == RT_RETURN || type == RT_CALL_PROC || type == RT_CALL_FUNC || type == RT_DELOBJ)
+bool ClientBase::frameNeedsBytes(const FrameHeader &header) const
+{
+	//Relayed values are copied and views read the message in place
+	if(header.type == RT_RETURN)
 	{
-		stream.read((char*)&requestID, sizeof(requestID));
+		Lock lock(m_mutex);
+		return !asyncMode() || m_relayTargets.count(header.requestID) != 0;
 	}
+	if(header.type == RT_CALL_PROC || header.type == RT_CALL_FUNC)
+	{
+		if(header.id == 0 && header.type == RT_CALL_FUNC && header.name == WIRE_VERSION_METHOD)
+			return true;
+		boost::shared_ptr<RemoteObject> proxy = m_storage.findRemoteObject(header.id);
+		if(proxy && proxy->client()->asyncMode())
+			return true;
+		return m_storage.hasViewMethod(header.id, header.name);
+	}
+	return true;
+}
+
+bool ClientBase::processInput(Variant &result, const char *data, std::size_t size)
+{
+	InputBuffer in(data, size, m_recvWireVersion, recvStrings(framePriority(data, size)));
+	FrameHeader header;
+	readFrameHeader(in, header);
+	return processFrame(header, result, &in);
+}
+
+bool ClientBase::processFrame(const FrameHeader &header, Variant &result, InputBuffer *in)
+{
+	char type = header.type;
+	RequestID requestID = header.requestID;
+	unsigned int credit = m_frameBytes;
+	m_frameBytes = 0;
 
 	if(type == RT_RETURN)
 	{
@@ -278,8 +1312,26 @@ bool ClientBase::processInput(Variant &result, const string &data)
 			}
 		}
 
-		//result.unpack(stream);		
-		m_storage.unpackVariant(stream, result, shared_from_this());
+		ClientBasePtr origin;
+		{
+			Lock lock(m_mutex);
+			RelayTargetMap::iterator relay = m_relayTargets.find(requestID);
+			if(relay != m_relayTargets.end())
+			{
+				origin = relay->second.lock();
+				m_relayTargets.erase(relay);
+				trackMemory(MEM_CALLBACKS, -(std::ptrdiff_t)MemoryGovernor::CALLBACK_BYTES);
+			}
+		}
+		if(origin && in)
+		{
+			result = m_storage.relayVariant(*in, shared_from_this(), origin);
+		}
+		else if(in)
+		{
+			//result.unpack(in);		
+			unpackVariant(*in, result);
+		}
 		LOG_DEBUG_FMT(0, "Receive answer on request %d value %s", requestID % result.repr());
 		//m_storage.replaceIDsToObjects(result, shared_from_this());
 		if(asyncMode())
@@ -296,68 +1348,145 @@ bool ClientBase::processInput(Variant &result, const string &data)
 	else
 	if(type == RT_CALL_PROC || type == RT_CALL_FUNC)
 	{
-		ObjectID id;
-		stream.read((char*)&id, sizeof(id));
+		ObjectID id = header.id;
+		const string &name = header.name;
 
-		string name;
-		unpackStr(stream, name, 1);
+		if(id == 0 && type == RT_CALL_FUNC && name == WIRE_VERSION_METHOD)
+			return answerWireVersion(requestID, *in);
 			
 		Variant args;
-		//args.unpack(stream);
-		//m_storage.replaceIDsToObjects(args, shared_from_this());
-		m_storage.unpackVariant(stream, args, shared_from_this());
-
-		LOG_DEBUG_FMT(0, "Receive request %d call <object id %d>.%s(%s)", 
-			requestID % id % name % args.repr());	
+		VariantView::ObjectList objects;
+		VariantView view;
+		boost::shared_ptr<RemoteObject> proxy = m_storage.findRemoteObject(id);
+		bool relayCall = proxy && proxy->client()->asyncMode();
+		bool viewCall = !relayCall && m_storage.hasViewMethod(id, name);
+		if(relayCall)
+		{
+			//Arguments for another connection are not decoded, only object ids are rewritten
+			args = m_storage.relayVariant(*in, shared_from_this(), proxy->client());
+			LOG_DEBUG_FMT(0, "Receive request %d call <object id %d>.%s(%s)", 
+				requestID % id % name % args.repr());	
+		}
+		else if(viewCall)
+		{
+			//Only object ids are taken from the message, the method reads the rest in place
+			view = VariantView(*in, &objects);
+			view.resolveObjects(objects, boost::bind(&ObjectsStorage::IDtoObjectReplacer, 
+				&m_storage, _1, shared_from_this()));
+			LOG_DEBUG_FMT(0, "Receive request %d call <object id %d>.%s(%s)", 
+				requestID % id % name % view.repr());	
+		}
+		else
+		{
+			//args.unpack(in);
+			//m_storage.replaceIDsToObjects(args, shared_from_this());
+			if(in)
+				unpackVariant(*in, args);
+			else
+				args = std::move(result);
+			LOG_DEBUG_FMT(0, "Receive request %d call <object id %d>.%s(%s)", 
+				requestID % id % name % args.repr());	
+		}
 
 		FutureResultPtr written;	
+		holdCredit(credit);
 		
+		//Frames keep being read while calls are in flight, answers go back in 
+		//the order the calls complete
 		if(type == RT_CALL_FUNC)
 		{			
-			result = m_storage.localCall(id, name, args, true, -1, written);
-			if(written)	//Отложенный результат удаленного транзитного вызова
-			{
-				written->addCallback(boost::bind(&ClientBase::startRead, 
-					shared_from_this(), Variant()));
+			if(relayCall)
+				result = m_storage.relayCall(id, name, args, header.priority, true, shared_from_this(), written);
+			else if(viewCall)
+				result = m_storage.localViewCall(id, name, view, true, -1, written);
+			else
+				result = m_storage.localCall(id, name, args, true, -1, written);
 
-				FutureResultPtr f = result.toFuture();
-				f->addBoth(boost::bind(&ClientBase::sendReturnResponse, 
-					shared_from_this(), requestID, _1));
-				return false;
-			}
-
-			if(result.isFuture())	//Отложенный результат локального вызова 
+			bool more = beginCall();
+			if(result.isFuture())	//Отложенный результат локального или транзитного вызова
 			{
 				FutureResultPtr f = result.toFuture();
-				f->addBoth(boost::bind(&ClientBase::disableProcessing, 
-					shared_from_this(), requestID, _1));				
-				return true;
+				f->addBoth(boost::bind(&ClientBase::returnCall, 
+					shared_from_this(), requestID, header.priority, credit, _1));
 			}			
 			else //Результат локального вызова
 			{		
-				FutureResultPtr f = sendReturnResponse(requestID, result).toFuture();
-				f->addCallback(boost::bind(&ClientBase::startRead, 
-					shared_from_this(), Variant()));
-				return false;
+				returnCall(requestID, header.priority, credit, result);
 			}			
+			return more;
 		}
 		else
 		{
-			m_storage.localCall(id, name, args, false, -1, written);
+			if(relayCall)
+				m_storage.relayCall(id, name, args, header.priority, false, shared_from_this(), written);
+			else if(viewCall)
+				m_storage.localViewCall(id, name, view, false, -1, written);
+			else
+				m_storage.localCall(id, name, args, false, -1, written);
 			if(written)
 			{
-				written->addCallback(boost::bind(&ClientBase::startRead, 
-					shared_from_this(), Variant()));
-				return false;
+				//A relayed call holds its credit until the next peer takes it
+				bool more = beginCall();
+				written->addCallback(boost::bind(&ClientBase::endCall, 
+					shared_from_this(), credit, _1));
+				return more;
 			}			
+			returnCredit(credit);
 			return true;
 		}
 	}
 	else
+	if(type == RT_CREDIT)
+	{
+		unsigned int bytes = (unsigned int)in->readUInt(sizeof(bytes));
+		unsigned int messages = (unsigned int)in->readUInt(sizeof(messages));
+		HeldCallQueue released;
+		Lock lock(m_mutex);
+		if(messages == NO_CREDIT_LIMIT)
+			m_sendUnlimited = true;
+		m_sendCreditBytes += bytes;
+		m_sendCreditMessages += messages;
+		releaseHeldCalls(released);
+		if(m_writingCount == 0 && !m_messageQueue.empty())
+			writeQueue();
+		return true;
+	}
+	else
+	if(type == RT_FRAGMENT || type == RT_LAST_FRAGMENT)
+	{
+		return assembleFragment(header, *in);
+	}
+	else
+	if(type == RT_STRINGS)
+	{
+		//Sent on a new connection of the session, the entries of all the messages
+		//packed so far in the class, queued ones define theirs again
+		StringTable *table = recvStrings(header.priority);
+		std::size_t count = (std::size_t)in->readUInt(sizeof(unsigned int));
+		if(!table || count > StringTable::MAX_SIZE)
+			throw std::runtime_error((boost::format("Invalid string table of %1% entries") % count).str());
+		table->clear();
+		for(std::size_t i = 0; i < count; i++)
+		{
+			std::size_t len = (std::size_t)in->readUInt(sizeof(unsigned int));
+			table->define(i, in->readSpan(len), len);
+		}
+		return true;
+	}
+	else
+	if(type == RT_WIRE_VERSION)
+	{
+		Lock lock(m_mutex);
+		LOG_DEBUG_FMT(0, "Peer switched to wire version %1%", int(m_wireVersion));
+		m_recvWireVersion = m_wireVersion;
+		for(int i = 0; i < PRIORITY_CLASSES; i++)
+			m_recvStrings[i].clear();
+		return true;
+	}
+	else
 	if(type == RT_DELOBJ)
 	{
-		ObjectID id;
-		stream.read((char*)&id, sizeof(id));
+		ObjectID id = (ObjectID)in->readUInt(sizeof(id));
 		LOG_DEBUG_FMT(0, "Receive request %d on delete object %d", requestID % id);
 		m_storage.deleteObject(id);
 		return true;
@@ -366,25 +1495,177 @@ bool ClientBase::processInput(Variant &result, const string &data)
 	return false;
 }
 
+bool ClientBase::assembleFragment(const FrameHeader &header, InputBuffer &in)
+{
+	//Fragments of a class come in order, other classes may go between them
+	Assembly &assembly = m_assembly[header.priority];
+	std::size_t size = in.remaining();
+	if(m_maxAssembledSize != 0 && assembly.size + size > m_maxAssembledSize)
+	{
+		//As a frame over the max message size, only this connection is dropped
+		LOG_ALARM_FMT(0, "Max assembled message size %1% bytes exceeded by %2% bytes",
+			m_maxAssembledSize % (assembly.size + size));
+		clearAssembly(assembly);
+		close();
+		return false;
+	}
+	const char *data = in.readSpan(size);
+	bool last = header.type == RT_LAST_FRAGMENT;
+	assembly.size += size;
+	trackMemory(MEM_RECEIVE, size);
+
+	if(assembly.mode != Assembly::STREAMED)
+	{
+		if(assembly.data.empty())
+			assembly.data = acquireBuffer(size);
+		assembly.data.append(data, size);
+		if(assembly.mode == Assembly::HEADER)
+			startAssembly(assembly, header.priority, last);
+		if(assembly.mode != Assembly::STREAMED)
+		{
+			if(!last)
+				return true;
+
+			//Processed as if the message came in one frame
+			string body;
+			body.swap(assembly.data);
+			m_frameBytes = recvFlowControl() ? (unsigned int)(sizeof(unsigned int) + body.size()) : 0;
+			clearAssembly(assembly);
+			Variant result;
+			bool processed = processInput(result, body.data(), body.size());
+			releaseBuffer(body);
+			return processed;
+		}
+		size = 0;
+	}
+
+	//Bytes the decoder did not take go first, the fragment is fed in place otherwise
+	if(!assembly.data.empty() && size > 0)
+	{
+		assembly.data.append(data, size);
+		size = 0;
+	}
+	bool kept = !assembly.data.empty();
+	if(kept)
+	{
+		data = assembly.data.data();
+		size = assembly.data.size();
+	}
+	if(last)
+		assembly.decoder.end(size);
+	std::size_t taken = assembly.decoder.feed(data, size);
+	if(kept)
+		assembly.data.erase(0, taken);
+	else
+		assembly.data.assign(data + taken, size - taken);
+	if(!last)
+		return true;
+
+	//As processIncomingRequest, with the body decoded already
+	Variant body = assembly.decoder.take();
+	FrameHeader frame = assembly.header;
+	m_frameBytes = recvFlowControl() ? (unsigned int)(sizeof(unsigned int) + assembly.size) : 0;
+	clearAssembly(assembly);
+	return processFrame(frame, body, nullptr);
+}
+
+void ClientBase::startAssembly(Assembly &assembly, MessagePriority priority, bool last)
+{
+	if(m_streamFrameSize == 0 || !asyncMode())
+	{
+		assembly.mode = Assembly::BUFFERED;
+		return;
+	}
+	InputBuffer in(assembly.data.data(), assembly.data.size(), m_recvWireVersion, recvStrings(priority));
+	try
+	{
+		readFrameHeader(in, assembly.header);
+	}
+	catch(const std::exception&)
+	{
+		//Read again with the next fragment, the last one has the whole message
+		if(last)
+			assembly.mode = Assembly::BUFFERED;
+		return;
+	}
+	if(frameNeedsBytes(assembly.header))
+	{
+		assembly.mode = Assembly::BUFFERED;
+		return;
+	}
+
+	//The size is known with the last fragment, the limit bounds it until then
+	std::size_t limit = m_maxAssembledSize != 0 ? m_maxAssembledSize - in.pos() : std::size_t(-1);
+	assembly.decoder.start(limit, m_recvWireVersion, recvStrings(priority), 
+		boost::bind(&ObjectsStorage::IDtoObjectReplacer, &m_storage, _1, shared_from_this()));
+	assembly.data.erase(0, in.pos());
+	assembly.mode = Assembly::STREAMED;
+}
+
+void ClientBase::clearAssembly(Assembly &assembly)
+{
+	trackMemory(MEM_RECEIVE, -(std::ptrdiff_t)assembly.size);
+	releaseBuffer(assembly.data);
+	assembly.decoder.clear();
+	assembly.size = 0;
+	assembly.mode = Assembly::HEADER;
+}
+
+void ClientBase::unpackVariant(InputBuffer &in, Variant &v)
+{
+	if(m_arenaMode)
+		m_storage.unpackVariant(in, v, m_arena, shared_from_this());
+	else
+		m_storage.unpackVariant(in, v, shared_from_this());
+}
+
 void ClientBase::cancelRequestQueue(const std::exception &error)
 {
-	int count = 0;
+	//Completed once the lock is released, the held calls' values go with them
+	std::vector<FutureResultPtr> cancelled;
+	HeldCallQueue held;
+	Lock lock(m_mutex);
 	while(!m_messageQueue.empty())
 	{
 		RequestData &rd = m_messageQueue.front();
 		if(rd.type == RT_CALL_PROC || rd.type == RT_CALL_FUNC)
 		{
-			FutureResultMap::iterator it = m_callbacks.find(rd.id);
-			if(it != m_callbacks.end())
-			{
-				++count;
-				it->second->errback(error);
-				m_callbacks.erase(it);
-			}
+			if(FutureResultPtr future = cancelCall(rd.id))
+				cancelled.push_back(future);
 		}
-		m_messageQueue.pop();
+		trackMemory(MEM_SEND, -(std::ptrdiff_t)messageSize(rd));
+		m_messageQueue.pop_front();
 	}
-	LOG_DEBUG_FMT(0, "Canceling %d request queue items", count);
+	m_writingCount = 0;
+	held.swap(m_heldCalls);
+	for(HeldCallQueue::iterator it = held.begin(); it != held.end(); ++it)
+	{
+		if(it->type == RT_DELOBJ)
+			continue;
+		if(FutureResultPtr future = cancelCall(it->id))
+			cancelled.push_back(future);
+	}
+	//Calls already sent are not answered by another session either
+	while(!m_callbacks.empty())
+		cancelled.push_back(cancelCall(m_callbacks.begin()->first));
+	lock.unlock();
+
+	LOG_DEBUG_FMT(0, "Canceling %d request queue items", cancelled.size());
+	for(std::vector<FutureResultPtr>::iterator it = cancelled.begin(); it != cancelled.end(); ++it)
+		(*it)->errback(error);
+}
+
+FutureResultPtr ClientBase::cancelCall(RequestID requestID)
+{
+	if(m_relayTargets.erase(requestID) != 0)
+		trackMemory(MEM_CALLBACKS, -(std::ptrdiff_t)MemoryGovernor::CALLBACK_BYTES);
+	FutureResultMap::iterator it = m_callbacks.find(requestID);
+	if(it == m_callbacks.end())
+		return FutureResultPtr();
+	FutureResultPtr future = it->second;
+	m_callbacks.erase(it);
+	trackMemory(MEM_CALLBACKS, -(std::ptrdiff_t)MemoryGovernor::CALLBACK_BYTES);
+	return future;
 }
 
 
@@ -3,17 +3,25 @@
 #define BOOST_ASIO_HAS_MOVE
 
 #include <stack>
-#include <queue>
-#include <sstream>
+#include <deque>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/locks.hpp>
 
 #include "defs.h"
 #include "variant.h"
+#include "buffer.h"
+#include "arena.h"
+#include "buffer_pool.h"
+#include "stream_decoder.h"
+#include "string_table.h"
+#include "memory_governor.h"
 
 namespace DualRPC
 {
 
 extern const char* PROTOCOL_NAME;
+extern const char* WIRE_VERSION_METHOD;
 
 class ClientBase : public boost::enable_shared_from_this<ClientBase>
 {
@@ -21,75 +29,367 @@ class ClientBase : public boost::enable_shared_from_this<ClientBase>
 	ClientBase(ObjectsStorage &storage);
 	virtual ~ClientBase();
 
+	//Limits each frame, a message sent in fragments is limited by the assembled size
 	void setMaxMessageSize(unsigned int size);
 	unsigned int getMaxMessageSize() const;	
 
+	//From wire version 7 on, messages larger than this are sent as frames of this 
+	//size with their headers. Messages of other classes go between the fragments, 
+	//0 sends every message whole
+	void setFragmentSize(unsigned int size);
+	unsigned int getFragmentSize() const;
+	//Messages received in fragments are put together up to this size, 0 is no
+	//limit. It is the max message size until set
+	void setMaxAssembledSize(unsigned int size);
+	unsigned int getMaxAssembledSize() const;
+
+	//Strings and arrays of at least this size are written from their own 
+	//memory instead of being copied into the message, 0 copies everything
+	void setSpanThreshold(unsigned int size);
+	unsigned int getSpanThreshold() const;
+
 	void setAsyncMode(bool value);
 	bool asyncMode() const;
+
+	//Decode incoming messages into a per-connection arena released after each message
+	void setArenaMode(bool value);
+	bool arenaMode() const;
+	const Arena& arena() const;
+
+	//Frames of at least this size are decoded while their bytes arrive instead
+	//of being buffered whole, 0 buffers every frame
+	void setStreamFrameSize(unsigned int size);
+	unsigned int getStreamFrameSize() const;
+
+	//Calls from the peer are processed while earlier ones are in flight, up to
+	//this many. A call is in flight until its answer is written, 0 is no limit
+	void setMaxCallsInFlight(unsigned int count);
+	unsigned int getMaxCallsInFlight() const;
+	unsigned int callsInFlight() const;
+
+	//Budget for calls from the peer, advertised from wire version 5 on. The peer
+	//sends calls while it has credit and queues them after, credit of a call
+	//comes back when it is no longer in flight. 0 in either turns it off
+	void setReceiveWindow(unsigned int bytes, unsigned int messages);
+	unsigned int getReceiveWindowBytes() const;
+	unsigned int getReceiveWindowMessages() const;
+	//Credit left for calls to the peer, negative after one larger than it was
+	__int64 sendCreditBytes() const;
+	__int64 sendCreditMessages() const;
+	//Messages waiting to be written, calls out of credit among them. Their
+	//write futures complete once they are written
+	std::size_t queuedMessages() const;
+
+	//Queued messages are sent together by one write of up to this many bytes,
+	//a larger message is still written alone
+	void setMaxWriteBatchSize(unsigned int size);
+	unsigned int getMaxWriteBatchSize() const;
+	//Writes issued for queued messages and the messages they carried
+	std::size_t writeCalls() const;
+	std::size_t messagesWritten() const;
+	double averageMessagesPerWrite() const;
+
+	//Storage of incoming frames and outgoing messages, reused between messages
+	BufferPool& bufferPool();
+	const BufferPool& bufferPool() const;
+
+	//Highest wire version asked for or accepted from the peer
+	void setMaxWireVersion(WireVersion version);
+	WireVersion getMaxWireVersion() const;
+	//Format of messages after the handshake, WIRE_V1 until the peers agree on more
+	WireVersion wireVersion() const;
 	
+	//Memory the connection holds is reported to governor, which may pause its
+	//reads. Set before the connection starts, the governor outlives it
+	void setMemoryGovernor(MemoryGovernor *governor);
+	MemoryGovernor* memoryGovernor() const;
+	//Memory taken for the connection, negative when it is freed
+	void trackMemory(MemoryKind kind, std::ptrdiff_t bytes);
+
 	virtual void close();
 
+	//Classes are kept apart from wire version 6 on, older peers get every 
+	//message in the order it was sent
 	Variant call(ObjectID id, const string &name, const Variant &args, bool withResult, 
-		float timeout, FutureResultPtr &written);
+		float timeout, FutureResultPtr &written, MessagePriority priority = PRIORITY_NORMAL);
 
 	Variant destroyObject(ObjectID id);		
 
+	//Call with packed arguments whose packed result goes back to origin
+	Variant relayCall(ObjectID id, const string &name, const Variant &args, MessagePriority priority,
+		bool withResult, const ClientBasePtr &origin, FutureResultPtr &written);
+
 protected:
+	//Piece of a message, one write sends a list of them in order
+	typedef std::pair<const char*, std::size_t> WriteSegment;
+	typedef std::vector<WriteSegment> WriteSegmentList;
+
+	typedef boost::recursive_mutex Mutex;
+	typedef boost::unique_lock<Mutex> Lock;
+
+	ObjectsStorage& storage();
+	//Guards what the threads sending on the connection share with its reads:
+	//the message queue, credit, request maps and the buffer pool. Frames are 
+	//read and processed outside it, objects and futures are never called under it
+	Mutex& mutex() const;
+	//Buffers of the pool for received frames
+	string acquireBuffer(std::size_t size);
+	void releaseBuffer(string &buffer);
+
 	virtual Variant startRead(const Variant &v = Variant()) = 0;
+	//Stops taking bytes from the peer until called with false, from any thread
+	virtual void throttleReads(bool /*value*/) {}
+	//Frames may be parsed in place, data is not used after the call returns
+	void processIncomingRequest(const char *data, std::size_t size);
 	void processIncomingRequest(const string &data);
-	virtual void writeData(const string &data) = 0;
+
+	enum FrameStart
+	{
+		FRAME_MORE,		//more bytes of the frame are needed to decide
+		FRAME_STREAM,	//the rest of the frame goes to continueFrame
+		FRAME_WHOLE		//the frame goes buffered to processIncomingRequest
+	};
+	//Decides from the first bytes of a frame's body how it is processed. Relayed
+	//frames and views need all of the bytes, small frames are cheaper buffered.
+	//taken gets the header bytes that are done with, needed the bytes to wait for
+	FrameStart startFrame(const char *data, std::size_t size, std::size_t frameSize,
+		std::size_t &taken, std::size_t &needed);
+	//Returns the bytes of a streamed frame taken, the frame is processed with its
+	//last byte. needed gets the bytes to gather before the next call
+	std::size_t continueFrame(const char *data, std::size_t size, std::size_t &needed);
+	//Drops a streamed frame of a connection that is gone
+	void resetFrame();
+	//Sends the segments with one write, the memory stays alive until processDataWritten
+	virtual void writeData(const WriteSegmentList &segments) = 0;
+	//Completes the messages of the last write and writes the ones queued since
 	void processDataWritten();
 
 	void sendRequestQueue();
+	//Fails every call not answered yet, queued, held or sent, when the session is gone
 	void cancelRequestQueue(const std::exception &error);
 
+	//Asks the peer for a newer wire format by a call to the global object that
+	//old peers answer with an error. Returns the future of the answer, the
+	//format is switched before its callbacks run. Null if nothing was asked
+	Variant requestWireVersion();
+	void setWireVersion(WireVersion version);
+	//Credit of the old connection is lost with it, the peers grant it again
+	void restartFlowControl();
+	//Messages the old connection cut off between fragments are sent again from
+	//their start, the peer dropped what it had of them
+	void restartFragments();
+	//Entries defined by messages the old connection lost are sent again, the
+	//peer replaces its tables with the whole of ours ahead of the queued messages
+	void restartStringTables();
+
 private:
+	friend class MemoryGovernor;
+
 	enum MessageType
 	{
 		RT_PING = 0,
 		RT_PONG = 1,
+		RT_CREDIT = 2,
+		RT_FRAGMENT = 3,
+		RT_LAST_FRAGMENT = 4,
+		RT_WIRE_VERSION = 5,
+		RT_STRINGS = 6,
 		RT_CALL_PROC = 10,
 		RT_CALL_FUNC = 11,
 		RT_RETURN = 20,
 		RT_DELOBJ = 30
 	};	
+	//Messages of a grant that lifts the limit
+	static const unsigned int NO_CREDIT_LIMIT = 0xffffffff;
+	//Size and type of a fragment's frame
+	static const std::size_t FRAGMENT_HEADER_SIZE = sizeof(unsigned int) + 1;
 	struct RequestData
 	{
 		MessageType type;
 		RequestID id;
+		MessagePriority priority;
+		//Format it was packed in, the peer switches after the messages of the old one
+		WireVersion version;
+		//Called object and proxies of the connection packed in the message, 
+		//releases of them are not sent ahead of it
+		ObjectIDList objects;
+		bool needsCredit;
+		//Bytes of the body sent in fragments and in the fragment being written
+		std::size_t sent, sending;
 		FutureResultPtr writeCompletePtr;
 		string data;
+		SharedSpanList spans;
+
+		RequestData();
+		RequestData(RequestData &&rd);
+		RequestData& operator=(RequestData &&rd);
+	};
+	//A call out of credit, packed when credit comes so the strings it defines 
+	//go in the order of the messages. Releases of the called object wait too
+	struct HeldCall
+	{
+		char type;
+		RequestID id;
+		MessagePriority priority;
+		ObjectID object;
+		string name;
+		Variant args;
+		FutureResultPtr written;
+
+		HeldCall();
+	};
+	struct FrameHeader
+	{
+		char type;
+		MessagePriority priority;
+		RequestID requestID;
+		ObjectID id;		//called object
+		string name;		//called method
+	};
+	//A message received in fragments. Once its header is in, the value is decoded
+	//as the fragments come and only the bytes the decoder has not taken are kept.
+	//Messages that need their bytes are put together whole
+	struct Assembly
+	{
+		enum Mode { HEADER, BUFFERED, STREAMED };
+
+		Mode mode;
+		std::size_t size;		//bytes received
+		string data;
+		FrameHeader header;
+		StreamDecoder decoder;
+
+		Assembly();
 	};
 	typedef std::map<RequestID, FutureResultPtr> FutureResultMap;
-	typedef std::queue<RequestData> MessageQueue;
+	//Connections answers of relayed calls go back to, they may close before
+	typedef std::map<RequestID, boost::weak_ptr<ClientBase> > RelayTargetMap;
+	typedef std::vector< boost::weak_ptr<ClientBase> > ClientList;
+	typedef std::deque<RequestData> MessageQueue;
+	typedef std::deque<HeldCall> HeldCallQueue;
 
 	ObjectsStorage &m_storage;	
-	bool m_async, m_requireProcessing, m_enableProcessing;
+	mutable Mutex m_mutex;
+	bool m_async, m_readPaused, m_arenaMode;
+	WireVersion m_wireVersion, m_maxWireVersion;
+	//Format of received frames. The peer answering the version call switches it
+	//on RT_WIRE_VERSION, calls sent before the answer came are in the old one
+	WireVersion m_recvWireVersion;
 	RequestID m_nextRequestID;
 	unsigned int m_maxMessageSize;	
-	string m_delayedData;
+	unsigned int m_spanThreshold;
+	unsigned int m_maxWriteBatchSize;
+	unsigned int m_fragmentSize, m_maxAssembledSize;
+	unsigned int m_streamFrameSize;
+	unsigned int m_maxCallsInFlight, m_callsInFlight;
+	//Flow control, see setReceiveWindow. Held credit is of calls in flight,
+	//ungranted of frames done with but not yet given back
+	unsigned int m_recvWindowBytes, m_recvWindowMessages;
+	__int64 m_sendCreditBytes, m_sendCreditMessages;
+	bool m_sendUnlimited, m_grantWindow;
+	unsigned int m_heldBytes, m_heldMessages;
+	unsigned int m_ungrantedBytes, m_ungrantedMessages;
+	//Size of the frame being processed, taken by the call it carries
+	unsigned int m_frameBytes;
+	FrameHeader m_frameHeader;
+	StreamDecoder m_frameDecoder;
+	Arena m_arena;
+	BufferPool m_bufferPool;
+	unsigned int m_processingDepth;
+	MemoryGovernor *m_governor;
+	//Moving average of the size of received frames, bytes of a streamed frame
+	std::size_t m_frameSizeAverage, m_streamMemory;
+	//v3 interning, one table per direction for the wire version of the session.
+	//v6 keeps one per class, messages of different classes are reordered
+	StringTable m_sendStrings[PRIORITY_CLASSES], m_recvStrings[PRIORITY_CLASSES];
 		
 	//sync mode
 	std::stack<RequestID> m_syncRequestStack;
 	//async mode
 	FutureResultMap m_callbacks;
+	RelayTargetMap m_relayTargets;
+	//Connections relaying calls of this one, they drop the answers when it closes
+	ClientList m_relayedTo;
 	MessageQueue m_messageQueue;
+	//Calls out of credit and the releases behind them, in the order sent
+	HeldCallQueue m_heldCalls;
+	//Messages at the front of the queue carried by the write in progress
+	std::size_t m_writingCount;
+	std::size_t m_writeCalls, m_messagesWritten;
+	WriteSegmentList m_writeSegments;
+	//Headers of the fragments in the write in progress
+	string m_fragmentHeaders;
+	//Messages received in fragments, one at a time per class
+	Assembly m_assembly[PRIORITY_CLASSES];
 
 	RequestID getNextRequestID();
+	StringTable* sendStrings(MessagePriority priority);
+	StringTable* recvStrings(MessagePriority priority);
+	//Class a message is sent in, PRIORITY_NORMAL before wire version 6
+	MessagePriority sendPriority(MessagePriority priority) const;
+	//Class of a received frame from the first byte of its body
+	MessagePriority framePriority(const char *data, std::size_t size) const;
 
 	Variant syncCall(ObjectID id, const string &name, const Variant &args, bool withResult = true);
 	Variant asyncCall(ObjectID id, const string &name, const Variant &args, bool withResult = true, 
-		float timeout = -1, FutureResultPtr &written = FutureResultPtr());
+		float timeout = -1, FutureResultPtr &written = FutureResultPtr(), 
+		MessagePriority priority = PRIORITY_NORMAL);
 	
-	Variant disableProcessing(RequestID requestID, const Variant &v);
-	Variant enableProcessing(const Variant &v);
-	Variant sendBuffer(char type, RequestID requestID, std::ostringstream &stream);
-	Variant sendReturnResponse(RequestID requestID, const Variant &result);
-	Variant sendCallRequest(char type, RequestID requestID, ObjectID id, 
-		const string &name, const Variant &args);
-
-	bool processInput(Variant &result, const string &data);
-	bool findAndStartCallback(const Variant &result, RequestID id);	
+	//Counts a call from the peer, false if reading waits for one to complete
+	bool beginCall();
+	Variant endCall(unsigned int credit, const Variant &v);
+	Variant returnCall(RequestID requestID, MessagePriority priority, unsigned int credit, const Variant &v);
+
+	//Credit is the size of a call's frame, 0 for frames sent without flow control
+	bool flowControl() const;
+	bool recvFlowControl() const;
+	void holdCredit(unsigned int bytes);
+	void returnCredit(unsigned int bytes);
+	bool grantDue() const;
+	void queueGrant();
+	bool hasCredit() const;
+	//Queues held calls while there is credit, the caller writes them. The calls 
+	//go to released, to be destroyed once the caller's lock is released
+	void releaseHeldCalls(HeldCallQueue &released);
+	//Takes the future of the call out, the caller completes it outside the lock
+	FutureResultPtr cancelCall(RequestID requestID);
+	static std::size_t messageSize(const RequestData &rd);
+	//Place for a message that goes ahead of those queued, behind the write in
+	//progress and messages of an older format the peer reads before it switches
+	MessageQueue::iterator frontPosition();
+	//Queues the message ahead of those of lower classes, objects are those it refers
+	//to and are taken by the queued message. A held message being released comes 
+	//with its write future and is written by the caller
+	Variant sendBuffer(char type, RequestID requestID, MessagePriority priority, OutputBuffer &out, 
+		ObjectIDList *objects = nullptr, const FutureResultPtr &written = FutureResultPtr());
+	Variant sendRelease(RequestID requestID, ObjectID id, const FutureResultPtr &written = FutureResultPtr());
+	void writeQueue();
+	//Bytes of the body in the next fragment of the message, 0 if it goes whole
+	std::size_t nextFragment(const RequestData &rd) const;
+	void appendFragment(const RequestData &rd, std::size_t size, WriteSegmentList &segments);
+	//Bytes of the message from offset on, all of them by default
+	static void appendSegments(const RequestData &rd, WriteSegmentList &segments, 
+		std::size_t offset = 0, std::size_t size = std::string::npos);
+	Variant sendReturnResponse(RequestID requestID, MessagePriority priority, const Variant &result);
+	Variant sendCallRequest(char type, RequestID requestID, MessagePriority priority, ObjectID id, 
+		const string &name, const Variant &args, const FutureResultPtr &written = FutureResultPtr());
+
+	Variant acceptWireVersion(const Variant &v);
+	bool answerWireVersion(RequestID requestID, InputBuffer &in);
+
+	bool processInput(Variant &result, const char *data, std::size_t size);
+	void readFrameHeader(InputBuffer &in, FrameHeader &header);
+	bool frameNeedsBytes(const FrameHeader &header) const;
+	//A streamed frame comes without in, its body already decoded into result
+	bool processFrame(const FrameHeader &header, Variant &result, InputBuffer *in);
+	void unpackVariant(InputBuffer &in, Variant &v);
+	bool findAndStartCallback(Variant &result, RequestID id);	
+	//Forgets calls relayed for origin and the closed connections
+	void dropRelays(const ClientBase *origin);
+	bool assembleFragment(const FrameHeader &header, InputBuffer &in);
+	//Reads the header of the message and starts decoding its value when it may be
+	void startAssembly(Assembly &assembly, MessagePriority priority, bool last);
+	void clearAssembly(Assembly &assembly);
 };
 
 
@@ -1,10 +1,17 @@
 ﻿#include "StdAfx.h"
 #include "variant.h"
 #include "logger.h"
+#include "arena.h"
 
 #include <boost/format.hpp>
 
-#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <unordered_map>
+#include <new>
+#include <istream>
+#include <ostream>
 
 namespace DualRPC
 {
@@ -26,113 +33,257 @@ const char* remote_error::what() const
 
 /////////////////////////////////////////////////////////////////
 
+static_assert(sizeof(Variant) <= 16, "Variant must stay within 16 bytes: keep payloads in the union");
+
 Variant::Variant() : 
-	m_type(VT_NULL) 
+	m_type(VT_NULL),
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0),
+	m_int(0)
 {
 }
 
 Variant::Variant(int i) : 
-	m_type(VT_INT), 
+	m_type(VT_INT),
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0),
 	m_int(i) 
 {
 }
 
 Variant::Variant(__int64 i) : 
-	m_type(VT_INT), 
+	m_type(VT_INT),
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0),
 	m_int(i) 
 {
 }
 
 Variant::Variant(double f) : 
 	m_type(VT_REAL),
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0),
 	m_real(f)
 {
 }
 
 Variant::Variant(const char *str) :
 	m_type(VT_STRING),
-	m_stringPtr(new string(str))
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0)
 {
+	setString(str, std::strlen(str));
 }
 
 Variant::Variant(const string &s) :
 	m_type(VT_STRING),
-	m_stringPtr(new string(s))
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0)
+{
+	setString(s.data(), s.size());
+}
+
+Variant::Variant(string &&s) :
+	m_type(VT_STRING),
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0)
 {
+	if(s.size() <= SHORT_STRING_SIZE)
+		setString(s.data(), s.size());
+	else
+		m_stringPtr = new Shared<string>(std::move(s));
 }
 
 Variant::Variant(const Array &a) : 
 	m_type(VT_ARRAY),
-	m_arrayPtr(new Array(a))
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0),
+	m_arrayPtr(new Shared<Array>(a))
+{
+}
+
+Variant::Variant(Array &&a) : 
+	m_type(VT_ARRAY),
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0),
+	m_arrayPtr(new Shared<Array>(std::move(a)))
 {
 }
 
 Variant::Variant(const Map &m) : 
 	m_type(VT_MAP),
-	m_mapPtr(new Map(m))
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0),
+	m_mapPtr(new Shared<Map>(m))
+{
+}
+
+Variant::Variant(Map &&m) : 
+	m_type(VT_MAP),
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0),
+	m_mapPtr(new Shared<Map>(std::move(m)))
+{
+}
+
+Variant::Variant(const IntArray &a) : 
+	m_type(VT_INT_ARRAY),
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0),
+	m_intArrayPtr(new Shared<IntArray>(a))
+{
+}
+
+Variant::Variant(IntArray &&a) : 
+	m_type(VT_INT_ARRAY),
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0),
+	m_intArrayPtr(new Shared<IntArray>(std::move(a)))
+{
+}
+
+Variant::Variant(const RealArray &a) : 
+	m_type(VT_REAL_ARRAY),
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0),
+	m_realArrayPtr(new Shared<RealArray>(a))
+{
+}
+
+Variant::Variant(RealArray &&a) : 
+	m_type(VT_REAL_ARRAY),
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0),
+	m_realArrayPtr(new Shared<RealArray>(std::move(a)))
 {
 }
 
 Variant::Variant(const std::exception &e) :
 	m_type(VT_EXCEPTION),
-	m_stringPtr(new string(e.what()))
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0)
 {
+	const char *what = e.what();
+	setString(what, std::strlen(what));
 }
 
 Variant::Variant(std::size_t len, const Variant &v) : 
-	m_type(VT_ARRAY)
+	m_type(VT_ARRAY),
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0)
 {
-	m_arrayPtr = new Array();
-	m_arrayPtr->resize(len);
+	m_arrayPtr = new Shared<Array>();
+	m_arrayPtr->value.resize(len);
 	if(len > 0)
-		(*m_arrayPtr)[0] = v;
+		m_arrayPtr->value[0] = v;
 }
 
 Variant::Variant(const string &name, const Variant &v) : 
-	m_type(VT_MAP)
+	m_type(VT_MAP),
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0)
+{
+	m_mapPtr = new Shared<Map>();
+	m_mapPtr->value.emplace(name, v);
+}
+
+Variant::Variant(const string &name, Variant &&v) : 
+	m_type(VT_MAP),
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0)
 {
-	m_mapPtr = new Map();
-	m_mapPtr->insert(Map::value_type(name, v));
+	m_mapPtr = new Shared<Map>();
+	m_mapPtr->value.emplace(name, std::move(v));
 }
 
 Variant::Variant(IObjectPtr obj) : 
 	m_type(VT_OBJECT),
-	m_objectPtr(obj)
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0),
+	m_objectPtr(new IObjectPtr(obj))
 {
 }
 
 
 Variant::Variant(ObjectID id, bool) : 
 	m_type(VT_OBJECTID),
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0),
 	m_id(id)
 {
 }
 
 Variant::Variant(FutureResultPtr future) : 
 	m_type(VT_FUTURE),
-	m_futurePtr(future)
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0),
+	m_futurePtr(new FutureResultPtr(future))
 {
 }
 
 Variant::Variant(std::istream &stream, int size) : 
 	m_type(VT_PACKED),
-	m_stringPtr(new string)
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0),
+	m_stringPtr(new Shared<string>())
+{
+	m_stringPtr->value.resize(size);
+	stream.read(&m_stringPtr->value[0], size);
+}
+
+Variant::Variant(InputBuffer &in, int size) : 
+	m_type(VT_PACKED),
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0),
+	m_stringPtr(new Shared<string>(in.readSpan(size), size))
 {
-	m_stringPtr->resize(size);
-	stream.read(&(*m_stringPtr)[0], size);
 }
 
 Variant::Variant(const Variant &v) : 
-	m_type(VT_NULL)
+	m_type(VT_NULL),
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0)
 {
 	clone(v);
 }
 
 Variant::Variant(Variant &&v) : 
 	m_type(VT_NULL),
+	m_flags(0),
+	m_shortLen(0),
+	m_size(0),
 	m_int(0)
 {
-	swap(v);
+	//Arena payloads die with the arena, so they are copied out instead
+	if(v.m_flags & VF_ARENA)
+		clone(v);
+	else
+		swap(v);
 }
 
 Variant::~Variant()
@@ -140,27 +291,268 @@ Variant::~Variant()
 	free();
 }
 
+Variant Variant::fromBytes(const string &data)
+{
+	Variant v;
+	v.m_type = VT_BYTES;
+	v.setString(data.data(), data.size());
+	return v;
+}
+
+Variant Variant::fromBytes(string &&data)
+{
+	Variant v(std::move(data));
+	v.m_type = VT_BYTES;
+	return v;
+}
+
+Variant Variant::fromPacked(string &&data)
+{
+	Variant v;
+	v.m_type = VT_PACKED;
+	v.m_stringPtr = new Shared<string>(std::move(data));
+	return v;
+}
+
 void Variant::free()
 {
 	switch(m_type)
 	{
 	case VT_STRING:
 	case VT_EXCEPTION:
-		delete m_stringPtr;
+	case VT_BYTES:
+		if(!(m_flags & (VF_INLINE | VF_ARENA)))
+			release(m_stringPtr);
 		break;
 
 	case VT_ARRAY:
-		delete m_arrayPtr;
+	case VT_MAP:
+		if(m_flags & VF_ARENA)
+		{
+			//Arena memory is released by Arena::reset, only run destructors
+			for(std::size_t i = 0, n = itemCount() * (m_type == VT_MAP ? 2 : 1); i < n; i++)
+				m_arenaItems[i].~Variant();
+		}
+		else if(m_type == VT_ARRAY)
+			release(m_arrayPtr);
+		else
+			release(m_mapPtr);
 		break;
 
-	case VT_MAP:
-		delete m_mapPtr;
+	case VT_OBJECT:
+		delete m_objectPtr;
+		break;
+
+	case VT_FUTURE:
+		delete m_futurePtr;
+		break;
+
+	case VT_PACKED:
+		release(m_stringPtr);
+		break;
+
+	case VT_INT_ARRAY:
+		if(!(m_flags & VF_ARENA))
+			release(m_intArrayPtr);
+		break;
+
+	case VT_REAL_ARRAY:
+		if(!(m_flags & VF_ARENA))
+			release(m_realArrayPtr);
 		break;
 	}
 	m_type = VT_NULL;
+	m_flags = 0;
+	m_shortLen = 0;
+	m_size = 0;
 	m_int = 0;
 }
 
+void Variant::setString(const char *str, std::size_t len)
+{
+	if(len <= SHORT_STRING_SIZE)
+	{
+		m_flags |= VF_INLINE;
+		m_shortLen = (unsigned char)len;
+		std::memcpy(m_shortStr, str, len);
+	}
+	else
+	{
+		m_flags &= ~VF_INLINE;
+		m_stringPtr = new Shared<string>(str, len);
+	}
+}
+
+void Variant::setArenaString(Arena &arena, const char *str, std::size_t len)
+{
+	if(len <= SHORT_STRING_SIZE)
+	{
+		setString(str, len);
+		return;
+	}
+	char *p = (char*)arena.allocate(len);
+	std::memcpy(p, str, len);
+	m_flags |= VF_ARENA;
+	m_size = (unsigned int)len;
+	m_arenaStr = p;
+}
+
+const char* Variant::stringData() const
+{
+	if(m_flags & VF_INLINE)
+		return m_shortStr;
+	if(m_flags & VF_ARENA)
+		return m_arenaStr;
+	return m_stringPtr->value.data();
+}
+
+std::size_t Variant::stringSize() const
+{
+	if(m_flags & VF_INLINE)
+		return m_shortLen;
+	if(m_flags & VF_ARENA)
+		return m_size;
+	return m_stringPtr->value.size();
+}
+
+const Variant& Variant::promote() const
+{
+	//References to strings, arrays and maps need real heap containers, 
+	//so inline and arena payloads are moved to the heap. Only mutable members
+	//change, so a const value is promoted too
+	Variant &self = const_cast<Variant&>(*this);
+	if(m_flags & VF_ARENA)
+	{
+		Variant v;
+		v.clone(*this);
+		self.free();
+		self.swap(v);
+	}
+	if(m_flags & VF_INLINE)
+	{
+		m_stringPtr = new Shared<string>(m_shortStr, m_shortLen);
+		m_flags &= ~VF_INLINE;
+		m_shortLen = 0;
+	}
+	return *this;
+}
+
+template<typename T> Variant::Shared<T>* Variant::share(Shared<T> *p)
+{
+	if(p->unshareable)
+		return new Shared<T>(p->value);
+	++p->refs;
+	return p;
+}
+
+template<typename T> void Variant::release(Shared<T> *p)
+{
+	//Null when decode threw before the payload was set
+	if(p && --p->refs == 0)
+		delete p;
+}
+
+template<typename T> void Variant::detach(Shared<T> *&p)
+{
+	if(p->refs > 1)
+	{
+		Shared<T> *copy = new Shared<T>(p->value);
+		release(p);
+		p = copy;
+	}
+}
+
+template<typename T> T& Variant::mutate(Shared<T> *&p)
+{
+	//The reference can outlive any later copy, so copies take their own payload
+	detach(p);
+	p->unshareable = true;
+	return p->value;
+}
+
+template<typename T> void Variant::packShared(OutputBuffer &out, Shared<T> *p, std::size_t size)
+{
+	//The span holds a reference, so a later change of the value copies it first
+	Shared<T> *s = share(p);
+	boost::shared_ptr<const void> holder(s, &release<T>);
+	out.writeSpan(size > 0 ? (const char*)&s->value[0] : nullptr, size, holder);
+}
+
+std::size_t Variant::itemCount() const
+{
+	if(m_flags & VF_ARENA)
+		return m_size;
+	return isArray() ? m_arrayPtr->value.size() : m_mapPtr->value.size();
+}
+
+const Variant& Variant::arrayItem(std::size_t pos) const
+{
+	return (m_flags & VF_ARENA) ? m_arenaItems[pos] : m_arrayPtr->value[pos];
+}
+
+const Variant* Variant::findItem(const string &name) const
+{
+	if(m_flags & VF_ARENA)
+	{
+		for(std::size_t i = 0; i < m_size; i++)
+		{
+			const Variant &key = m_arenaItems[2*i];
+			if(key.stringSize() == name.size() && 
+				std::memcmp(key.stringData(), name.data(), name.size()) == 0)
+				return &m_arenaItems[2*i + 1];
+		}
+		return nullptr;
+	}
+	Map::const_iterator it = m_mapPtr->value.find(name);
+	return (it == m_mapPtr->value.end()) ? nullptr : &it->second;
+}
+
+const Variant& Variant::firstItem() const
+{
+	if(isArray())
+		return arrayItem(0);
+	if(!(m_flags & VF_ARENA))
+		return m_mapPtr->value.begin()->second;
+
+	//Same item std::map would put first: the one with the smallest key
+	std::size_t first = 0;
+	for(std::size_t i = 1; i < m_size; i++)
+	{
+		const Variant &a = m_arenaItems[2*i], &b = m_arenaItems[2*first];
+		if(string(a.stringData(), a.stringSize()) < string(b.stringData(), b.stringSize()))
+			first = i;
+	}
+	return m_arenaItems[2*first + 1];
+}
+
+bool Variant::hasStringPayload() const
+{
+	return m_type == VT_STRING || m_type == VT_EXCEPTION || m_type == VT_BYTES;
+}
+
+std::size_t Variant::typedSize() const
+{
+	if(m_flags & VF_ARENA)
+		return m_size;
+	return isIntArray() ? m_intArrayPtr->value.size() : m_realArrayPtr->value.size();
+}
+
+const char* Variant::typedData() const
+{
+	if(m_flags & VF_ARENA)
+		return m_arenaStr;
+	if(isIntArray())
+		return m_intArrayPtr->value.empty() ? nullptr : (const char*)&m_intArrayPtr->value[0];
+	return m_realArrayPtr->value.empty() ? nullptr : (const char*)&m_realArrayPtr->value[0];
+}
+
+template<typename T> T Variant::typedItem(std::size_t pos) const
+{
+	T v;
+	std::memcpy(&v, typedData() + pos * sizeof(T), sizeof(T));
+	return v;
+}
+
 void Variant::clone(const Variant &v)
 {
 	//LOG_DEBUG_FMT(0, "Variant::clone %1%", v.repr());
@@ -178,22 +570,66 @@ void Variant::clone(const Variant &v)
 		break;
 	case VT_STRING:
 	case VT_EXCEPTION:
-		m_stringPtr = new string(*v.m_stringPtr);
+	case VT_BYTES:
+		if(v.m_flags & (VF_INLINE | VF_ARENA))
+			setString(v.stringData(), v.stringSize());
+		else
+			m_stringPtr = share(v.m_stringPtr);
 		break;
 	case VT_ARRAY:
-		m_arrayPtr = new Array(*v.m_arrayPtr);
+		if(v.m_flags & VF_ARENA)
+		{
+			m_arrayPtr = new Shared<Array>(v.m_arenaItems, v.m_arenaItems + v.m_size);
+		}
+		else
+			m_arrayPtr = share(v.m_arrayPtr);
 		break;
 	case VT_MAP:
-		m_mapPtr = new Map(*v.m_mapPtr);
+		if(v.m_flags & VF_ARENA)
+		{
+			m_mapPtr = new Shared<Map>();
+			m_mapPtr->value.reserve(v.m_size);
+			for(std::size_t i = 0; i < v.m_size; i++)
+			{
+				const Variant &key = v.m_arenaItems[2*i];
+				m_mapPtr->value.emplace(string(key.stringData(), key.stringSize()), 
+					v.m_arenaItems[2*i + 1]);
+			}
+		}
+		else
+			m_mapPtr = share(v.m_mapPtr);
 		break;
 	case VT_OBJECT:
-		m_objectPtr = v.m_objectPtr;
+		m_objectPtr = new IObjectPtr(*v.m_objectPtr);
 		break;
 	case VT_OBJECTID:
 		m_id = v.m_id;
 		break;
 	case VT_FUTURE:
-		m_futurePtr = v.m_futurePtr;
+		m_futurePtr = new FutureResultPtr(*v.m_futurePtr);
+		break;
+	case VT_PACKED:
+		m_stringPtr = share(v.m_stringPtr);
+		break;
+	case VT_INT_ARRAY:
+		if(v.m_flags & VF_ARENA)
+		{
+			m_intArrayPtr = new Shared<IntArray>(v.m_size);
+			if(v.m_size > 0)
+				std::memcpy(&m_intArrayPtr->value[0], v.m_arenaStr, v.m_size * sizeof(__int64));
+		}
+		else
+			m_intArrayPtr = share(v.m_intArrayPtr);
+		break;
+	case VT_REAL_ARRAY:
+		if(v.m_flags & VF_ARENA)
+		{
+			m_realArrayPtr = new Shared<RealArray>(v.m_size);
+			if(v.m_size > 0)
+				std::memcpy(&m_realArrayPtr->value[0], v.m_arenaStr, v.m_size * sizeof(double));
+		}
+		else
+			m_realArrayPtr = share(v.m_realArrayPtr);
 		break;
 	}
 }
@@ -202,16 +638,14 @@ void Variant::swap(Variant &v)
 {
 	//LOG_DEBUG_FMT(0, "Variant::swap %1% and %2%", repr() % v.repr());
 
-	Type t = m_type;
-	m_type = v.m_type;
-	v.m_type = t;
+	std::swap(m_type, v.m_type);
+	std::swap(m_flags, v.m_flags);
+	std::swap(m_shortLen, v.m_shortLen);
+	std::swap(m_size, v.m_size);
 
 	__int64 i = m_int;
 	m_int = v.m_int;
 	v.m_int = i;
-
-	m_objectPtr.swap(v.m_objectPtr);
-	m_futurePtr.swap(v.m_futurePtr);
 }
 
 Variant& Variant::add(const Variant &v)
@@ -219,11 +653,30 @@ Variant& Variant::add(const Variant &v)
 	if(isNull())
 	{
 		m_type = VT_ARRAY;
-		m_arrayPtr = new Array();
+		m_arrayPtr = new Shared<Array>();
+	}
+	if(isArray())
+	{
+		promote();
+		detach(m_arrayPtr);
+		m_arrayPtr->value.push_back(v);
+	}	
+	else throw std::runtime_error("Can not append item to non-array type");
+	return *this;
+}
+
+Variant& Variant::add(Variant &&v)
+{
+	if(isNull())
+	{
+		m_type = VT_ARRAY;
+		m_arrayPtr = new Shared<Array>();
 	}
 	if(isArray())
 	{
-		m_arrayPtr->push_back(v);
+		promote();
+		detach(m_arrayPtr);
+		m_arrayPtr->value.push_back(std::move(v));
 	}	
 	else throw std::runtime_error("Can not append item to non-array type");
 	return *this;
@@ -234,11 +687,30 @@ Variant& Variant::add(const string &name, const Variant &v)
 	if(isNull())
 	{
 		m_type = VT_MAP;
-		m_mapPtr = new Map();
+		m_mapPtr = new Shared<Map>();
+	}
+	if(isMap())
+	{
+		promote();
+		detach(m_mapPtr);
+		m_mapPtr->value.emplace(name, v);
+	}
+	else throw std::runtime_error("Can not insert pair to non-map type");
+	return *this;
+}
+
+Variant& Variant::add(const string &name, Variant &&v)
+{
+	if(isNull())
+	{
+		m_type = VT_MAP;
+		m_mapPtr = new Shared<Map>();
 	}
 	if(isMap())
 	{
-		m_mapPtr->insert(Map::value_type(name, v));
+		promote();
+		detach(m_mapPtr);
+		m_mapPtr->value.emplace(name, std::move(v));
 	}
 	else throw std::runtime_error("Can not insert pair to non-map type");
 	return *this;
@@ -247,7 +719,17 @@ Variant& Variant::add(const string &name, const Variant &v)
 Variant Variant::item(unsigned int pos) const
 {
 	if(isArray())
-		return m_arrayPtr->at(pos);
+	{
+		if(pos >= itemCount())
+			throw std::out_of_range("Array item index out of range");
+		return arrayItem(pos);
+	}
+	else if(isIntArray() || isRealArray())
+	{
+		if(pos >= typedSize())
+			throw std::out_of_range("Array item index out of range");
+		return isIntArray() ? Variant(typedItem<__int64>(pos)) : Variant(typedItem<double>(pos));
+	}
 	else
 		throw std::runtime_error("Can not return item from non-array type");
 }
@@ -256,16 +738,56 @@ Variant Variant::item(const string &name, const Variant &def) const
 {
 	if(isMap())
 	{
-		Map::iterator it = m_mapPtr->find(name);
-		return (it == m_mapPtr->end()) ? def : it->second;
+		const Variant *v = findItem(name);
+		return v ? *v : def;
 	}
 	else
 		throw std::runtime_error("Can not return item from non-map type");
 }
 
+const Variant& Variant::at(unsigned int pos) const
+{
+	if(!isArray())
+		throw std::runtime_error("Can not return item ref from non-array type");
+	if(pos >= itemCount())
+		throw std::out_of_range("Array item index out of range");
+	return arrayItem(pos);
+}
+
+const Variant& Variant::at(const string &name) const
+{
+	const Variant *v = find(name);
+	if(!v)
+		throw std::out_of_range((boost::format("Map has no item '%1%'") % name).str());
+	return *v;
+}
+
+const Variant* Variant::find(const string &name) const
+{
+	if(!isMap())
+		throw std::runtime_error("Can not return item ref from non-map type");
+	return findItem(name);
+}
+
 Variant& Variant::operator=(const Variant &v)
 {
-	clone(v);
+	if(this != &v)
+		clone(v);
+	return *this;
+}
+
+Variant& Variant::operator=(Variant &&v)
+{
+	if(this != &v)
+	{
+		if(v.m_flags & VF_ARENA)
+			clone(v);
+		else
+		{
+			free();
+			swap(v);
+		}
+	}
 	return *this;
 }
 
@@ -279,11 +801,9 @@ __int64 Variant::toInt(bool convert) const
 		if(isReal())
 			return __int64(m_real);
 		if(isString())
-			return std::stoi(*m_stringPtr);
-		if(isArray() && m_arrayPtr->size() > 0)
-			return (*m_arrayPtr)[0].toInt();
-		if(isMap() && m_mapPtr->size() > 0)
-			return m_mapPtr->begin()->second.toInt();
+			return std::stoi(string(stringData(), stringSize()));
+		if((isArray() || isMap()) && itemCount() > 0)
+			return firstItem().toInt();
 	}
 
 	throw std::runtime_error((boost::format("Error cast type '%1%' to 'int'") % typeName()).str());
@@ -299,11 +819,9 @@ double Variant::toReal(bool convert) const
 		if(isInt())
 			return double(m_int);
 		if(isString())
-			return std::stod(*m_stringPtr);
-		if(isArray() && m_arrayPtr->size() > 0)
-			return (*m_arrayPtr)[0].toReal();
-		if(isMap() && m_mapPtr->size() > 0)
-			return m_mapPtr->begin()->second.toReal();
+			return std::stod(string(stringData(), stringSize()));
+		if((isArray() || isMap()) && itemCount() > 0)
+			return firstItem().toReal();
 	}
 
 	throw std::runtime_error((boost::format("Error cast type '%1%' to 'real'") % typeName()).str());
@@ -315,7 +833,7 @@ string Variant::toString(bool convert) const
 		return string();
 
 	if(isString())
-		return *m_stringPtr;
+		return string(stringData(), stringSize());
 
 	if(convert)
 	{
@@ -323,12 +841,10 @@ string Variant::toString(bool convert) const
 			return std::to_string(m_int);
 		if(isReal())
 			return std::to_string((long double)m_real);
-		if(isException())
-			return *m_stringPtr;
-		if(isArray() && m_arrayPtr->size() > 0)
-			return (*m_arrayPtr)[0].toString();
-		if(isMap() && m_mapPtr->size() > 0)
-			return m_mapPtr->begin()->second.toString();
+		if(isException() || isBytes())
+			return string(stringData(), stringSize());
+		if((isArray() || isMap()) && itemCount() > 0)
+			return firstItem().toString();
 	}
 
 	throw std::runtime_error((boost::format("Error cast type '%1%' to 'string'") % typeName()).str());
@@ -337,7 +853,21 @@ string Variant::toString(bool convert) const
 Variant::Array Variant::toArray(bool convert) const
 {
 	if(isArray())
-		return *m_arrayPtr;
+	{
+		//Arena items are copied out, the value itself stays as it is
+		if(m_flags & VF_ARENA)
+			return Variant(*this).m_arrayPtr->value;
+		return m_arrayPtr->value;
+	}
+
+	if(isIntArray() || isRealArray())
+	{
+		Array a;
+		a.reserve(typedSize());
+		for(std::size_t i = 0; i < typedSize(); i++)
+			a.push_back(item((unsigned int)i));
+		return a;
+	}
 
 	if(convert)
 		return Array(1, *this);
@@ -348,7 +878,11 @@ Variant::Array Variant::toArray(bool convert) const
 Variant::Map Variant::toMap(bool convert) const
 {
 	if(isMap())
-		return *m_mapPtr;
+	{
+		if(m_flags & VF_ARENA)
+			return Variant(*this).m_mapPtr->value;
+		return m_mapPtr->value;
+	}
 
 	if(convert)
 	{
@@ -360,10 +894,62 @@ Variant::Map Variant::toMap(bool convert) const
 	throw std::runtime_error((boost::format("Error cast type '%1%' to 'map'") % typeName()).str());
 }
 
+Variant::IntArray Variant::toIntArray(bool convert) const
+{
+	if(isIntArray())
+	{
+		if(m_flags & VF_ARENA)
+			return Variant(*this).m_intArrayPtr->value;
+		return m_intArrayPtr->value;
+	}
+
+	if(convert && (isArray() || isRealArray()))
+	{
+		IntArray a;
+		std::size_t n = isArray() ? itemCount() : typedSize();
+		a.reserve(n);
+		for(std::size_t i = 0; i < n; i++)
+			a.push_back(isArray() ? arrayItem(i).toInt(true) : __int64(typedItem<double>(i)));
+		return a;
+	}
+
+	throw std::runtime_error((boost::format("Error cast type '%1%' to 'int array'") % typeName()).str());
+}
+
+Variant::RealArray Variant::toRealArray(bool convert) const
+{
+	if(isRealArray())
+	{
+		if(m_flags & VF_ARENA)
+			return Variant(*this).m_realArrayPtr->value;
+		return m_realArrayPtr->value;
+	}
+
+	if(convert && (isArray() || isIntArray()))
+	{
+		RealArray a;
+		std::size_t n = isArray() ? itemCount() : typedSize();
+		a.reserve(n);
+		for(std::size_t i = 0; i < n; i++)
+			a.push_back(isArray() ? arrayItem(i).toReal(true) : double(typedItem<__int64>(i)));
+		return a;
+	}
+
+	throw std::runtime_error((boost::format("Error cast type '%1%' to 'real array'") % typeName()).str());
+}
+
+string Variant::toBytes(bool convert) const
+{
+	if(isBytes() || (convert && isString()))
+		return string(stringData(), stringSize());
+
+	throw std::runtime_error((boost::format("Error cast type '%1%' to 'bytes'") % typeName()).str());
+}
+
 remote_error Variant::toException() const
 {
 	if(isException())
-		return remote_error(m_stringPtr->c_str());
+		return remote_error(string(stringData(), stringSize()));
 
 	throw std::runtime_error((boost::format("Error cast type '%1%' to 'exception'") % typeName()).str());
 }
@@ -371,7 +957,7 @@ remote_error Variant::toException() const
 IObjectPtr Variant::toObject() const
 {
 	if(isObject())
-		return m_objectPtr;
+		return *m_objectPtr;
 
 	throw std::runtime_error((boost::format("Error cast type '%1%' to 'object'") % typeName()).str());
 }
@@ -387,7 +973,7 @@ ObjectID Variant::toObjectID() const
 FutureResultPtr Variant::toFuture() const
 {
 	if(isFuture())
-		return m_futurePtr;
+		return *m_futurePtr;
 
 	throw std::runtime_error((boost::format("Error cast type '%1%' to 'future'") % typeName()).str());
 }
@@ -395,7 +981,10 @@ FutureResultPtr Variant::toFuture() const
 Variant::Array& Variant::getArray()
 {
 	if(isArray())
-		return *m_arrayPtr;
+	{
+		promote();
+		return mutate(m_arrayPtr);
+	}
 
 	throw std::runtime_error("Error accessing array ref in non-array type");
 }
@@ -403,7 +992,10 @@ Variant::Array& Variant::getArray()
 Variant::Map& Variant::getMap()
 {
 	if(isMap())
-		return *m_mapPtr;
+	{
+		promote();
+		return mutate(m_mapPtr);
+	}
 
 	throw std::runtime_error("Error accessing map ref in non-map type");
 }
@@ -411,43 +1003,142 @@ Variant::Map& Variant::getMap()
 string& Variant::getString()
 {
 	if(isString())
-		return *m_stringPtr;
+	{
+		promote();
+		return mutate(m_stringPtr);
+	}
 
 	throw std::runtime_error("Error accessing string ref in non-string type");
 }
 
-const Variant::Array& Variant::getArray() const
+string& Variant::getPacked()
 {
-	if(isArray())
-		return *m_arrayPtr;
+	if(isPacked())
+		return mutate(m_stringPtr);
 
-	throw std::runtime_error("Error accessing array ref in non-array type");
+	throw std::runtime_error("Error accessing packed ref in non-packed type");
 }
 
-const Variant::Map& Variant::getMap() const
+Variant::IntArray& Variant::getIntArray()
 {
-	if(isMap())
-		return *m_mapPtr;
+	if(isIntArray())
+	{
+		promote();
+		return mutate(m_intArrayPtr);
+	}
 
-	throw std::runtime_error("Error accessing map ref in non-map type");
+	throw std::runtime_error("Error accessing int array ref in non-int-array type");
 }
 
-const string& Variant::getString() const
+Variant::RealArray& Variant::getRealArray()
 {
-	if(isString())
-		return *m_stringPtr;
+	if(isRealArray())
+	{
+		promote();
+		return mutate(m_realArrayPtr);
+	}
 
-	throw std::runtime_error("Error accessing string ref in non-string type");
+	throw std::runtime_error("Error accessing real array ref in non-real-array type");
 }
 
-Variant::Type Variant::type() const
+string& Variant::getBytes()
 {
-	return m_type;
+	if(isBytes())
+	{
+		promote();
+		return mutate(m_stringPtr);
+	}
+
+	throw std::runtime_error("Error accessing bytes ref in non-bytes type");
 }
 
-const char* Variant::typeName() const
+const Variant::Array& Variant::getArray() const
 {
-	switch(m_type)
+	if(isArray())
+	{
+		promote();
+		return m_arrayPtr->value;
+	}
+
+	throw std::runtime_error("Error accessing array ref in non-array type");
+}
+
+const Variant::Map& Variant::getMap() const
+{
+	if(isMap())
+	{
+		promote();
+		return m_mapPtr->value;
+	}
+
+	throw std::runtime_error("Error accessing map ref in non-map type");
+}
+
+const string& Variant::getString() const
+{
+	if(isString())
+	{
+		promote();
+		return m_stringPtr->value;
+	}
+
+	throw std::runtime_error("Error accessing string ref in non-string type");
+}
+
+const string& Variant::getPacked() const
+{
+	if(isPacked())
+		return m_stringPtr->value;
+
+	throw std::runtime_error("Error accessing packed ref in non-packed type");
+}
+
+const Variant::IntArray& Variant::getIntArray() const
+{
+	if(isIntArray())
+	{
+		promote();
+		return m_intArrayPtr->value;
+	}
+
+	throw std::runtime_error("Error accessing int array ref in non-int-array type");
+}
+
+const Variant::RealArray& Variant::getRealArray() const
+{
+	if(isRealArray())
+	{
+		promote();
+		return m_realArrayPtr->value;
+	}
+
+	throw std::runtime_error("Error accessing real array ref in non-real-array type");
+}
+
+const string& Variant::getBytes() const
+{
+	if(isBytes())
+	{
+		promote();
+		return m_stringPtr->value;
+	}
+
+	throw std::runtime_error("Error accessing bytes ref in non-bytes type");
+}
+
+Variant::Type Variant::type() const
+{
+	return Type(m_type);
+}
+
+const char* Variant::typeName() const
+{
+	return typeName(Type(m_type));
+}
+
+const char* Variant::typeName(Type type)
+{
+	switch(type)
 	{
 	case VT_NULL: return "null";
 	case VT_INT: return "int";
@@ -458,6 +1149,12 @@ const char* Variant::typeName() const
 	case VT_EXCEPTION: return "exception";
 	case VT_OBJECT: return "object";
 	case VT_OBJECTID: return "id";
+	case VT_FUTURE: return "future";
+	case VT_PACKED: return "packed";
+	case VT_INT_ARRAY: return "int array";
+	case VT_REAL_ARRAY: return "real array";
+	case VT_BYTES: return "bytes";
+	case VT_COLUMNS: return "columns";
 	}
 	return "unknown";
 }
@@ -517,75 +1214,143 @@ bool Variant::isPacked() const
 	return m_type == VT_PACKED;
 }
 
-void packStr(std::ostream &stream, const string &s, int sizeLen)
+bool Variant::isIntArray() const
+{
+	return m_type == VT_INT_ARRAY;
+}
+
+bool Variant::isRealArray() const
+{
+	return m_type == VT_REAL_ARRAY;
+}
+
+bool Variant::isBytes() const
+{
+	return m_type == VT_BYTES;
+}
+
+void packStr(OutputBuffer &out, const string &s, int sizeLen)
 {
 	std::size_t len = s.size();
-	if(sizeLen == 1) len = len > 0xff ? 0xff : len;
-	else if(sizeLen == 2) len = len > 0xffff ? 0xffff : len;
-	else sizeLen = 4;
-	stream.write((const char*)&len, sizeLen);
-	stream.write(s.c_str(), len);
+	if(sizeLen != 1 && sizeLen != 2) sizeLen = 4;
+	if(out.version() == WIRE_V1)
+	{
+		if(sizeLen == 1) len = len > 0xff ? 0xff : len;
+		else if(sizeLen == 2) len = len > 0xffff ? 0xffff : len;
+	}
+	out.writeUInt(len, sizeLen);
+	out.write(s.data(), len);
+}
+
+void unpackStr(InputBuffer &in, string &s, int sizeLen)
+{
+	if(sizeLen != 1 && sizeLen != 2) sizeLen = 4;
+	std::size_t len = (std::size_t)in.readUInt(sizeLen);
+	s.assign(in.readSpan(len), len);
+}
+
+void packStr(std::ostream &stream, const string &s, int sizeLen)
+{
+	OutputBuffer out;
+	packStr(out, s, sizeLen);
+	stream.write(out.data(), out.size());
 }
 
 void unpackStr(std::istream &stream, string &s, int sizeLen) 
 {
 	std::size_t len = 0;
-	if(sizeLen == 1) len = len > 0xff ? 0xff : len;
-	else if(sizeLen == 2) len = len > 0xffff ? 0xffff : len;
-	else sizeLen = 4;
+	if(sizeLen != 1 && sizeLen != 2) sizeLen = 4;
 	stream.read((char*)&len, sizeLen);
+	s.resize(len);
 	if(len > 0)
-	{
-		s.resize(len);
 		stream.read(&s[0], len);
+}
+
+//Items of a typed array as an array of VT_INT or VT_REAL, data may be unaligned
+static void packPlainArray(OutputBuffer &out, bool ints, const char *data, std::size_t count)
+{
+	out.writeHeader(Variant::VT_ARRAY, count, sizeof(std::size_t));
+	for(std::size_t i = 0; i < count; i++, data += 8)
+	{
+		if(ints)
+		{
+			__int64 value;
+			std::memcpy(&value, data, sizeof(value));
+			out.writeIntHeader(Variant::VT_INT, value);
+		}
+		else
+		{
+			out.writeHeader(Variant::VT_REAL, 0, 0);
+			out.write(data, 8);
+		}
 	}
 }
 
-void Variant::pack(std::ostream &stream, const Callback &replacer) const
+void Variant::pack(OutputBuffer &out, const Callback &replacer) const
 {
 	char type = m_type;
+	if(type == VT_BYTES && out.plainTypes())
+		type = VT_STRING;
 
 	switch(m_type)
 	{
 	case VT_NULL:
-		stream.write(&type, sizeof(type));
+		out.writeHeader(type, 0, 0);
 		break;
 
 	case VT_INT:
-		stream.write(&type, sizeof(type));
-		stream.write((const char*)&m_int, sizeof(m_int));
+		out.writeIntHeader(type, m_int);
 		break;
 
 	case VT_REAL:
-		stream.write(&type, sizeof(type));
-		stream.write((const char*)&m_real, sizeof(m_real));
+		out.writeHeader(type, 0, 0);
+		out.writeValue(m_real);
 		break;
 
 	case VT_STRING:
 	case VT_EXCEPTION:
-		stream.write(&type, sizeof(type));
-		packStr(stream, *m_stringPtr, 4);
+	case VT_BYTES:
+		{
+			unsigned int len = (unsigned int)stringSize();
+			out.writeHeader(type, len, sizeof(len));
+			if(out.sharesSpan(len) && !(m_flags & (VF_INLINE | VF_ARENA)))
+				packShared(out, m_stringPtr, len);
+			else
+				out.write(stringData(), len);
+		}
 		break;
 
 	case VT_ARRAY:
 		{
-			stream.write(&type, sizeof(type));
-			std::size_t len = m_arrayPtr->size();
-			stream.write((const char*)&len, sizeof(len));
-			for(auto it = m_arrayPtr->cbegin(); it != m_arrayPtr->cend(); ++it)
-				it->pack(stream, replacer);
+			if(out.version() >= WIRE_V4 && packColumns(out, replacer))
+				break;
+			std::size_t len = itemCount();
+			out.writeHeader(type, len, sizeof(len));
+			for(std::size_t i = 0; i < len; i++)
+				arrayItem(i).pack(out, replacer);
 		}
 		break;
 
 	case VT_MAP:
 		{
-			stream.write(&type, sizeof(type));
-			std::size_t len = m_mapPtr->size();
-			stream.write((const char*)&len, sizeof(len));
-			for(auto it = m_mapPtr->cbegin(); it != m_mapPtr->cend(); ++it)
+			std::size_t len = itemCount();
+			out.writeHeader(type, len, sizeof(len));
+			if(m_flags & VF_ARENA)
 			{
-				packStr(stream, it->first, 1);
-				it->second.pack(stream, replacer);
+				for(std::size_t i = 0; i < len; i++)
+				{
+					const Variant &key = m_arenaItems[2*i];
+					out.writeKey(key.stringData(), key.stringSize());
+					m_arenaItems[2*i + 1].pack(out, replacer);
+				}
+			}
+			else
+			{
+				for(auto it = m_mapPtr->value.cbegin(); it != m_mapPtr->value.cend(); ++it)
+				{
+					out.writeKey(it->first.data(), it->first.size());
+					it->second.pack(out, replacer);
+				}
 			}
 		}
 		break;
@@ -593,38 +1358,87 @@ void Variant::pack(std::ostream &stream, const Callback &replacer) const
 	case VT_OBJECT:
 		if(replacer.empty())
 			throw std::runtime_error("Can not pack VT_OBJECT");
-		replacer(*this).pack(stream);
+		replacer(*this).pack(out);
 		break;
 
 	case VT_OBJECTID:
-		stream.write(&type, sizeof(type));
-		stream.write((const char*)&m_id, sizeof(m_id));
+		out.writeHeader(type, m_id, sizeof(m_id));
 		break;	
 
 	case VT_FUTURE:
 		throw std::runtime_error("Can not pack VT_FUTURE");
 
 	case VT_PACKED:
-		stream.write(m_stringPtr->c_str(), m_stringPtr->length());
+		if(out.sharesSpan(m_stringPtr->value.size()))
+			packShared(out, m_stringPtr, m_stringPtr->value.size());
+		else
+			out.write(m_stringPtr->value.data(), m_stringPtr->value.length());
+		break;
+
+	case VT_INT_ARRAY:
+	case VT_REAL_ARRAY:
+		{
+			//Items are 8 bytes in host order in all versions, one copy or a span
+			unsigned int len = (unsigned int)typedSize();
+			if(out.plainTypes())
+			{
+				packPlainArray(out, isIntArray(), typedData(), len);
+				break;
+			}
+			out.writeHeader(type, len, sizeof(len));
+			if(out.sharesSpan(len * 8) && !(m_flags & VF_ARENA))
+			{
+				if(isIntArray())
+					packShared(out, m_intArrayPtr, len * 8);
+				else
+					packShared(out, m_realArrayPtr, len * 8);
+			}
+			else
+				out.write(typedData(), len * 8);
+		}
 		break;
 	}
 }
 
+void Variant::pack(std::ostream &stream, const Callback &replacer) const
+{
+	OutputBuffer out;
+	pack(out, replacer);
+	stream.write(out.data(), out.size());
+}
+
 Variant& Variant::unpack(const Callback &replacer)
 {
 	if(m_type != VT_PACKED)
 		throw std::runtime_error("Can not unpack not VT_PACKED");
 
-	std::istringstream stream(*m_stringPtr);
-	return unpack(stream, replacer);
+	string data;
+	if(m_stringPtr->refs > 1)
+		data = m_stringPtr->value;
+	else
+		data.swap(m_stringPtr->value);
+	InputBuffer in(data);
+	return unpack(in, replacer);
 }
 
-Variant& Variant::unpack(std::istream &stream, const Callback &replacer)
+Variant& Variant::unpack(InputBuffer &in, const Callback &replacer)
 {
 	free();
+	decode(in, nullptr, replacer);
+	return *this;
+}
 
-	char type;
-	stream.read(&type, sizeof(type));
+Variant& Variant::unpack(InputBuffer &in, Arena &arena, const Callback &replacer)
+{
+	free();
+	decode(in, &arena, replacer);
+	return *this;
+}
+
+void Variant::decode(InputBuffer &in, Arena *arena, const Callback &replacer)
+{
+	unsigned char tag;
+	char type = in.readHeader(tag);
 	m_type = Type(type);
 
 	switch(m_type)
@@ -633,51 +1447,124 @@ Variant& Variant::unpack(std::istream &stream, const Callback &replacer)
 		break;
 
 	case VT_INT:
-		stream.read((char*)&m_int, sizeof(m_int));
+		m_int = in.readIntHeaderValue(tag);
 		break;
 
 	case VT_REAL:
-		stream.read((char*)&m_real, sizeof(m_real));
+		in.readValue(m_real);
 		break;
 
 	case VT_STRING:
 	case VT_EXCEPTION:
-		m_stringPtr = new string();
-		unpackStr(stream, *m_stringPtr, 4);
+	case VT_BYTES:
+		{
+			std::size_t len = (std::size_t)in.readHeaderValue(tag, sizeof(unsigned int));
+			if(arena)
+				setArenaString(*arena, in.readSpan(len), len);
+			else
+				setString(in.readSpan(len), len);
+		}
 		break;
 
 	case VT_ARRAY:
 		{
-			std::size_t len = 0;
-			m_arrayPtr = new Array();
-			stream.read((char*)&len, sizeof(len));
-			m_arrayPtr->resize(len);
-			for(auto it = m_arrayPtr->begin(); it != m_arrayPtr->end(); ++it)
-				it->unpack(stream, replacer);
+			std::size_t len = (std::size_t)in.readHeaderValue(tag, sizeof(std::size_t));
+			if(len > in.remaining())
+				throw std::runtime_error("Invalid array length");
+			if(arena)
+			{
+				m_arenaItems = (Variant*)arena->allocate(len * sizeof(Variant));
+				for(std::size_t i = 0; i < len; i++)
+					new(&m_arenaItems[i]) Variant();
+				m_flags |= VF_ARENA;
+				m_size = (unsigned int)len;
+				for(std::size_t i = 0; i < len; i++)
+					m_arenaItems[i].decode(in, arena, replacer);
+				break;
+			}
+			m_arrayPtr = new Shared<Array>();
+			m_arrayPtr->value.resize(len);
+			for(auto it = m_arrayPtr->value.begin(); it != m_arrayPtr->value.end(); ++it)
+				it->decode(in, nullptr, replacer);
 		}
 		break;
 
 	case VT_MAP:
 		{
-			std::size_t len = 0;
-			m_mapPtr = new Map();
-			stream.read((char*)&len, sizeof(len));
+			std::size_t len = (std::size_t)in.readHeaderValue(tag, sizeof(std::size_t));
+			if(len > in.remaining())
+				throw std::runtime_error("Invalid map length");
+			if(arena)
+			{
+				//Keys and values alternate, lookups are linear like the maps are small
+				m_arenaItems = (Variant*)arena->allocate(2 * len * sizeof(Variant));
+				for(std::size_t i = 0; i < 2 * len; i++)
+					new(&m_arenaItems[i]) Variant();
+				m_flags |= VF_ARENA;
+				m_size = (unsigned int)len;
+				for(std::size_t i = 0; i < len; i++)
+				{
+					std::size_t keyLen;
+					const char *keyData = in.readKey(keyLen);
+					Variant &key = m_arenaItems[2*i];
+					key.m_type = VT_STRING;
+					key.setArenaString(*arena, keyData, keyLen);
+					m_arenaItems[2*i + 1].decode(in, arena, replacer);
+				}
+				break;
+			}
+			m_mapPtr = new Shared<Map>();
+			m_mapPtr->value.reserve(len);
 			for(std::size_t i = 0; i < len; i++)
 			{
-				string s;
-				unpackStr(stream, s, 1);
-				m_mapPtr->insert(Map::value_type(s, Variant().unpack(stream, replacer)));
+				std::size_t keyLen;
+				const char *keyData = in.readKey(keyLen);
+				string s(keyData, keyLen);
+				Variant v;
+				v.decode(in, nullptr, replacer);
+				//keys arrive sorted from our peers, so the end hint is exact
+				m_mapPtr->value.emplace_hint(m_mapPtr->value.end(), std::move(s), std::move(v));
+			}
+		}
+		break;
+
+	case VT_INT_ARRAY:
+	case VT_REAL_ARRAY:
+		{
+			std::size_t len = (std::size_t)in.readHeaderValue(tag, sizeof(unsigned int));
+			if(len > in.remaining() / 8)
+				throw std::runtime_error("Invalid typed array length");
+			const char *data = in.readSpan(len * 8);
+			if(arena)
+			{
+				char *p = (char*)arena->allocate(len * 8);
+				std::memcpy(p, data, len * 8);
+				m_flags |= VF_ARENA;
+				m_size = (unsigned int)len;
+				m_arenaStr = p;
+			}
+			else if(m_type == VT_INT_ARRAY)
+			{
+				m_intArrayPtr = new Shared<IntArray>(len);
+				if(len > 0)
+					std::memcpy(&m_intArrayPtr->value[0], data, len * 8);
+			}
+			else
+			{
+				m_realArrayPtr = new Shared<RealArray>(len);
+				if(len > 0)
+					std::memcpy(&m_realArrayPtr->value[0], data, len * 8);
 			}
 		}
 		break;
 
 	case VT_OBJECTID:
-		stream.read((char*)&m_id, sizeof(m_id));
+		m_id = (ObjectID)in.readHeaderValue(tag, sizeof(m_id));
 		if(!replacer.empty())
 		{
 			Variant v = replacer(*this);
 			m_type = VT_OBJECT;
-			m_objectPtr = v.toObject();
+			m_objectPtr = new IObjectPtr(v.toObject());
 		}
 		break;
 
@@ -692,7 +1579,478 @@ Variant& Variant::unpack(std::istream &stream, const Callback &replacer)
 	case VT_PACKED:
 		throw std::runtime_error("Can not unpack VT_PACKED");
 		break;
+
+	case VT_COLUMNS:
+		decodeColumns(in, tag, arena, replacer);
+		break;
+
+	default:
+		m_type = VT_NULL;
+		throw std::runtime_error((boost::format("Can not unpack unknown type %1%") % int(type)).str());
 	}
+}
+
+void Variant::transcode(InputBuffer &in, OutputBuffer &out, const Callback &replacer)
+{
+	unsigned char tag;
+	char type = in.readHeader(tag);
+
+	switch(type)
+	{
+	case VT_NULL:
+		out.writeHeader(type, 0, 0);
+		break;
+
+	case VT_INT:
+		out.writeIntHeader(type, in.readIntHeaderValue(tag));
+		break;
+
+	case VT_REAL:
+		out.writeHeader(type, 0, 0);
+		out.write(in.readSpan(8), 8);
+		break;
+
+	case VT_STRING:
+	case VT_EXCEPTION:
+	case VT_BYTES:
+		{
+			std::size_t len = (std::size_t)in.readHeaderValue(tag, sizeof(unsigned int));
+			out.writeHeader((type == VT_BYTES && out.plainTypes()) ? char(VT_STRING) : type, 
+				len, sizeof(unsigned int));
+			out.write(in.readSpan(len), len);
+		}
+		break;
+
+	case VT_INT_ARRAY:
+	case VT_REAL_ARRAY:
+		{
+			std::size_t len = (std::size_t)in.readHeaderValue(tag, sizeof(unsigned int));
+			if(len > in.remaining() / 8)
+				throw std::runtime_error("Invalid typed array length");
+			if(out.plainTypes())
+			{
+				packPlainArray(out, type == VT_INT_ARRAY, in.readSpan(len * 8), len);
+				break;
+			}
+			out.writeHeader(type, len, sizeof(unsigned int));
+			out.write(in.readSpan(len * 8), len * 8);
+		}
+		break;
+
+	case VT_ARRAY:
+		{
+			std::size_t len = (std::size_t)in.readHeaderValue(tag, sizeof(std::size_t));
+			if(len > in.remaining())
+				throw std::runtime_error("Invalid array length");
+			out.writeHeader(type, len, sizeof(std::size_t));
+			for(std::size_t i = 0; i < len; i++)
+				transcode(in, out, replacer);
+		}
+		break;
+
+	case VT_MAP:
+		{
+			std::size_t len = (std::size_t)in.readHeaderValue(tag, sizeof(std::size_t));
+			if(len > in.remaining())
+				throw std::runtime_error("Invalid map length");
+			out.writeHeader(type, len, sizeof(std::size_t));
+			for(std::size_t i = 0; i < len; i++)
+			{
+				std::size_t keyLen;
+				const char *keyData = in.readKey(keyLen);
+				out.writeKey(keyData, keyLen);
+				transcode(in, out, replacer);
+			}
+		}
+		break;
+
+	case VT_COLUMNS:
+		transcodeColumns(in, tag, out, replacer);
+		break;
+
+	case VT_OBJECTID:
+		{
+			Variant id((ObjectID)in.readHeaderValue(tag, sizeof(ObjectID)), true);
+			if(replacer.empty())
+				id.pack(out);
+			else
+				replacer(id).pack(out);
+		}
+		break;
+
+	default:
+		throw std::runtime_error((boost::format("Can not transcode unknown type %1%") % int(type)).str());
+	}
+}
+
+bool Variant::packColumns(OutputBuffer &out, const Callback &replacer) const
+{
+	//Arrays of maps with the same keys: keys once, then the values of each key
+	std::size_t rows = itemCount();
+	if(rows < MIN_COLUMN_ROWS)
+		return false;
+	const Variant &first = arrayItem(0);
+	if(!first.isMap() || first.itemCount() == 0)
+		return false;
+
+	std::vector<string> keys;
+	if(first.m_flags & VF_ARENA)
+	{
+		for(std::size_t i = 0; i < first.m_size; i++)
+			keys.push_back(string(first.m_arenaItems[2*i].stringData(), first.m_arenaItems[2*i].stringSize()));
+	}
+	else
+	{
+		for(auto it = first.m_mapPtr->value.cbegin(); it != first.m_mapPtr->value.cend(); ++it)
+			keys.push_back(it->first);
+	}
+
+	//Column after column, rows with other keys keep the array in rows
+	std::vector<const Variant*> cells(rows * keys.size());
+	for(std::size_t r = 0; r < rows; r++)
+	{
+		const Variant &row = arrayItem(r);
+		if(!row.isMap() || row.itemCount() != keys.size())
+			return false;
+		if(!(row.m_flags & VF_ARENA))
+		{
+			//Sorted like the keys of the first row
+			std::size_t c = 0;
+			for(auto it = row.m_mapPtr->value.cbegin(); it != row.m_mapPtr->value.cend(); ++it, ++c)
+			{
+				if(it->first != keys[c])
+					return false;
+				cells[c * rows + r] = &it->second;
+			}
+			continue;
+		}
+		for(std::size_t c = 0; c < keys.size(); c++)
+		{
+			const Variant *cell = row.findItem(keys[c]);
+			if(!cell)
+				return false;
+			cells[c * rows + r] = cell;
+		}
+	}
+
+	out.writeHeader(VT_COLUMNS, rows, sizeof(rows));
+	out.writeVarint(keys.size());
+	for(std::size_t c = 0; c < keys.size(); c++)
+		out.writeKey(keys[c].data(), keys[c].size());
+
+	for(std::size_t c = 0; c < keys.size(); c++)
+	{
+		const Variant **column = &cells[c * rows];
+
+		bool ints = true, strings = true;
+		for(std::size_t r = 0; r < rows && (ints || strings); r++)
+		{
+			ints = ints && column[r]->m_type == VT_INT;
+			strings = strings && column[r]->m_type == VT_STRING;
+		}
+
+		if(ints)
+		{
+			out.writeValue(char(COL_INT_DELTA));
+			__int64 prev = 0;
+			for(std::size_t r = 0; r < rows; r++)
+			{
+				//Differences wrap around like the sums on decode
+				out.writeVarint(zigzagEncode(__int64((unsigned __int64)column[r]->m_int - (unsigned __int64)prev)));
+				prev = column[r]->m_int;
+			}
+			continue;
+		}
+
+		if(strings)
+		{
+			//Worth it when strings repeat at least twice on average, 
+			//columns of distinct names are given up after a few rows
+			std::unordered_map<string, unsigned int> index;
+			std::vector<unsigned int> ids(rows);
+			std::size_t r = 0;
+			for(; r < rows && index.size() * 2 <= rows && (r < 64 || index.size() * 2 <= r); r++)
+			{
+				auto it = index.emplace(string(column[r]->stringData(), column[r]->stringSize()), 
+					(unsigned int)index.size()).first;
+				ids[r] = it->second;
+			}
+			if(r == rows && index.size() * 2 <= rows)
+			{
+				std::vector<const string*> dictionary(index.size());
+				for(auto it = index.cbegin(); it != index.cend(); ++it)
+					dictionary[it->second] = &it->first;
+
+				out.writeValue(char(COL_DICTIONARY));
+				out.writeVarint(dictionary.size());
+				for(auto it = dictionary.cbegin(); it != dictionary.cend(); ++it)
+				{
+					out.writeVarint((*it)->size());
+					out.write((*it)->data(), (*it)->size());
+				}
+				for(r = 0; r < rows; r++)
+					out.writeVarint(ids[r]);
+				continue;
+			}
+		}
+
+		out.writeValue(char(COL_VALUES));
+		for(std::size_t r = 0; r < rows; r++)
+			column[r]->pack(out, replacer);
+	}
+	return true;
+}
+
+void Variant::shareString(const Variant &v)
+{
+	//Inline and arena strings own nothing, rows may share one payload
+	m_type = v.m_type;
+	m_flags = v.m_flags;
+	m_shortLen = v.m_shortLen;
+	m_size = v.m_size;
+	std::memcpy(m_shortStr, v.m_shortStr, SHORT_STRING_SIZE);
+}
+
+void Variant::decodeColumns(InputBuffer &in, unsigned char tag, Arena *arena, const Callback &replacer)
+{
+	std::size_t rows = (std::size_t)in.readHeaderValue(tag, sizeof(std::size_t));
+	std::size_t columns = (std::size_t)in.readVarint();
+	//Every cell takes a byte at least
+	if(columns == 0 || columns > in.remaining() || (rows != 0 && columns > in.remaining() / rows))
+		throw std::runtime_error("Invalid columns size");
+
+	std::vector<Variant> keys(columns);
+	for(auto it = keys.begin(); it != keys.end(); ++it)
+	{
+		std::size_t keyLen;
+		const char *keyData = in.readKey(keyLen);
+		it->m_type = VT_STRING;
+		if(arena)
+			it->setArenaString(*arena, keyData, keyLen);
+		else
+			it->setString(keyData, keyLen);
+	}
+
+	//Each column is decoded in one sequential pass into a scratch table,
+	//the cells are then moved into rows in row order
+	std::size_t cells = rows * columns;
+	Variant *table = arena ? (Variant*)arena->allocate(cells * sizeof(Variant)) :
+		(Variant*)::operator new(cells * sizeof(Variant));
+	for(std::size_t i = 0; i < cells; i++)
+		new(&table[i]) Variant();
+	auto freeTable = [&]()
+	{
+		for(std::size_t i = 0; i < cells; i++)
+			table[i].~Variant();
+		if(!arena)
+			::operator delete(table);
+	};
+
+	try
+	{
+		std::vector<Variant> dictionary;
+		for(std::size_t c = 0; c < columns; c++)
+		{
+			Variant *column = &table[c * rows];
+			char kind;
+			in.readValue(kind);
+
+			if(kind == COL_VALUES)
+			{
+				for(std::size_t r = 0; r < rows; r++)
+					column[r].decode(in, arena, replacer);
+			}
+			else if(kind == COL_INT_DELTA)
+			{
+				__int64 sum = 0;
+				for(std::size_t r = 0; r < rows; r++)
+				{
+					sum = __int64((unsigned __int64)sum + (unsigned __int64)zigzagDecode(in.readVarint()));
+					column[r].m_type = VT_INT;
+					column[r].m_int = sum;
+				}
+			}
+			else if(kind == COL_DICTIONARY)
+			{
+				std::size_t size = (std::size_t)in.readVarint();
+				if(size > in.remaining())
+					throw std::runtime_error("Invalid column dictionary size");
+				dictionary.clear();
+				dictionary.resize(size);
+				for(auto it = dictionary.begin(); it != dictionary.end(); ++it)
+				{
+					std::size_t len = (std::size_t)in.readVarint();
+					it->m_type = VT_STRING;
+					if(arena)
+						it->setArenaString(*arena, in.readSpan(len), len);
+					else
+						it->setString(in.readSpan(len), len);
+				}
+				for(std::size_t r = 0; r < rows; r++)
+				{
+					std::size_t id = (std::size_t)in.readVarint();
+					if(id >= size)
+						throw std::runtime_error("Invalid column dictionary index");
+					if(arena)
+						column[r].shareString(dictionary[id]);
+					else
+						column[r] = dictionary[id];
+				}
+			}
+			else
+				throw std::runtime_error((boost::format("Unknown column kind %1%") % int(kind)).str());
+		}
+	}
+	catch(...)
+	{
+		freeTable();
+		throw;
+	}
+
+	if(arena)
+	{
+		//Variants hold no pointers to themselves, moving the bytes moves ownership.
+		//The value becomes the array once nothing is left to fail
+		Variant *items, *arrayItems;
+		try
+		{
+			items = (Variant*)arena->allocate(cells * 2 * sizeof(Variant));
+			arrayItems = (Variant*)arena->allocate(rows * sizeof(Variant));
+		}
+		catch(...)
+		{
+			freeTable();
+			throw;
+		}
+		m_type = VT_ARRAY;
+		m_arenaItems = arrayItems;
+		for(std::size_t r = 0; r < rows; r++)
+		{
+			Variant *rowItems = &items[r * 2 * columns];
+			for(std::size_t c = 0; c < columns; c++)
+			{
+				new(&rowItems[2*c]) Variant();
+				rowItems[2*c].shareString(keys[c]);
+				std::memcpy((void*)&rowItems[2*c + 1], &table[c * rows + r], sizeof(Variant));
+			}
+			Variant *row = new(&m_arenaItems[r]) Variant();
+			row->m_type = VT_MAP;
+			row->m_flags = VF_ARENA;
+			row->m_size = (unsigned int)columns;
+			row->m_arenaItems = rowItems;
+		}
+		m_flags |= VF_ARENA;
+		m_size = (unsigned int)rows;
+	}
+	else
+	{
+		Shared<Array> *array;
+		try
+		{
+			array = new Shared<Array>(rows);
+		}
+		catch(...)
+		{
+			freeTable();
+			throw;
+		}
+		m_type = VT_ARRAY;
+		m_arrayPtr = array;
+		for(std::size_t r = 0; r < rows; r++)
+		{
+			Variant &row = m_arrayPtr->value[r];
+			row.m_mapPtr = new Shared<Map>();
+			row.m_type = VT_MAP;
+			row.m_mapPtr->value.reserve(columns);
+			for(std::size_t c = 0; c < columns; c++)
+				row.m_mapPtr->value.emplace_hint(row.m_mapPtr->value.end(), 
+					string(keys[c].stringData(), keys[c].stringSize()), std::move(table[c * rows + r]));
+		}
+		freeTable();
+	}
+}
+
+static void replaceObjectIDs(Variant &v, const Callback &replacer)
+{
+	if(v.isObjectID())
+		v = replacer(v);
+	else if(v.isArray())
+	{
+		for(auto it = v.getArray().begin(); it != v.getArray().end(); ++it)
+			replaceObjectIDs(*it, replacer);
+	}
+	else if(v.isMap())
+	{
+		for(auto it = v.getMap().begin(); it != v.getMap().end(); ++it)
+			replaceObjectIDs(it->second, replacer);
+	}
+}
+
+void Variant::transcodeColumns(InputBuffer &in, unsigned char tag, OutputBuffer &out, const Callback &replacer)
+{
+	if(out.version() < WIRE_V4)
+	{
+		//Peers before v4 get rows, the columns are decoded for that
+		Variant rows;
+		rows.decodeColumns(in, tag, nullptr, Callback());
+		if(!replacer.empty())
+			replaceObjectIDs(rows, replacer);
+		rows.pack(out);
+		return;
+	}
+
+	std::size_t rows = (std::size_t)in.readHeaderValue(tag, sizeof(std::size_t));
+	std::size_t columns = (std::size_t)in.readVarint();
+	if(columns == 0 || columns > in.remaining() || (rows != 0 && columns > in.remaining() / rows))
+		throw std::runtime_error("Invalid columns size");
+	out.writeHeader(VT_COLUMNS, rows, sizeof(rows));
+	out.writeVarint(columns);
+	for(std::size_t c = 0; c < columns; c++)
+	{
+		std::size_t keyLen;
+		const char *keyData = in.readKey(keyLen);
+		out.writeKey(keyData, keyLen);
+	}
+
+	for(std::size_t c = 0; c < columns; c++)
+	{
+		char kind;
+		in.readValue(kind);
+		out.writeValue(kind);
+		if(kind == COL_VALUES)
+		{
+			for(std::size_t r = 0; r < rows; r++)
+				transcode(in, out, replacer);
+			continue;
+		}
+		if(kind == COL_DICTIONARY)
+		{
+			std::size_t size = (std::size_t)in.readVarint();
+			if(size > in.remaining())
+				throw std::runtime_error("Invalid column dictionary size");
+			out.writeVarint(size);
+			for(std::size_t i = 0; i < size; i++)
+			{
+				std::size_t len = (std::size_t)in.readVarint();
+				out.writeVarint(len);
+				out.write(in.readSpan(len), len);
+			}
+		}
+		else if(kind != COL_INT_DELTA)
+			throw std::runtime_error((boost::format("Unknown column kind %1%") % int(kind)).str());
+		for(std::size_t r = 0; r < rows; r++)
+			out.writeVarint(in.readVarint());
+	}
+}
+
+Variant& Variant::unpack(std::istream &stream, const Callback &replacer)
+{
+	std::istream::pos_type start = stream.tellg();
+	string data((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+	InputBuffer in(data);
+	unpack(in, replacer);
+	stream.clear();
+	stream.seekg(start + std::streamoff(in.pos()));
 	return *this;
 }
 
@@ -711,17 +2069,17 @@ string Variant::repr(unsigned int maxlen) const
 
 	case VT_STRING:
 		return (boost::format("string[%1%]=\"%2%\"%3%)") % 
-			m_stringPtr->length() % m_stringPtr->substr(0, maxlen) % 
-			(m_stringPtr->length() > maxlen ? "..." : "")).str();
+			stringSize() % string(stringData(), std::min<std::size_t>(stringSize(), maxlen)) % 
+			(stringSize() > maxlen ? "..." : "")).str();
 
 	case VT_ARRAY:
 		{
 			string s("[");
-			for(Array::const_iterator it = m_arrayPtr->cbegin(); it != m_arrayPtr->cend(); ++it)
+			for(std::size_t i = 0; i < itemCount(); i++)
 			{
-				if(it != m_arrayPtr->cbegin())
+				if(i > 0)
 					s += ", ";
-				s += it->repr();
+				s += arrayItem(i).repr();
 			}
 			return s + "]";
 		}
@@ -729,9 +2087,19 @@ string Variant::repr(unsigned int maxlen) const
 	case VT_MAP:
 		{
 			string s("{");
-			for(Map::const_iterator it = m_mapPtr->cbegin(); it != m_mapPtr->cend(); ++it)
+			if(m_flags & VF_ARENA)
 			{
-				if(it != m_mapPtr->cbegin())
+				for(std::size_t i = 0; i < m_size; i++)
+				{
+					if(i > 0)
+						s += ", ";
+					s += string("\"") + m_arenaItems[2*i].toString() + "\" : " + m_arenaItems[2*i + 1].repr();
+				}
+				return s + "}";
+			}
+			for(Map::const_iterator it = m_mapPtr->value.cbegin(); it != m_mapPtr->value.cend(); ++it)
+			{
+				if(it != m_mapPtr->value.cbegin())
 					s += ", ";
 				s += string("\"") + it->first + "\" : " + it->second.repr();
 			}
@@ -739,21 +2107,40 @@ string Variant::repr(unsigned int maxlen) const
 		}
 
 	case VT_OBJECT:
-		return (boost::format("object(addr=0x%X)") % int(m_objectPtr.get())).str();
+		return (boost::format("object(addr=0x%X)") % int(m_objectPtr->get())).str();
 
 	case VT_OBJECTID:
 		return (boost::format("object(id=%1%)") % m_id).str();
 
 	case VT_EXCEPTION:
-		return (boost::format("exception(\"%1%\"") % *m_stringPtr).str();
+		return (boost::format("exception(\"%1%\"") % string(stringData(), stringSize())).str();
 
 	case VT_FUTURE:
-		return (boost::format("future(addr=0x%X)") % int(m_futurePtr.get())).str();
+		return (boost::format("future(addr=0x%X)") % int(m_futurePtr->get())).str();
+
+	case VT_BYTES:
+		return (boost::format("bytes[%1%]") % stringSize()).str();
+
+	case VT_INT_ARRAY:
+	case VT_REAL_ARRAY:
+		{
+			string s = (boost::format("%1%[%2%]=[") % typeName() % typedSize()).str();
+			for(std::size_t i = 0; i < typedSize(); i++)
+			{
+				if(s.size() > maxlen)
+					return s + "...]";
+				if(i > 0)
+					s += ", ";
+				s += isIntArray() ? std::to_string(typedItem<__int64>(i)) : 
+					std::to_string((long double)typedItem<double>(i));
+			}
+			return s + "]";
+		}
 
 	case VT_PACKED:
 		return (boost::format("packed[%1%]=\"%2%\"%3%)") % 
-			m_stringPtr->length() % m_stringPtr->substr(0, maxlen) % 
-			(m_stringPtr->length() > maxlen ? "..." : "")).str();
+			m_stringPtr->value.length() % m_stringPtr->value.substr(0, maxlen) % 
+			(m_stringPtr->value.length() > maxlen ? "..." : "")).str();
 	}
 	return string();
 }
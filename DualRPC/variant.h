@@ -3,8 +3,13 @@
 #include <exception>
 #include <vector>
 #include <map>
+#include <iosfwd>
+
+#include <boost/smart_ptr/detail/atomic_count.hpp>
 
 #include "defs.h"
+#include "buffer.h"
+#include "flat_map.h"
 
 namespace DualRPC
 {
@@ -29,17 +34,30 @@ class Variant
 		VT_NULL = 0,		//no value
 		VT_INT = 1,			//m_int
 		VT_REAL = 2,		//m_float
-		VT_STRING = 3,		//m_string
-		VT_ARRAY = 4,		//m_arrayPtr (delete on destroy)
-		VT_MAP = 5,			//m_mapPtr (delete on destroy)
-		VT_EXCEPTION = 6,	//m_stringPtr (exception text)
-		VT_OBJECT = 7,		//m_objectPtr
+		VT_STRING = 3,		//m_shortStr, m_arenaStr or m_stringPtr (VF_INLINE/VF_ARENA decide)
+		VT_ARRAY = 4,		//m_arrayPtr (shared) or m_arenaItems
+		VT_MAP = 5,			//m_mapPtr (shared) or m_arenaItems (key, value, ...)
+		VT_EXCEPTION = 6,	//same as VT_STRING (exception text)
+		VT_OBJECT = 7,		//m_objectPtr (delete on destroy)
 		VT_OBJECTID = 8,	//m_id
-		VT_FUTURE = 9,		//m_futurePtr
-		VT_PACKED = 10
+		VT_FUTURE = 9,		//m_futurePtr (delete on destroy)
+		VT_PACKED = 10,		//m_stringPtr (packed bytes)
+		VT_INT_ARRAY = 11,	//m_intArrayPtr (shared) or m_arenaStr
+		VT_REAL_ARRAY = 12,	//m_realArrayPtr (shared) or m_arenaStr
+		VT_BYTES = 13,		//same as VT_STRING (binary data)
+		VT_COLUMNS = 14		//wire only: array of maps with the same keys, decoded as VT_ARRAY
+	};
+	//How a VT_COLUMNS column stores its values
+	enum ColumnKind
+	{
+		COL_VALUES = 0,		//packed values
+		COL_INT_DELTA = 1,	//zigzag varint of the first int, then of the differences
+		COL_DICTIONARY = 2	//distinct strings once, then an index per row
 	};
 	typedef std::vector<Variant> Array;
-	typedef std::map<string, Variant> Map;
+	typedef FlatMap<string, Variant> Map;
+	typedef std::vector<__int64> IntArray;
+	typedef std::vector<double> RealArray;
 
 	Variant();
 	Variant(int i);
@@ -47,32 +65,57 @@ class Variant
 	Variant(double f);
 	Variant(const char *str);
 	Variant(const string &s);
+	Variant(string &&s);
 	Variant(const Array &a);
+	Variant(Array &&a);
 	Variant(const Map &m);
+	Variant(Map &&m);
+	Variant(const IntArray &a);
+	Variant(IntArray &&a);
+	Variant(const RealArray &a);
+	Variant(RealArray &&a);
 	Variant(const std::exception &e);
 	Variant(std::size_t len, const Variant &v);
 	Variant(const string &name, const Variant &v);
+	Variant(const string &name, Variant &&v);
 	Variant(IObjectPtr obj);
 	Variant(ObjectID id, bool);
 	Variant(FutureResultPtr future);
 	Variant(std::istream &stream, int size);
+	Variant(InputBuffer &in, int size);
 	Variant(const Variant &v);
 	Variant(Variant &&v);
 	~Variant();
 
+	//Binary data, a constructor would clash with Variant(name, value)
+	static Variant fromBytes(const string &data);
+	static Variant fromBytes(string &&data);
+	//Already packed value, sent as it is
+	static Variant fromPacked(string &&data);
+
 	Variant& add(const Variant &v);
+	Variant& add(Variant &&v);
 	Variant& add(const string &name, const Variant &v);
+	Variant& add(const string &name, Variant &&v);
 
 	Variant item(unsigned int pos) const;
 	Variant item(const string &name, const Variant &def = Variant()) const;
+	//Items without a copy, valid until the array or map is changed
+	const Variant& at(unsigned int pos) const;
+	const Variant& at(const string &name) const;
+	const Variant* find(const string &name) const;
 
 	Variant& operator=(const Variant &v);
+	Variant& operator=(Variant &&v);
 
 	__int64 toInt(bool convert = false) const;
 	double toReal(bool convert = false) const;
 	string toString(bool convert = false) const;
 	Array toArray(bool convert = false) const;
 	Map toMap(bool convert = false) const;
+	IntArray toIntArray(bool convert = false) const;
+	RealArray toRealArray(bool convert = false) const;
+	string toBytes(bool convert = false) const;
 	remote_error toException() const;
 	IObjectPtr toObject() const;
 	ObjectID toObjectID() const;
@@ -81,13 +124,26 @@ class Variant
 	Array& getArray();
 	Map& getMap();
 	string& getString();
+	string& getPacked();
+	IntArray& getIntArray();
+	RealArray& getRealArray();
+	string& getBytes();
 
 	const Array& getArray() const;
 	const Map& getMap() const;
 	const string& getString() const;
+	const string& getPacked() const;
+	const IntArray& getIntArray() const;
+	const RealArray& getRealArray() const;
+	const string& getBytes() const;
+	//Short strings are kept inline and decoded values may live in an arena, the
+	//references above move them to the heap on first use. A value read by several
+	//threads at once is promoted before it is shared
+	const Variant& promote() const;
 
 	Type type() const;
 	const char* typeName() const;
+	static const char* typeName(Type type);
 
 	bool isNull() const;
 	bool isInt() const;
@@ -100,32 +156,103 @@ class Variant
 	bool isObjectID() const;
 	bool isFuture() const;
 	bool isPacked() const;
+	bool isIntArray() const;
+	bool isRealArray() const;
+	bool isBytes() const;
 
+	void pack(OutputBuffer &out, const Callback &replacer = Callback()) const;
 	void pack(std::ostream &stream, const Callback &replacer = Callback()) const;
 	Variant& unpack(const Callback &replacer = Callback());
+	Variant& unpack(InputBuffer &in, const Callback &replacer = Callback());
+	Variant& unpack(InputBuffer &in, Arena &arena, const Callback &replacer = Callback());
 	Variant& unpack(std::istream &stream, const Callback &replacer = Callback());
+	//Copies one packed value between wire formats without decoding it,
+	//replacer gets and returns object ids
+	static void transcode(InputBuffer &in, OutputBuffer &out, const Callback &replacer = Callback());
 	string repr(unsigned int maxlen = 100) const;
 
 private:
-	Type m_type;
+	enum Flags
+	{
+		VF_INLINE = 1,		//string payload stored in m_shortStr
+		VF_ARENA = 2		//payload owned by an Arena, copied to the heap when it escapes
+	};
+	static const std::size_t SHORT_STRING_SIZE = sizeof(__int64);
+
+	//Heap payloads are shared by copies and copied before the first change.
+	//A payload handed out by a non-const reference is not shared any more
+	template<typename T> struct Shared
+	{
+		T value;
+		boost::detail::atomic_count refs;
+		bool unshareable;
+
+		Shared() : refs(1), unshareable(false) {}
+		template<typename A> explicit Shared(A &&a) : 
+			value(std::forward<A>(a)), refs(1), unshareable(false) {}
+		template<typename A, typename B> Shared(A &&a, B &&b) : 
+			value(std::forward<A>(a), std::forward<B>(b)), refs(1), unshareable(false) {}
+	};
+
+	//The payload of a const value moves to the heap by promote(), the value
+	//stays the same
+	mutable unsigned char m_type;
+	mutable unsigned char m_flags;
+	mutable unsigned char m_shortLen;
+	mutable unsigned int m_size;		//item or byte count of arena payloads
 
 	union {
-		__int64 m_int;
-		double m_real;
-		ObjectID m_id;
-		string *m_stringPtr;
-		Array *m_arrayPtr;
-		Map *m_mapPtr;	
+		mutable __int64 m_int;
+		mutable double m_real;
+		mutable ObjectID m_id;
+		mutable Shared<string> *m_stringPtr;
+		mutable Shared<Array> *m_arrayPtr;
+		mutable Shared<Map> *m_mapPtr;
+		mutable IObjectPtr *m_objectPtr;
+		mutable FutureResultPtr *m_futurePtr;
+		mutable Shared<IntArray> *m_intArrayPtr;
+		mutable Shared<RealArray> *m_realArrayPtr;
+		mutable char m_shortStr[SHORT_STRING_SIZE];
+		mutable const char *m_arenaStr;
+		mutable Variant *m_arenaItems;
 	};
-	
-	IObjectPtr m_objectPtr;	
-	FutureResultPtr m_futurePtr;
 
 	void clone(const Variant &v);	
 	void swap(Variant &v);
 	void free();
+
+	void setString(const char *str, std::size_t len);
+	const char* stringData() const;
+	std::size_t stringSize() const;
+	void setArenaString(Arena &arena, const char *str, std::size_t len);
+	template<typename T> static Shared<T>* share(Shared<T> *p);
+	template<typename T> static void release(Shared<T> *p);
+	template<typename T> static void detach(Shared<T> *&p);
+	template<typename T> static T& mutate(Shared<T> *&p);
+	template<typename T> static void packShared(OutputBuffer &out, Shared<T> *p, std::size_t size);
+
+	std::size_t itemCount() const;
+	const Variant& arrayItem(std::size_t pos) const;
+	const Variant* findItem(const string &name) const;
+	const Variant& firstItem() const;
+
+	bool hasStringPayload() const;
+	std::size_t typedSize() const;
+	const char* typedData() const;
+	template<typename T> T typedItem(std::size_t pos) const;
+
+	void decode(InputBuffer &in, Arena *arena, const Callback &replacer);
+
+	static const std::size_t MIN_COLUMN_ROWS = 4;
+	bool packColumns(OutputBuffer &out, const Callback &replacer) const;
+	void decodeColumns(InputBuffer &in, unsigned char tag, Arena *arena, const Callback &replacer);
+	void shareString(const Variant &v);
+	static void transcodeColumns(InputBuffer &in, unsigned char tag, OutputBuffer &out, const Callback &replacer);
 };
 
+void packStr(OutputBuffer &out, const string &s, int sizeLen = 4);
+void unpackStr(InputBuffer &in, string &s, int sizeLen = 4);
+
 void packStr(std::ostream &stream, const string &s, int sizeLen = 4);
 void unpackStr(std::istream &stream, string &s, int sizeLen = 4);
 
@@ -0,0 +1,466 @@
+﻿#include "stdafx.h"
+#include "variant_view.h"
+
+#include <boost/format.hpp>
+#include <boost/bind.hpp>
+
+#include <cstring>
+#include <stdexcept>
+
+namespace DualRPC
+{
+
+VariantView::VariantView() :
+	m_data(nullptr),
+	m_size(0),
+	m_objects(nullptr),
+	m_version(WIRE_V1),
+	m_strings(nullptr)
+{
+}
+
+VariantView::VariantView(const char *data, std::size_t size, const ObjectList *objects, 
+	WireVersion version) :
+	m_data(data),
+	m_size(size),
+	m_objects(objects),
+	m_version(version),
+	m_strings(nullptr)
+{
+	if(m_size == 0)
+		m_data = nullptr;
+}
+
+VariantView::VariantView(const InputBuffer &in, const ObjectList *objects) :
+	m_data(in.current()),
+	m_size(in.remaining()),
+	m_objects(objects),
+	m_version(in.version()),
+	m_strings(in.strings())
+{
+	if(m_size == 0)
+		m_data = nullptr;
+}
+
+Variant::Type VariantView::type() const
+{
+	Variant::Type type = wireType();
+	return type == Variant::VT_COLUMNS ? Variant::VT_ARRAY : type;
+}
+
+Variant::Type VariantView::wireType() const
+{
+	if(!m_data)
+		return Variant::VT_NULL;
+	return Variant::Type(m_version == WIRE_V1 ? *m_data : *m_data & 0x0f);
+}
+
+const char* VariantView::typeName() const
+{
+	return Variant::typeName(type());
+}
+
+bool VariantView::isNull() const
+{
+	return type() == Variant::VT_NULL;
+}
+
+bool VariantView::isInt() const
+{
+	return type() == Variant::VT_INT;
+}
+
+bool VariantView::isReal() const
+{
+	return type() == Variant::VT_REAL;
+}
+
+bool VariantView::isString() const
+{
+	return type() == Variant::VT_STRING;
+}
+
+bool VariantView::isArray() const
+{
+	return type() == Variant::VT_ARRAY;
+}
+
+bool VariantView::isMap() const
+{
+	return type() == Variant::VT_MAP;
+}
+
+bool VariantView::isException() const
+{
+	return type() == Variant::VT_EXCEPTION;
+}
+
+bool VariantView::isObjectID() const
+{
+	return type() == Variant::VT_OBJECTID;
+}
+
+bool VariantView::isIntArray() const
+{
+	return type() == Variant::VT_INT_ARRAY;
+}
+
+bool VariantView::isRealArray() const
+{
+	return type() == Variant::VT_REAL_ARRAY;
+}
+
+bool VariantView::isBytes() const
+{
+	return type() == Variant::VT_BYTES;
+}
+
+InputBuffer VariantView::body(Variant::Type expected, const char *to, unsigned char &tag) const
+{
+	if(type() != expected)
+		throw std::runtime_error((boost::format("Error cast type '%1%' to '%2%'") % typeName() % to).str());
+
+	InputBuffer in(m_data, m_size, m_version, m_strings);
+	in.readHeader(tag);
+	return in;
+}
+
+VariantView VariantView::at(const InputBuffer &in) const
+{
+	return VariantView(in, m_objects);
+}
+
+std::size_t VariantView::size() const
+{
+	switch(type())
+	{
+	case Variant::VT_STRING:
+	case Variant::VT_EXCEPTION:
+	case Variant::VT_BYTES:
+	case Variant::VT_INT_ARRAY:
+	case Variant::VT_REAL_ARRAY:
+		{
+			unsigned char tag;
+			InputBuffer in(m_data, m_size, m_version, m_strings);
+			in.readHeader(tag);
+			return (std::size_t)in.readHeaderValue(tag, sizeof(unsigned int));
+		}
+
+	case Variant::VT_ARRAY:
+	case Variant::VT_MAP:
+		{
+			//Rows of columns too
+			unsigned char tag;
+			InputBuffer in(m_data, m_size, m_version, m_strings);
+			in.readHeader(tag);
+			return (std::size_t)in.readHeaderValue(tag, sizeof(std::size_t));
+		}
+
+	default:
+		//Scalars, objects and futures have no items
+		return 0;
+	}
+}
+
+__int64 VariantView::toInt() const
+{
+	unsigned char tag;
+	InputBuffer in = body(Variant::VT_INT, "int", tag);
+	return in.readIntHeaderValue(tag);
+}
+
+double VariantView::toReal() const
+{
+	unsigned char tag;
+	InputBuffer in = body(Variant::VT_REAL, "real", tag);
+	double f;
+	in.readValue(f);
+	return f;
+}
+
+string VariantView::toString() const
+{
+	if(isNull())
+		return string();
+	return string(stringData(), size());
+}
+
+const char* VariantView::stringData() const
+{
+	unsigned char tag;
+	InputBuffer in = body(isException() || isBytes() ? type() : Variant::VT_STRING, "string", tag);
+	std::size_t len = (std::size_t)in.readHeaderValue(tag, sizeof(unsigned int));
+	return in.readSpan(len);
+}
+
+remote_error VariantView::toException() const
+{
+	unsigned char tag;
+	InputBuffer in = body(Variant::VT_EXCEPTION, "exception", tag);
+	std::size_t len = (std::size_t)in.readHeaderValue(tag, sizeof(unsigned int));
+	return remote_error(string(in.readSpan(len), len));
+}
+
+ObjectID VariantView::toObjectID() const
+{
+	unsigned char tag;
+	InputBuffer in = body(Variant::VT_OBJECTID, "id", tag);
+	return (ObjectID)in.readHeaderValue(tag, sizeof(ObjectID));
+}
+
+IObjectPtr VariantView::toObject() const
+{
+	return findObject(toObjectID());
+}
+
+IObjectPtr VariantView::findObject(ObjectID id) const
+{
+	if(m_objects)
+	{
+		for(ObjectList::const_iterator it = m_objects->cbegin(); it != m_objects->cend(); ++it)
+			if(it->first == id)
+				return it->second;
+	}
+	throw std::runtime_error((boost::format("Object #%1% is not resolved in view") % id).str());
+}
+
+Variant VariantView::objectReplacer(const Variant &v) const
+{
+	return findObject(v.toObjectID());
+}
+
+const char* VariantView::typedItem(Variant::Type expected, const char *to, unsigned int pos) const
+{
+	unsigned char tag;
+	InputBuffer in = body(expected, to, tag);
+	std::size_t len = (std::size_t)in.readHeaderValue(tag, sizeof(unsigned int));
+	if(pos >= len)
+		throw std::out_of_range("Array item index out of range");
+	in.skip(pos * 8);
+	return in.readSpan(8);
+}
+
+__int64 VariantView::intItem(unsigned int pos) const
+{
+	__int64 i;
+	std::memcpy(&i, typedItem(Variant::VT_INT_ARRAY, "int array", pos), sizeof(i));
+	return i;
+}
+
+double VariantView::realItem(unsigned int pos) const
+{
+	double f;
+	std::memcpy(&f, typedItem(Variant::VT_REAL_ARRAY, "real array", pos), sizeof(f));
+	return f;
+}
+
+VariantView VariantView::item(unsigned int pos) const
+{
+	//Rows of columns do not exist as bytes, they are built by toVariant()
+	if(wireType() == Variant::VT_COLUMNS)
+		throw std::runtime_error("Items of columns can not be viewed, use toVariant()");
+
+	unsigned char tag;
+	InputBuffer in = body(Variant::VT_ARRAY, "array", tag);
+	std::size_t len = (std::size_t)in.readHeaderValue(tag, sizeof(std::size_t));
+	if(pos >= len)
+		throw std::out_of_range("Array item index out of range");
+	for(unsigned int i = 0; i < pos; i++)
+		skip(in);
+	return at(in);
+}
+
+VariantView VariantView::item(const string &name) const
+{
+	unsigned char tag;
+	InputBuffer in = body(Variant::VT_MAP, "map", tag);
+	std::size_t len = (std::size_t)in.readHeaderValue(tag, sizeof(std::size_t));
+	for(std::size_t i = 0; i < len; i++)
+	{
+		std::size_t keyLen;
+		const char *key = in.readKey(keyLen);
+		if(keyLen == name.size() && std::memcmp(key, name.data(), keyLen) == 0)
+			return at(in);
+		skip(in);
+	}
+	return VariantView();
+}
+
+string VariantView::key(unsigned int pos) const
+{
+	unsigned char tag;
+	InputBuffer in = body(Variant::VT_MAP, "map", tag);
+	std::size_t len = (std::size_t)in.readHeaderValue(tag, sizeof(std::size_t));
+	if(pos >= len)
+		throw std::out_of_range("Map item index out of range");
+	for(unsigned int i = 0; ; i++)
+	{
+		std::size_t keyLen;
+		const char *key = in.readKey(keyLen);
+		if(i == pos)
+			return string(key, keyLen);
+		skip(in);
+	}
+}
+
+bool VariantView::contains(const string &name) const
+{
+	return item(name).m_data != nullptr;
+}
+
+Variant VariantView::toVariant() const
+{
+	Variant v;
+	if(m_data)
+	{
+		InputBuffer in(m_data, m_size, m_version, m_strings);
+		if(m_objects && !m_objects->empty())
+			v.unpack(in, boost::bind(&VariantView::objectReplacer, this, _1));
+		else
+			v.unpack(in);
+	}
+	return v;
+}
+
+std::size_t VariantView::packedSize() const
+{
+	if(!m_data)
+		return 0;
+	InputBuffer in(m_data, m_size, m_version, m_strings);
+	skip(in);
+	return in.pos();
+}
+
+string VariantView::repr() const
+{
+	return (boost::format("view(%1%, %2% bytes)") % typeName() % packedSize()).str();
+}
+
+void VariantView::resolveObjects(ObjectList &objects, const Callback &replacer) const
+{
+	ObjectIDOffsetList ids;
+	findObjectIDs(ids);
+	for(ObjectIDOffsetList::const_iterator it = ids.cbegin(); it != ids.cend(); ++it)
+		objects.push_back(ObjectPair(it->second, replacer(Variant(it->second, true)).toObject()));
+}
+
+std::size_t VariantView::findObjectIDs(ObjectIDOffsetList &ids) const
+{
+	if(!m_data)
+		return 0;
+	InputBuffer in(m_data, m_size, m_version, m_strings);
+	skip(in, &ids);
+	return in.pos();
+}
+
+void VariantView::skip(InputBuffer &in, ObjectIDOffsetList *ids)
+{
+	std::size_t start = in.pos();
+	unsigned char tag;
+	char type = in.readHeader(tag);
+
+	switch(type)
+	{
+	case Variant::VT_NULL:
+		break;
+
+	case Variant::VT_INT:
+		in.readHeaderValue(tag, sizeof(__int64));
+		break;
+
+	case Variant::VT_REAL:
+		in.skip(8);
+		break;
+
+	case Variant::VT_STRING:
+	case Variant::VT_EXCEPTION:
+	case Variant::VT_BYTES:
+		in.skip((std::size_t)in.readHeaderValue(tag, sizeof(unsigned int)));
+		break;
+
+	case Variant::VT_INT_ARRAY:
+	case Variant::VT_REAL_ARRAY:
+		{
+			std::size_t len = (std::size_t)in.readHeaderValue(tag, sizeof(unsigned int));
+			if(len > in.remaining() / 8)
+				throw std::runtime_error("Invalid typed array length");
+			in.skip(len * 8);
+		}
+		break;
+
+	case Variant::VT_ARRAY:
+		{
+			std::size_t len = (std::size_t)in.readHeaderValue(tag, sizeof(std::size_t));
+			if(len > in.remaining())
+				throw std::runtime_error("Invalid array length");
+			for(std::size_t i = 0; i < len; i++)
+				skip(in, ids);
+		}
+		break;
+
+	case Variant::VT_MAP:
+		{
+			std::size_t len = (std::size_t)in.readHeaderValue(tag, sizeof(std::size_t));
+			if(len > in.remaining())
+				throw std::runtime_error("Invalid map length");
+			for(std::size_t i = 0; i < len; i++)
+			{
+				std::size_t keyLen;
+				in.readKey(keyLen);
+				skip(in, ids);
+			}
+		}
+		break;
+
+	case Variant::VT_OBJECTID:
+		{
+			ObjectID id = (ObjectID)in.readHeaderValue(tag, sizeof(ObjectID));
+			if(ids)
+				ids->push_back(std::make_pair(start, id));
+		}
+		break;
+
+	case Variant::VT_COLUMNS:
+		skipColumns(in, tag, ids);
+		break;
+
+	default:
+		throw std::runtime_error((boost::format("Can not view unknown type %1%") % int(type)).str());
+	}
+}
+
+void VariantView::skipColumns(InputBuffer &in, unsigned char tag, ObjectIDOffsetList *ids)
+{
+	std::size_t rows = (std::size_t)in.readHeaderValue(tag, sizeof(std::size_t));
+	std::size_t columns = (std::size_t)in.readVarint();
+	if(rows > in.remaining() || columns > in.remaining())
+		throw std::runtime_error("Invalid columns size");
+	for(std::size_t c = 0; c < columns; c++)
+	{
+		std::size_t keyLen;
+		in.readKey(keyLen);
+	}
+	for(std::size_t c = 0; c < columns; c++)
+	{
+		char kind;
+		in.readValue(kind);
+		if(kind == Variant::COL_VALUES)
+		{
+			for(std::size_t r = 0; r < rows; r++)
+				skip(in, ids);
+			continue;
+		}
+		if(kind == Variant::COL_DICTIONARY)
+		{
+			std::size_t size = (std::size_t)in.readVarint();
+			for(std::size_t i = 0; i < size; i++)
+				in.skip((std::size_t)in.readVarint());
+		}
+		else if(kind != Variant::COL_INT_DELTA)
+			throw std::runtime_error((boost::format("Unknown column kind %1%") % int(kind)).str());
+		for(std::size_t r = 0; r < rows; r++)
+			in.readVarint();
+	}
+}
+
+}
@@ -0,0 +1,90 @@
+﻿#pragma once
+
+#include <vector>
+
+#include "defs.h"
+#include "variant.h"
+#include "buffer.h"
+
+namespace DualRPC
+{
+
+//Non-owning read-only access to a packed Variant, nothing is decoded
+//until it is asked for. The viewed bytes must outlive the view.
+class VariantView
+{
+public:
+	typedef std::pair<ObjectID, IObjectPtr> ObjectPair;
+	typedef std::vector<ObjectPair> ObjectList;
+	typedef std::vector<std::pair<std::size_t, ObjectID> > ObjectIDOffsetList;
+
+	VariantView();
+	VariantView(const char *data, std::size_t size, const ObjectList *objects = nullptr, 
+		WireVersion version = WIRE_V1);
+	//Remaining bytes of the buffer in its wire format
+	explicit VariantView(const InputBuffer &in, const ObjectList *objects = nullptr);
+
+	Variant::Type type() const;
+	const char* typeName() const;
+
+	bool isNull() const;
+	bool isInt() const;
+	bool isReal() const;
+	bool isString() const;
+	bool isArray() const;
+	bool isMap() const;
+	bool isException() const;
+	bool isObjectID() const;
+	bool isIntArray() const;
+	bool isRealArray() const;
+	bool isBytes() const;
+
+	//Items of an array or map, bytes of a string
+	std::size_t size() const;
+
+	__int64 toInt() const;
+	double toReal() const;
+	string toString() const;
+	const char* stringData() const;
+	remote_error toException() const;
+	ObjectID toObjectID() const;
+	IObjectPtr toObject() const;
+
+	__int64 intItem(unsigned int pos) const;
+	double realItem(unsigned int pos) const;
+
+	VariantView item(unsigned int pos) const;
+	VariantView item(const string &name) const;
+	string key(unsigned int pos) const;
+	bool contains(const string &name) const;
+
+	Variant toVariant() const;
+	std::size_t packedSize() const;
+	string repr() const;
+
+	//Replaces every object id of the value with an object, the list must
+	//stay alive while views from this one are used
+	void resolveObjects(ObjectList &objects, const Callback &replacer) const;
+
+	//Collects byte offsets of all object id values, returns packedSize()
+	std::size_t findObjectIDs(ObjectIDOffsetList &ids) const;
+
+private:
+	const char *m_data;
+	std::size_t m_size;
+	const ObjectList *m_objects;
+	WireVersion m_version;
+	StringTable *m_strings;
+
+	Variant::Type wireType() const;
+	InputBuffer body(Variant::Type expected, const char *to, unsigned char &tag) const;
+	const char* typedItem(Variant::Type expected, const char *to, unsigned int pos) const;
+	VariantView at(const InputBuffer &in) const;
+	IObjectPtr findObject(ObjectID id) const;
+	Variant objectReplacer(const Variant &v) const;
+
+	static void skip(InputBuffer &in, ObjectIDOffsetList *ids = nullptr);
+	static void skipColumns(InputBuffer &in, unsigned char tag, ObjectIDOffsetList *ids);
+};
+
+}
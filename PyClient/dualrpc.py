@@ -3,6 +3,7 @@
 import socket
 import struct
 import exceptions
+import array
 
 VT_NULL = 0
 VT_INT = 1
@@ -14,6 +15,10 @@
 VT_OBJECT = 7
 VT_OBJECTID = 8
 VT_FUTURE = 9
+VT_PACKED = 10
+VT_INT_ARRAY = 11
+VT_REAL_ARRAY = 12
+VT_BYTES = 13
 
 RT_PING = 0
 RT_PONG = 1
@@ -22,6 +27,17 @@
 RT_RETURN = 20
 RT_DELOBJ = 30
 
+def int64Array(items=()):
+    """array of 8-byte ints where the platform has one, plain list otherwise"""
+    for code in ('l', 'q'):
+        try:
+            if array.array(code).itemsize == 8:
+                return array.array(code, items)
+        except ValueError:
+            pass
+    return list(items)
+
+
 class RemoteFunc:
     def __init__(self, client, id, name):
         self._client = client
@@ -162,6 +178,21 @@ def packArg(self, arg):
         elif isinstance(arg, str):
             result = struct.pack('=bI', VT_STRING, len(arg))
             result += arg
+        elif isinstance(arg, bytearray):
+            result = struct.pack('=bI', VT_BYTES, len(arg))
+            result += str(arg)
+        elif isinstance(arg, array.array):
+            # typed arrays go as one block of 8-byte items in host order
+            if arg.typecode in ('f', 'd'):
+                a = arg if arg.typecode == 'd' else array.array('d', arg)
+                result = struct.pack('=bI', VT_REAL_ARRAY, len(a))
+            else:
+                a = arg if arg.itemsize == 8 else int64Array(arg)
+                result = struct.pack('=bI', VT_INT_ARRAY, len(a))
+            if isinstance(a, array.array):
+                result += a.tostring()
+            else:
+                result += struct.pack('=%dq' % len(a), *a)
         elif isinstance(arg, (tuple, list)):
             result = struct.pack('=bI', VT_ARRAY, len(arg))
             for i in arg:
@@ -223,6 +254,21 @@ def unpack(pos):
             elif typ == VT_OBJECTID:
                 (id,) = struct.unpack('=I', data[pos+1:pos+5])
                 return (RemoteObject(self, id), pos+5)
+            elif typ == VT_BYTES:
+                (n,) = struct.unpack('=I', data[pos+1:pos+5])
+                return (bytearray(data[pos+5:pos+5+n]), pos+5+n)
+            elif typ in (VT_INT_ARRAY, VT_REAL_ARRAY):
+                (n,) = struct.unpack('=I', data[pos+1:pos+5])
+                block = data[pos+5:pos+5+n*8]
+                if typ == VT_REAL_ARRAY:
+                    res = array.array('d')
+                else:
+                    res = int64Array()
+                if isinstance(res, array.array):
+                    res.fromstring(block)
+                else:
+                    res.extend(struct.unpack('=%dq' % n, block))
+                return (res, pos+5+n*8)
             else:
                 print "Unsupported unpack type", typ
         
@@ -1,11 +1,11 @@
 ﻿#pragma once
 
-#include "transport.h"
+#include "asio_transport.h"
 
-class ActorClient : public DualRPC::Client
+class ActorClient : public DualRPC::AsioClient
 {
 public:
 	ActorClient(boost::asio::io_service &iosvc, DualRPC::ObjectsStorage &storage)  : 
-		DualRPC::Client(iosvc, storage) {
+		DualRPC::AsioClient(iosvc, storage) {
 	}
 };
\ No newline at end of file
@@ -0,0 +1,129 @@
+﻿#include "stdafx.h"
+#include "Benchmarks.h"
+
+#include "variant.h"
+#include "arena.h"
+
+#include <iostream>
+#include <map>
+#include <boost/chrono.hpp>
+#include <boost/format.hpp>
+
+using namespace DualRPC;
+using namespace std;
+
+namespace
+{
+
+typedef boost::chrono::steady_clock Clock;
+
+//Best of five runs, microseconds per repetition
+template<typename F> double measure(int reps, F f)
+{
+	double best = 0;
+	for(int run = 0; run < 5; run++)
+	{
+		Clock::time_point start = Clock::now();
+		for(int i = 0; i < reps; i++)
+			f();
+		double us = boost::chrono::duration<double, boost::micro>(Clock::now() - start).count() / reps;
+		if(run == 0 || us < best)
+			best = us;
+	}
+	return best;
+}
+
+//Arguments of GlobalServerObject::login
+Variant loginPayload()
+{
+	return Variant("login", 0).add("type", 1).add("name", "Actor").add("domain", "HOME")
+		.add("object", Variant(ObjectID(105), true));
+}
+
+//Answer of enumClients
+Variant clientsPayload(int count)
+{
+	Variant clients;
+	for(int i = 0; i < count; i++)
+	{
+		clients.add(Variant("id", 1000 + i).add("name", (i % 3) ? "ACTOR-PC" : "WORKSTATION-0042")
+			.add("type", 1).add("domain", "HOME").add("group", 0));
+	}
+	return clients;
+}
+
+void benchArena(const char *name, const Variant &payload, int reps)
+{
+	OutputBuffer out;
+	payload.pack(out);
+	const string &data = out.str();
+
+	double heap = measure(reps, [&]() {
+		InputBuffer in(data);
+		Variant v;
+		v.unpack(in);
+	});
+	Arena arena;
+	double arenaTime = measure(reps, [&]() {
+		{
+			InputBuffer in(data);
+			Variant v;
+			v.unpack(in, arena);
+		}
+		arena.reset();
+	});
+	cout << name << ": " << data.size() << " bytes, decode " << heap << " us, into arena " << 
+		arenaTime << " us" << endl;
+}
+
+//Building a map key by key in the order given, then looking every key up
+template<typename M> void benchMapType(const vector<string> &keys, int reps, double &build, double &find)
+{
+	build = measure(reps, [&]() {
+		M m;
+		for(std::size_t i = 0; i < keys.size(); i++)
+			m[keys[i]] = Variant(__int64(i));
+	});
+	M m;
+	for(std::size_t i = 0; i < keys.size(); i++)
+		m[keys[i]] = Variant(__int64(i));
+	__int64 sum = 0;
+	find = measure(reps, [&]() {
+		for(std::size_t i = 0; i < keys.size(); i++)
+			sum += m.find(keys[i])->second.toInt();
+	});
+	//Keeps the lookups from being optimized out
+	if(sum == 0)
+		cout << "";
+}
+
+void benchMap(const char *name, const vector<string> &keys, int reps)
+{
+	double flatBuild, flatFind, treeBuild, treeFind;
+	benchMapType<Variant::Map>(keys, reps, flatBuild, flatFind);
+	benchMapType< std::map<string, Variant> >(keys, reps, treeBuild, treeFind);
+	cout << name << ": build " << flatBuild << " us, find all " << flatFind << " us; std::map " <<
+		treeBuild << " us, " << treeFind << " us" << endl;
+}
+
+}
+
+void runBenchmarks()
+{
+	cout << "Arena decoding" << endl;
+	benchArena("login", loginPayload(), 200000);
+	benchArena("enumClients[1000]", clientsPayload(1000), 500);
+
+	cout << "Variant::Map" << endl;
+	const char *loginKeys[] = { "login", "type", "name", "domain", "object" };
+	benchMap("login keys", vector<string>(loginKeys, loginKeys + 5), 200000);
+	//Decoded maps arrive with sorted keys, built ones in any order
+	vector<string> sortedKeys, mixedKeys;
+	for(int i = 0; i < 64; i++)
+	{
+		sortedKeys.push_back((boost::format("field%|02|") % i).str());
+		mixedKeys.push_back((boost::format("field%|02|") % ((i * 37) % 64)).str());
+	}
+	benchMap("64 sorted keys", sortedKeys, 20000);
+	benchMap("64 mixed keys", mixedKeys, 20000);
+}
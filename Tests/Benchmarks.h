@@ -0,0 +1,4 @@
+﻿#pragma once
+
+//Codec timings on the payloads of the login and enumClients calls, run by "Tests bench"
+void runBenchmarks();
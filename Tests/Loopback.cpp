@@ -0,0 +1,395 @@
+﻿#include "stdafx.h"
+#include "Loopback.h"
+
+#include "variant.h"
+#include "objects.h"
+#include "asio_transport.h"
+#include "future_result.h"
+
+#include <iostream>
+#include <boost/format.hpp>
+#include <boost/detail/atomic_count.hpp>
+
+using namespace DualRPC;
+using namespace std;
+
+namespace
+{
+
+int failures = 0;
+
+void check(bool ok, const string &what)
+{
+	cout << (ok ? "  ok: " : "  FAILED: ") << what << endl;
+	if(!ok)
+		++failures;
+}
+
+//Global object of the server
+class EchoObject : public LocalObject
+{
+public:
+	int pending, maxPending, echoed;
+
+	explicit EchoObject(aio::io_service &iosvc) :
+		pending(0), maxPending(0), echoed(0), m_iosvc(iosvc)
+	{
+		registerMethod("echo", boost::bind(&EchoObject::echo, this, _1));
+		registerMethod("size", boost::bind(&EchoObject::size, this, _1));
+		registerMethod("slow", boost::bind(&EchoObject::slow, this, _1));
+		registerMethod("callBack", boost::bind(&EchoObject::callBack, this, _1));
+	}
+
+	Variant echo(const Variant &args)
+	{
+		++echoed;
+		return args;
+	}
+
+	Variant size(const Variant &args)
+	{
+		return (int)args.toString().size();
+	}
+
+	//Answered a few milliseconds later, the call stays in flight meanwhile
+	Variant slow(const Variant &args)
+	{
+		if(++pending > maxPending)
+			maxPending = pending;
+		FutureResultPtr result(new FutureResult);
+		boost::shared_ptr<aio::deadline_timer> timer(new aio::deadline_timer(m_iosvc));
+		timer->expires_from_now(boost::posix_time::milliseconds(2));
+		timer->async_wait(boost::bind(&EchoObject::slowDone, this, result, timer, args));
+		return result;
+	}
+
+	//Answered with what the caller's object answers
+	Variant callBack(const Variant &args)
+	{
+		return args.toObject()->call("value", Variant(), true);
+	}
+
+private:
+	aio::io_service &m_iosvc;
+
+	void slowDone(const FutureResultPtr &result, const boost::shared_ptr<aio::deadline_timer>&, const Variant &args)
+	{
+		--pending;
+		result->callback(args);
+	}
+};
+
+class ValueObject : public LocalObject
+{
+public:
+	ValueObject()
+	{
+		registerMethod("value", boost::bind(&ValueObject::value, this, _1));
+	}
+
+	Variant value(const Variant&)
+	{
+		return 42;
+	}
+};
+
+class LoopbackClient : public AsioClient
+{
+public:
+	boost::function<void()> started;
+
+	LoopbackClient(aio::io_service &iosvc, ObjectsStorage &storage) :
+		AsioClient(iosvc, storage) {
+	}
+
+	boost::shared_ptr<RemoteObject> server()
+	{
+		return boost::static_pointer_cast<RemoteObject, IObject>(globalObject());
+	}
+
+protected:
+	void onStart() override
+	{
+		if(started)
+			started();
+	}
+};
+
+//Set up the server and the client before run, start calls from started
+struct Loopback
+{
+	aio::io_service iosvc;
+	ObjectsStorage serverStorage, clientStorage;
+	boost::shared_ptr<EchoObject> echo;
+	AsioServer server;
+	boost::shared_ptr<LoopbackClient> client;
+	//More clients of the server, connected with client
+	std::vector< boost::shared_ptr<LoopbackClient> > others;
+	//Threads running the service
+	unsigned int threads;
+	bool finished;
+	//Error a connection stopped the loop with
+	string error;
+
+	Loopback() :
+		echo(new EchoObject(iosvc)),
+		server(iosvc, serverStorage),
+		client(new LoopbackClient(iosvc, clientStorage)),
+		threads(1),
+		finished(false)
+	{
+		serverStorage.registerObject(echo, ClientBasePtr(), true);
+	}
+
+	//False when the time is up or a connection fails before done
+	bool run(unsigned short port, int seconds = 10)
+	{
+		server.listen("127.0.0.1", port);
+		client->setEndpoint("127.0.0.1", port);
+		client->connectTcp();
+		for(std::size_t i = 0; i < others.size(); i++)
+		{
+			others[i]->setEndpoint("127.0.0.1", port);
+			others[i]->connectTcp();
+		}
+		aio::deadline_timer timer(iosvc);
+		timer.expires_from_now(boost::posix_time::seconds(seconds));
+		timer.async_wait(boost::bind(&Loopback::timeout, this, aio::placeholders::error));
+		try
+		{
+			runIoService(iosvc, threads);
+		}
+		catch(const std::exception &e)
+		{
+			error = e.what();
+		}
+		return finished;
+	}
+
+	Variant done(const Variant &v = Variant())
+	{
+		finished = true;
+		iosvc.stop();
+		return v;
+	}
+
+	void timeout(const boost::system::error_code &error)
+	{
+		if(!error)
+			iosvc.stop();
+	}
+};
+
+void testFragments()
+{
+	cout << "Fragments" << endl;
+	Loopback loop;
+	loop.server.setFragmentSize(4096);
+	loop.server.setMaxAssembledSize(4*1024*1024);
+	loop.client->setFragmentSize(4096);
+	loop.client->setMaxAssembledSize(4*1024*1024);
+
+	Variant::IntArray ints(100000);
+	for(std::size_t i = 0; i < ints.size(); i++)
+		ints[i] = __int64(i) * 7919;
+	Variant payload = Variant("text", string(1024*1024, 'f')).add("ints", ints).add("name", "loopback");
+	Variant answer;
+	loop.client->started = [&]() {
+		loop.client->server()->call("echo", payload, true).toFuture()->addBoth([&](const Variant &v) -> Variant {
+			answer = v;
+			return loop.done();
+		});
+	};
+	check(loop.run(16301), "a message of 1.4 MB in 4 KB fragments is answered");
+	check(loop.client->wireVersion() == WIRE_V7, "fragments are sent at wire version 7");
+	check(answer.isMap() && answer.item("text").toString() == payload.item("text").toString() &&
+		answer.item("ints").toIntArray() == ints && answer.item("name").toString() == "loopback",
+		"the echoed value is the one sent");
+}
+
+void testFragmentLimit()
+{
+	cout << "Assembled size limit" << endl;
+	Loopback loop;
+	loop.client->setFragmentSize(4096);
+	loop.client->setReconnectTimeout(1);
+	loop.others.push_back(boost::shared_ptr<LoopbackClient>(new LoopbackClient(loop.iosvc, loop.clientStorage)));
+	Variant refused, answer;
+	//The server puts together no more than its max message size by default, it
+	//drops the session and the client learns on reconnecting
+	loop.client->started = [&]() {
+		if(!refused.isNull())
+			return;
+		loop.client->server()->call("size", string(2*1024*1024, 'f'), true).toFuture()->addBoth(
+			[&](const Variant &v) -> Variant {
+				refused = v;
+				loop.others[0]->server()->call("echo", "after", true).toFuture()->addBoth(
+					[&](const Variant &v) -> Variant {
+						answer = v;
+						return loop.done();
+					});
+				return Variant();
+			});
+	};
+	check(loop.run(16302), "the server goes on after a message of 2 MB");
+	check(loop.error.empty(), "nothing escapes the server's loop");
+	check(refused.isException(), "the call of 2 MB fails with its connection");
+	check(answer.isString() && answer.toString() == "after", "another client is answered");
+}
+
+void testPriorities()
+{
+	cout << "Priority classes" << endl;
+	Loopback loop;
+	loop.server.setFragmentSize(16*1024);
+	loop.client->setFragmentSize(16*1024);
+	const int count = 8;
+	int answered = 0, controlAt = -1;
+	loop.client->started = [&]() {
+		boost::shared_ptr<RemoteObject> server = loop.client->server();
+		for(int i = 0; i < count; i++)
+		{
+			server->call(PRIORITY_BULK, "size", string(512*1024, 'b'), true).toFuture()->addBoth(
+				[&](const Variant &v) -> Variant {
+					if(++answered == count)
+						loop.done();
+					return v;
+				});
+		}
+		server->call(PRIORITY_CONTROL, "echo", "control", true).toFuture()->addBoth(
+			[&](const Variant &v) -> Variant {
+				controlAt = answered;
+				return v;
+			});
+	};
+	check(loop.run(16303), "bulk calls are answered");
+	check(controlAt >= 0 && controlAt < count / 2,
+		(boost::format("a control call sent last is answered after %1% of %2% bulk calls") % controlAt % count).str());
+}
+
+void testCredit()
+{
+	cout << "Credit" << endl;
+	Loopback loop;
+	loop.server.setReceiveWindow(64*1024, 2);
+	const int count = 20;
+	int answered = 0;
+	std::size_t held = 0;
+	loop.client->started = [&]() {
+		for(int i = 0; i < count; i++)
+		{
+			loop.client->server()->call("slow", string(16*1024, 'c'), true).toFuture()->addBoth(
+				[&](const Variant &v) -> Variant {
+					if(v.isString() && v.toString().size() == 16*1024 && ++answered == count)
+						loop.done();
+					return v;
+				});
+		}
+		held = loop.client->queuedMessages();
+	};
+	check(loop.run(16304), "every call is answered");
+	check(loop.echo->maxPending <= 2,
+		(boost::format("%1% calls were in flight at the server with a window of 2") % loop.echo->maxPending).str());
+	check(held > 0, "calls out of credit wait at the client");
+}
+
+void testCreditCallbacks()
+{
+	cout << "Credit with calls back" << endl;
+	//Both peers are out of credit while they wait for the other's answers, the
+	//answers still go
+	Loopback loop;
+	loop.server.setReceiveWindow(64*1024, 1);
+	loop.client->setReceiveWindow(64*1024, 1);
+	const int count = 6;
+	int answered = 0;
+	IObjectPtr value(new ValueObject);
+	loop.client->started = [&]() {
+		for(int i = 0; i < count; i++)
+		{
+			loop.client->server()->call("callBack", value, true).toFuture()->addBoth(
+				[&](const Variant &v) -> Variant {
+					if(v.isInt() && v.toInt() == 42 && ++answered == count)
+						loop.done();
+					return v;
+				});
+		}
+	};
+	bool finished = loop.run(16305, 5);
+	check(finished, (boost::format("%1% of %2% calls calling back are answered") % answered % count).str());
+}
+
+void testThreads()
+{
+	cout << "Connections on several threads" << endl;
+	Loopback loop;
+	loop.threads = 4;
+	const int clients = 4, count = 200;
+	boost::detail::atomic_count answered(0), failed(0);
+	for(int i = 1; i < clients; i++)
+		loop.others.push_back(boost::shared_ptr<LoopbackClient>(new LoopbackClient(loop.iosvc, loop.clientStorage)));
+
+	//Every client sends its calls as it starts, the answers come on any thread
+	boost::function<void(LoopbackClient*)> start = [&](LoopbackClient *client) {
+		for(int i = 0; i < count; i++)
+		{
+			client->server()->call("echo", i, true).toFuture()->addBoth(
+				[&, i](const Variant &v) -> Variant {
+					if(!v.isInt() || v.toInt() != i)
+						++failed;
+					if(++answered == clients * count)
+						loop.done();
+					return v;
+				});
+		}
+	};
+	loop.client->started = boost::bind(start, loop.client.get());
+	for(std::size_t i = 0; i < loop.others.size(); i++)
+		loop.others[i]->started = boost::bind(start, loop.others[i].get());
+	bool finished = loop.run(16309);
+	check(finished, (boost::format("%1% of %2% calls are answered") % long(answered) % (clients * count)).str());
+	check(long(failed) == 0, "every answer is the value sent");
+	check(loop.echo->echoed == clients * count, "calls to one object run one at a time");
+}
+
+void testVersion(const char *name, unsigned short port, WireVersion server, WireVersion client, WireVersion expected)
+{
+	cout << "Wire version " << name << endl;
+	Loopback loop;
+	loop.server.setMaxWireVersion(server);
+	loop.client->setMaxWireVersion(client);
+	WireVersion started = WIRE_V1;
+	Variant answer;
+	loop.client->started = [&]() {
+		started = loop.client->wireVersion();
+		loop.client->server()->call("echo", Variant("key", "value").add("ints", Variant::IntArray(4, 1)), true).toFuture()->addBoth(
+			[&](const Variant &v) -> Variant {
+				answer = v;
+				return loop.done();
+			});
+	};
+	check(loop.run(port), "the call is answered");
+	check(started == expected, (boost::format("version %1% is agreed on") % int(started)).str());
+	check(answer.isMap() && answer.item("key").toString() == "value" &&
+		answer.item("ints").toIntArray(true) == Variant::IntArray(4, 1), "the value goes both ways");
+}
+
+}
+
+int runLoopbackTests()
+{
+	testFragments();
+	testFragmentLimit();
+	testPriorities();
+	testCredit();
+	testCreditCallbacks();
+	testThreads();
+	testVersion("of the server", 16306, WIRE_V5, WIRE_V7, WIRE_V5);
+	testVersion("of the client", 16307, WIRE_V7, WIRE_V4, WIRE_V4);
+	testVersion("of an old server", 16308, WIRE_V1, WIRE_V7, WIRE_V1);
+	cout << (failures ? "Failed checks: " : "All checks passed") ;
+	if(failures)
+		cout << failures;
+	cout << endl;
+	return failures;
+}
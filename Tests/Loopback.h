@@ -0,0 +1,6 @@
+﻿#pragma once
+
+//A server and a client talking over a local port: fragments, priority classes,
+//credit, connections served on several threads and wire version negotiation.
+//Run by "Tests loopback", returns the number of failed checks
+int runLoopbackTests();
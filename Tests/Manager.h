@@ -1,11 +1,11 @@
 ﻿#pragma once
 
-#include "transport.h"
+#include "asio_transport.h"
 
-class ManagerClient : public DualRPC::Client
+class ManagerClient : public DualRPC::AsioClient
 {
 public:
 	ManagerClient(boost::asio::io_service &iosvc, DualRPC::ObjectsStorage &storage) : 
-		DualRPC::Client(iosvc, storage) {
+		DualRPC::AsioClient(iosvc, storage) {
 	}
 };
\ No newline at end of file
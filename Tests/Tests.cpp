@@ -5,12 +5,14 @@
 
 #include "variant.h"
 #include "objects.h"
-#include "transport.h"
+#include "asio_transport.h"
 #include "logger.h"
 
 #include "Actor.h"
 #include "Manager.h"
 #include "ServerObject.h"
+#include "Benchmarks.h"
+#include "Loopback.h"
 
 #include <iostream>
 #include <locale>
@@ -40,15 +42,23 @@ int _tmain(int argc, _TCHAR* argv[])
 {
 	initLogger();
 
+	if(argc > 1 && _tcscmp(argv[1], _T("bench")) == 0)
+	{
+		runBenchmarks();
+		return 0;
+	}
+	if(argc > 1 && _tcscmp(argv[1], _T("loopback")) == 0)
+		return runLoopbackTests();
+
 	boost::asio::io_service io_service;	
 
 	//Server
 	ObjectsStorage serverStorage;
-	serverStorage.registerObject(IObjectPtr(new ServerObject), nullptr, true);
+	serverStorage.registerObject(IObjectPtr(new ServerObject), ClientBasePtr(), true);
 
-	Server server(io_service, serverStorage);
+	AsioServer server(io_service, serverStorage);
 	server.setMaxMessageSize(50*1024*1024);
-	server.asyncListenTcp("0.0.0.0", 6000);
+	server.listen("0.0.0.0", 6000);
 
 	//Actor
 	ObjectsStorage actorStorage;